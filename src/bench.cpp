@@ -0,0 +1,295 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "corpus.hpp"
+#include "host_encoder.hpp"
+#include "kernel_decoder.hpp"
+
+// Encodes and decodes synthetic corpora of growing sizes on the device image
+// and writes the numbers as JSON.
+//   bench <results.json> [max size] [chunk MiB] [corpus ...]
+// Sizes go from 4K up to max size by factors of 4. A size takes a K, M or G
+// suffix, and defaults to 1M in emulation and 4G on hardware. The corpora
+// default to all of uniform, zipf, runs, fastq and incompressible.
+//
+// Throughputs are in MiB/s of input:
+//   kernel_encode   coder kernels only, as "encoding thpt" in decoder
+//   e2e_encode      StreamingEncoder::Encode, without generating the corpus,
+//                   into a sink that only counts the chunks
+//   kernel_decode   decoder kernels only, as "decoding thpt" in decoder
+//   e2e_decode      buffer setup, transfers, kernels and joining the lanes
+//   host_decode     FastHostDecoder on its threads
+// The decoders run on a second encoding pass, so that their time never
+// overlaps the timed encode, the device ones on kDecodeBatch chunks at a
+// time.
+// With PERF_COUNTERS, every result also has the kernel counters as "perf".
+//
+// "precision", "engine" and "transform" in the config are the coder
+// precision, engine and symbol transform of the image, "barrel_depth" the
+// slots of its barrel decoder, 0 without one. "ratio_by_precision"
+// gives the ratio of every CoderPrecision of the range engine from
+// HostStreamEncoder, exact division included, "ratio_by_engine" the ratio of
+// every CoderEngine, the range engine with the precision of the image, and
+// "ratio_by_transform" the ratio of every SymbolTransform of the range engine
+// with the precision of the image. The fmax and area of an image are in the
+// reports of its build, one per setting of the precision, engine and
+// transform options.
+
+#ifdef FPGA_EMULATOR
+constexpr size_t kDefaultMaxSize = size_t(1) << 20;
+#else
+constexpr size_t kDefaultMaxSize = size_t(4) << 30;
+#endif
+constexpr size_t kMinSize = 4 << 10;
+
+struct BenchResult {
+  CorpusKind corpus;
+  size_t size;
+  size_t n_chunks;
+  size_t compressed_size;
+  double kernel_encode_seconds;
+  double e2e_encode_seconds;
+  double kernel_decode_seconds;
+  double e2e_decode_seconds;
+  double host_decode_seconds;
+  size_t compressed_by_precision[size_t(CoderPrecision::kCount)];
+  size_t compressed_by_engine[size_t(CoderEngine::kCount)];
+  size_t compressed_by_transform[size_t(SymbolTransform::kCount)];
+  bool ok;
+  // kernel counters with PERF_COUNTERS
+  PerfReport perf;
+};
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+size_t ParseSize(const std::string &s) {
+  size_t end;
+  size_t size = std::stoull(s, &end);
+  switch (end < s.size() ? s[end] : ' ') {
+    case 'G': case 'g': return size << 30;
+    case 'M': case 'm': return size << 20;
+    case 'K': case 'k': return size << 10;
+    default: return size;
+  }
+}
+
+BenchResult Run(queue &q, CorpusKind corpus, size_t size, size_t chunk_size) {
+  BenchResult r{corpus, size};
+  PerfReport decode_perf;
+  r.ok = true;
+
+  // the sink of chunk k runs while chunk k+1 is on the device, so the timed
+  // pass only counts
+  Encoder encoder(q, chunk_size);
+  CorpusBuf corpus_buf(corpus, size);
+  std::istream input(&corpus_buf);
+  auto encode_start = std::chrono::steady_clock::now();
+  size_t total = encoder.Encode(
+      input, [&](const MultiStream &stream, const uchar *, size_t) {
+        r.n_chunks++;
+        r.compressed_size += stream.size();
+      });
+  r.e2e_encode_seconds =
+      Seconds(encode_start) - corpus_buf.GenerateSeconds();
+  r.kernel_encode_seconds = encoder.EncodingSeconds();
+  r.ok &= total == size;
+  r.perf = encoder.Perf();
+
+  // the same chunks again, decoded and checked, kDecodeBatch at a time on
+  // the device, so that the barrel decoder has a lane for every slot
+  std::vector<MultiStream> batch;
+  std::vector<vector<uchar>> batch_in;
+  std::vector<vector<uchar>> batch_out(kDecodeBatch, vector<uchar>(chunk_size));
+  vector<uchar> decoded(chunk_size);
+  auto decode_batch = [&] {
+    std::vector<uchar *> outs;
+    for (auto &out : batch_out) {
+      outs.push_back(out.data());
+    }
+    auto start = std::chrono::steady_clock::now();
+    r.kernel_decode_seconds += KernelDecodeMultiStreams(
+        q, batch.data(), outs.data(), batch.size(), chunk_size, decode_perf);
+    r.e2e_decode_seconds += Seconds(start);
+    for (size_t c = 0; c < batch.size(); ++c) {
+      r.ok &= std::equal(batch_in[c].begin(), batch_in[c].end(),
+                         batch_out[c].begin());
+    }
+    batch.clear();
+    batch_in.clear();
+  };
+  CorpusBuf check_buf(corpus, size);
+  std::istream check_input(&check_buf);
+  encoder.Encode(
+      check_input, [&](const MultiStream &stream, const uchar *in, size_t n) {
+        if constexpr (kEngine == CoderEngine::kRans) {
+          r.ok &= RansTablesFit(stream, in);
+        }
+
+        batch.push_back(stream);
+        batch_in.emplace_back(in, in + n);
+        if (batch.size() == kDecodeBatch) {
+          decode_batch();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        FastHostDecode(stream, decoded.data(), chunk_size);
+        r.host_decode_seconds += Seconds(start);
+        r.ok &= memcmp(decoded.data(), in, n) == 0;
+      });
+  if (!batch.empty()) {
+    decode_batch();
+  }
+  r.perf.Add(decode_perf);
+
+  auto host_compressed_size = [&](CoderPrecision precision,
+                                  CoderEngine engine,
+                                  SymbolTransform transform) {
+    CorpusBuf host_buf(corpus, size);
+    std::istream host_input(&host_buf);
+    // the binary and rANS engines have no context order
+    HostStreamEncoder<kNCoders, Alphabets> host_encoder(
+        chunk_size, std::thread::hardware_concurrency(),
+        engine == CoderEngine::kRange ? kOrder : ContextOrder::kOrder0,
+        precision, engine, transform);
+    size_t compressed = 0;
+    host_encoder.Encode(host_input,
+                        [&](const MultiStream &stream, const uchar *, size_t) {
+                          compressed += stream.size();
+                        });
+    return compressed;
+  };
+  for (uint p = 0; p < uint(CoderPrecision::kCount); ++p) {
+    r.compressed_by_precision[p] = host_compressed_size(
+        CoderPrecision(p), CoderEngine::kRange, SymbolTransform::kNone);
+  }
+  for (uint e = 0; e < uint(CoderEngine::kCount); ++e) {
+    r.compressed_by_engine[e] = host_compressed_size(
+        Precision::kId, CoderEngine(e), SymbolTransform::kNone);
+  }
+  for (uint t = 0; t < uint(SymbolTransform::kCount); ++t) {
+    r.compressed_by_transform[t] = host_compressed_size(
+        Precision::kId, CoderEngine::kRange, SymbolTransform(t));
+  }
+  return r;
+}
+
+void WriteJson(FILE *f, const std::vector<BenchResult> &results,
+               size_t chunk_size) {
+  auto mibps = [](size_t size, double seconds) {
+    return seconds > 0 ? size / seconds / 1024 / 1024 : 0;
+  };
+  fprintf(f, "{\n  \"config\": {\"lanes\": %u, \"order\": %u, "
+             "\"precision\": \"%s\", \"engine\": \"%s\", "
+             "\"transform\": \"%s\", \"fastq_mode\": %s, "
+             "\"barrel_depth\": %u, \"chunk_size\": %zu, \"emulator\": %s},\n",
+          kNLanes, uint(kOrder), Precision::kName, EngineName(kEngine),
+          TransformName(kTransform),
+#ifdef FASTQ_MODE
+          "true",
+#else
+          "false",
+#endif
+          kBarrelDecoder ? kBarrelDepth : 0, chunk_size,
+#ifdef FPGA_EMULATOR
+          "true");
+#else
+          "false");
+#endif
+  fprintf(f, "  \"results\": [\n");
+  for (size_t k = 0; k < results.size(); ++k) {
+    const auto &r = results[k];
+    fprintf(f,
+            "    {\"corpus\": \"%s\", \"size\": %zu, \"chunks\": %zu, "
+            "\"compressed_size\": %zu, \"ratio\": %.6f, "
+            "\"kernel_encode_mibps\": %.4f, \"e2e_encode_mibps\": %.4f, "
+            "\"kernel_decode_mibps\": %.4f, \"e2e_decode_mibps\": %.4f, "
+            "\"host_decode_mibps\": %.4f, \"ok\": %s",
+            CorpusName(r.corpus), r.size, r.n_chunks, r.compressed_size,
+            r.compressed_size * 1.0 / r.size,
+            mibps(r.size, r.kernel_encode_seconds),
+            mibps(r.size, r.e2e_encode_seconds),
+            mibps(r.size, r.kernel_decode_seconds),
+            mibps(r.size, r.e2e_decode_seconds),
+            mibps(r.size, r.host_decode_seconds), r.ok ? "true" : "false");
+    fprintf(f, ", \"ratio_by_precision\": {");
+    for (uint p = 0; p < uint(CoderPrecision::kCount); ++p) {
+      fprintf(f, "%s\"%s\": %.6f", p > 0 ? ", " : "",
+              PrecisionName(CoderPrecision(p)),
+              r.compressed_by_precision[p] * 1.0 / r.size);
+    }
+    fprintf(f, "}, \"ratio_by_engine\": {");
+    for (uint e = 0; e < uint(CoderEngine::kCount); ++e) {
+      fprintf(f, "%s\"%s\": %.6f", e > 0 ? ", " : "",
+              EngineName(CoderEngine(e)),
+              r.compressed_by_engine[e] * 1.0 / r.size);
+    }
+    fprintf(f, "}, \"ratio_by_transform\": {");
+    for (uint t = 0; t < uint(SymbolTransform::kCount); ++t) {
+      fprintf(f, "%s\"%s\": %.6f", t > 0 ? ", " : "",
+              TransformName(SymbolTransform(t)),
+              r.compressed_by_transform[t] * 1.0 / r.size);
+    }
+    fprintf(f, "}");
+    if (kPerfCounters) {
+      fprintf(f, ", \"perf\": ");
+      r.perf.WriteJson(f);
+    }
+    fprintf(f, "}%s\n", k + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("usage: %s <results.json> [max size] [chunk MiB] [corpus ...]\n",
+           argv[0]);
+    return 1;
+  }
+  size_t max_size = argc > 2 ? ParseSize(argv[2]) : kDefaultMaxSize;
+  size_t chunk_size = argc > 3 ? std::stoul(argv[3]) << 20 : kChunkSize;
+  std::vector<CorpusKind> corpora;
+  for (int a = 4; a < argc; ++a) {
+    uint kind = 0;
+    while (kind < uint(CorpusKind::kCount) &&
+           argv[a] != std::string(CorpusName(CorpusKind(kind)))) {
+      kind++;
+    }
+    if (kind == uint(CorpusKind::kCount)) {
+      throw std::runtime_error("unknown corpus " + std::string(argv[a]));
+    }
+    corpora.push_back(CorpusKind(kind));
+  }
+  if (corpora.empty()) {
+    for (uint kind = 0; kind < uint(CorpusKind::kCount); ++kind) {
+      corpora.push_back(CorpusKind(kind));
+    }
+  }
+
+  auto q = CreateQueue();
+  std::vector<BenchResult> results;
+  bool all_ok = true;
+  for (auto corpus : corpora) {
+    for (size_t size = kMinSize; size <= max_size; size *= 4) {
+      results.push_back(Run(q, corpus, size, chunk_size));
+      const auto &r = results.back();
+      all_ok &= r.ok;
+      printf("%s %zu bytes: ratio %.4f, %s\n", CorpusName(corpus), size,
+             r.compressed_size * 1.0 / size, r.ok ? "ok" : "FAILED");
+    }
+  }
+
+  FILE *f = fopen(argv[1], "w");
+  if (!f) {
+    throw std::runtime_error("cannot open results file");
+  }
+  WriteJson(f, results, chunk_size);
+  fclose(f);
+  return all_ok ? 0 : 1;
+}
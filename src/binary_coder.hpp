@@ -0,0 +1,229 @@
+#ifndef BINARY_CODER_HPP_
+#define BINARY_CODER_HPP_
+#include "range_decoder.hpp"
+#include "range_encoder.hpp"
+
+// A second coding engine in the style of LZMA's range coder. A symbol of a
+// kNSymbol alphabet is coded as log2(kNSymbol) binary decisions, walking a
+// bit tree from the root, and every node has a probability of a zero with
+// kProbBits bits. The interval is split with one multiply, (range >>
+// kProbBits) * prob, and the probability moves by 1/2^kMoveBits of the
+// distance to the coded bit with a shift. There is no reciprocal and no
+// prefix sum over the alphabet.
+//
+// low, range and the bytes they produce follow RangeCoder, so the lanes go
+// through the same Store, the same container and the same feed into the
+// decoder kernels.
+
+constexpr uint kProbBits = 12;
+constexpr uint kMoveBits = 5;
+constexpr ushort kProbInit = 1 << (kProbBits - 1);
+
+// The probabilities of the inner nodes of a kNSymbol-leaf bit tree. Node 1
+// is the root, and node n has children 2n and 2n + 1.
+template <uint kNSymbol>
+struct BitTreeModel {
+  static_assert((kNSymbol & (kNSymbol - 1)) == 0,
+                "the bit tree needs a power-of-two alphabet");
+  static constexpr uint kBits = Log2(kNSymbol);
+
+  ushort probs[kNSymbol];
+
+  void Init() {
+#pragma unroll
+    for (uint i = 0; i < kNSymbol; ++i) {
+      probs[i] = kProbInit;
+    }
+  }
+};
+
+// The part of range that codes a zero.
+inline uint BinaryBound(uint range, ushort prob) {
+  return (range >> kProbBits) * prob;
+}
+
+inline ushort AdaptProb(ushort prob, bool bit) {
+  return bit ? prob - (prob >> kMoveBits)
+             : prob + (((1 << kProbBits) - prob) >> kMoveBits);
+}
+
+// Codes the symbols of kNCoders lanes from InPipes, one binary decision per
+// lane and cycle. A lane reads its next symbol when the last bit of the
+// previous one is coded.
+template <typename InPipes, uint kNCoders, uint kNSymbol>
+struct BinaryCoder {
+  using Model = BitTreeModel<kNSymbol>;
+
+  void operator()() const {
+    Model models[kNCoders];
+    ulong low[kNCoders];
+    uint range[kNCoders];
+    bool can_continue[kNCoders];
+    uchar symbol[kNCoders];
+    ac_int<Log2(kNSymbol) + 1, false> node[kNCoders];
+    ac_int<Log2(Model::kBits) + 1, false> bits_left[kNCoders];
+#pragma unroll
+    for (int i = 0; i < kNCoders; i++) {
+      models[i].Init();
+      can_continue[i] = true;
+      low[i] = 0;
+      range[i] = (uint)-1;
+      bits_left[i] = 0;
+    }
+
+    // extend 2 loops for sending low out after all done
+    bool do_ouput_low[2] = {false, false};
+    bool alive = true;
+    PerfCounters perf;
+    perf.Init();
+
+    while (alive) {
+      bool alive_exists = false;
+      bool carries[kNCoders];
+      bool coded[kNCoders];
+      perf.Cycle();
+      fpga_tools::UnrolledLoop<0, kNCoders>([&](auto i) {
+        carries[i] = false;
+        // a finished lane must not consume the next job's symbols
+        if (bits_left[i] == 0 && can_continue[i]) {
+          bool read_success = false;
+          auto [data, done] = InPipes::template read<i>(read_success);
+          perf.EmptyRead(!read_success);
+          if (read_success) {
+            can_continue[i] = !done;
+            symbol[i] = data;
+            node[i] = 1;
+            bits_left[i] = done ? 0 : Model::kBits;
+          }
+        }
+        coded[i] = bits_left[i] > 0;
+        if (coded[i]) {
+          bool bit = (symbol[i] >> (bits_left[i] - 1)) & 1;
+          ushort prob = models[i].probs[node[i]];
+          uint bound = BinaryBound(range[i], prob);
+          if (bit) {
+            carries[i] = AddToLow(low[i], bound);
+            range[i] -= bound;
+          } else {
+            range[i] = bound;
+          }
+          models[i].probs[node[i]] = AdaptProb(prob, bit);
+          node[i] = node[i] * 2 + bit;
+          bits_left[i] = bits_left[i] - 1;
+        }
+      });
+      fpga_tools::UnrolledLoop<0, kNCoders>([&](auto i) {
+        alive_exists = alive_exists || can_continue[i] || bits_left[i] > 0;
+      });
+
+      do_ouput_low[1] = do_ouput_low[0];
+      alive = !do_ouput_low[1];
+      do_ouput_low[0] = !alive_exists;
+
+      std::array<RangeOutput, kNCoders> out_buffers;
+      fpga_tools::UnrolledLoop<0, kNCoders>([&](auto i) {
+        RangeOutput out = Normalize(low[i], range[i]);
+        perf.Renorm(coded[i], out.size);
+        perf.Carry(carries[i]);
+
+        if (do_ouput_low[0]) {
+          out = FlushLow<kRangeOutSize>(low[i], do_ouput_low[1]);
+        }
+        out.carry = carries[i];
+        out_buffers[i] = out;
+      });
+
+      RangePipe<kNCoders>::write({out_buffers, do_ouput_low[1]});
+    }
+    perf.Send<InPipes>();
+  }
+};
+
+// BinaryCoder with the model size picked at launch.
+template <typename InPipes, uint kNCoders, typename Alphabets>
+struct AlphabetBinaryCoder {
+  uint alphabet;  // index into Alphabets
+
+  void operator()() const {
+    fpga_tools::UnrolledLoop<Alphabets::kCount>([&](auto a) {
+      if (a == alphabet) {
+        BinaryCoder<InPipes, kNCoders, Alphabets::Size(a)>{}();
+      }
+    });
+  }
+};
+
+// Decodes a lane of BinaryCoder, one binary decision per cycle, from the
+// pipes RangeDecoderKernel<kLane> reads.
+template <uint kNSymbol, uint kLane = 0>
+struct BinaryDecoderKernel {
+  using Model = BitTreeModel<kNSymbol>;
+
+  void operator()() const {
+    Model model;
+    model.Init();
+    ac_int<Log2(kNSymbol) + 1, false> node = 1;
+    uint range = (uint)-1;
+    uint4 init = RCInitPipes::read<kLane>();
+    uint num_symbol = init[0];
+    uint code = init[1];
+    RCInputStream input_stream{init[2], kRangeOutSize};
+    uint num_words = init[3];
+    uint words_read = 0;
+    PerfCounters perf;
+    perf.Init();
+
+    for (uint s = 0; s < num_symbol;) {
+      perf.Cycle();
+      ushort prob = model.probs[node];
+      uint bound = BinaryBound(range, prob);
+      bool bit = code >= bound;
+      if (bit) {
+        code -= bound;
+        range -= bound;
+      } else {
+        range = bound;
+      }
+      model.probs[node] = AdaptProb(prob, bit);
+      node = node * 2 + bit;
+
+      uchar stream_size = input_stream.size;
+      UpdateRange(range, code, input_stream);
+      perf.Renorm(true, stream_size - input_stream.size);
+
+      if (input_stream.size <= kRangeOutSize) {
+        UintRCVecx2 in = RCDataInPipes::read<kLane>();
+        input_stream.bits |= in << (input_stream.size * 8);
+        input_stream.size += kRangeOutSize;
+        words_read++;
+      }
+
+      if (node >= kNSymbol) {
+        SymbolOutPipes::write<kLane>(node - kNSymbol);
+        node = 1;
+        s++;
+      }
+    }
+    // leave the data pipe empty for the next stream
+    for (; words_read < num_words; ++words_read) {
+      RCDataInPipes::read<kLane>();
+    }
+    perf.Send<RCDataInPipes::PipeAt<kLane>>();
+  }
+};
+
+// BinaryDecoderKernel with the model size picked at launch.
+template <typename Alphabets, uint kLane = 0>
+struct AlphabetBinaryDecoderKernel {
+  uint alphabet;  // index into Alphabets
+
+  void operator()() const {
+    fpga_tools::UnrolledLoop<Alphabets::kCount>([&](auto a) {
+      if (a == alphabet) {
+        BinaryDecoderKernel<Alphabets::Size(a), kLane>{}();
+      }
+    });
+  }
+};
+
+#endif  // BINARY_CODER_HPP_
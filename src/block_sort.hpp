@@ -0,0 +1,330 @@
+#ifndef BLOCK_SORT_HPP_
+#define BLOCK_SORT_HPP_
+#include <algorithm>
+#include <vector>
+
+#include "range_coding.h"
+
+// The block-sorting transform: the Burrows-Wheeler transform of every lane
+// on the host, then move-to-front on the device in front of the model. The
+// BWT puts the symbols that precede equal contexts next to each other, and
+// move-to-front turns that locality into small indices, mostly 0, which an
+// order-0 model codes well.
+//
+// A lane is one BWT block. Its payload starts with the 4-byte primary index
+// of the block, the row of the sorted rotations that holds the lane itself,
+// ahead of the coded indices. Ranking bytes keeps their order, so the BWT of
+// the bytes ranks to the BWT of the ranks.
+
+namespace block_sort_internal {
+
+// Counts of every symbol of s, as the start or the end of its bucket in the
+// suffix array.
+template <typename T>
+void GetBuckets(const T *s, int n, int k, std::vector<int> &buckets,
+                bool end) {
+  std::fill(buckets.begin(), buckets.end(), 0);
+  for (int i = 0; i < n; ++i) {
+    buckets[s[i]]++;
+  }
+  for (int c = 0, sum = 0; c <= k; ++c) {
+    sum += buckets[c];
+    buckets[c] = end ? sum : sum - buckets[c];
+  }
+}
+
+// SA-IS (Nong, Zhang and Chan): the suffix array of the n symbols of s,
+// which are in [0, k] and end with a unique 0.
+template <typename T>
+void SuffixArray(const T *s, int *sa, int n, int k) {
+  // stype[i]: suffix i is smaller than suffix i + 1
+  std::vector<bool> stype(n);
+  stype[n - 1] = true;
+  for (int i = n - 2; i >= 0; --i) {
+    stype[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && stype[i + 1]);
+  }
+  auto is_lms = [&](int i) { return i > 0 && stype[i] && !stype[i - 1]; };
+
+  std::vector<int> buckets(k + 1);
+  auto induce = [&] {
+    GetBuckets(s, n, k, buckets, false);
+    for (int i = 0; i < n; ++i) {
+      int j = sa[i] - 1;
+      if (sa[i] > 0 && !stype[j]) {
+        sa[buckets[s[j]]++] = j;
+      }
+    }
+    GetBuckets(s, n, k, buckets, true);
+    for (int i = n - 1; i >= 0; --i) {
+      int j = sa[i] - 1;
+      if (sa[i] > 0 && stype[j]) {
+        sa[--buckets[s[j]]] = j;
+      }
+    }
+  };
+
+  // sort the LMS substrings
+  GetBuckets(s, n, k, buckets, true);
+  std::fill(sa, sa + n, -1);
+  for (int i = 1; i < n; ++i) {
+    if (is_lms(i)) {
+      sa[--buckets[s[i]]] = i;
+    }
+  }
+  induce();
+
+  // name them in sorted order, equal substrings with equal names
+  int n1 = 0;
+  for (int i = 0; i < n; ++i) {
+    if (is_lms(sa[i])) {
+      sa[n1++] = sa[i];
+    }
+  }
+  std::fill(sa + n1, sa + n, -1);
+  int names = 0;
+  for (int i = 0, prev = -1; i < n1; ++i) {
+    int pos = sa[i];
+    bool diff = false;
+    for (int d = 0; d < n; ++d) {
+      if (prev == -1 || s[pos + d] != s[prev + d] ||
+          stype[pos + d] != stype[prev + d]) {
+        diff = true;
+        break;
+      }
+      if (d > 0 && (is_lms(pos + d) || is_lms(prev + d))) {
+        break;
+      }
+    }
+    if (diff) {
+      names++;
+      prev = pos;
+    }
+    sa[n1 + pos / 2] = names - 1;
+  }
+  for (int i = n - 1, j = n - 1; i >= n1; --i) {
+    if (sa[i] >= 0) {
+      sa[j--] = sa[i];
+    }
+  }
+
+  // sort the LMS suffixes by their names, recursively while names repeat
+  int *s1 = sa + n - n1;
+  if (names < n1) {
+    SuffixArray(s1, sa, n1, names - 1);
+  } else {
+    for (int i = 0; i < n1; ++i) {
+      sa[s1[i]] = i;
+    }
+  }
+
+  // and induce the whole array from them
+  for (int i = 1, j = 0; i < n; ++i) {
+    if (is_lms(i)) {
+      s1[j++] = i;
+    }
+  }
+  for (int i = 0; i < n1; ++i) {
+    sa[i] = s1[sa[i]];
+  }
+  std::fill(sa + n1, sa + n, -1);
+  GetBuckets(s, n, k, buckets, true);
+  for (int i = n1 - 1; i >= 0; --i) {
+    int j = sa[i];
+    sa[i] = -1;
+    sa[--buckets[s[j]]] = j;
+  }
+  induce();
+}
+
+}  // namespace block_sort_internal
+
+// The BWT of the n bytes at in, to out. Returns the primary index.
+inline uint BlockSort(const uchar *in, uint n, uchar *out) {
+  if (n == 0) {
+    return 0;
+  }
+  // the end of the block sorts before every byte
+  std::vector<int> text(n + 1);
+  for (uint k = 0; k < n; ++k) {
+    text[k] = in[k] + 1;
+  }
+  text[n] = 0;
+  std::vector<int> sa(n + 1);
+  block_sort_internal::SuffixArray(text.data(), sa.data(), n + 1, 256);
+
+  // sa[0] is the end itself, the row that precedes the block's first byte
+  uint primary = 0;
+  uchar *p = out;
+  *p++ = in[n - 1];
+  for (uint i = 1; i <= n; ++i) {
+    if (sa[i] == 0) {
+      primary = i;
+    } else {
+      *p++ = in[sa[i] - 1];
+    }
+  }
+  return primary;
+}
+
+// Turns the BWT of n bytes with the given primary index back into the
+// block, in place.
+inline void UndoBlockSort(uchar *data, uint n, uint primary) {
+  if (n == 0) {
+    return;
+  }
+  // row i of the last column, with the end at row primary
+  auto last = [&](uint i) { return data[i < primary ? i : i - 1]; };
+  uint starts[256] = {0};
+  for (uint k = 0; k < n; ++k) {
+    starts[data[k]]++;
+  }
+  // the first column has the end at row 0, then the bytes in order
+  for (uint c = 0, sum = 1; c < 256; ++c) {
+    uint count = starts[c];
+    starts[c] = sum;
+    sum += count;
+  }
+  std::vector<uint> next(n + 1);
+  for (uint i = 0; i <= n; ++i) {
+    if (i != primary) {
+      next[i] = starts[last(i)]++;
+    }
+  }
+  std::vector<uchar> block(n);
+  for (uint i = 0, k = n; k > 0; i = next[i]) {
+    block[--k] = last(i);
+  }
+  std::copy(block.begin(), block.end(), data);
+}
+
+// Move-to-front of the n symbols at data, in place: every symbol becomes its
+// position in a list that starts in symbol order, and moves to its front.
+inline void MoveToFront(uchar *data, size_t n) {
+  uchar list[256];
+  for (uint c = 0; c < 256; ++c) {
+    list[c] = c;
+  }
+  for (size_t k = 0; k < n; ++k) {
+    uchar symbol = data[k];
+    uchar idx = std::find(list, list + 256, symbol) - list;
+    std::copy_backward(list, list + idx, list + idx + 1);
+    list[0] = symbol;
+    data[k] = idx;
+  }
+}
+
+inline void UndoMoveToFront(uchar *data, size_t n) {
+  uchar list[256];
+  for (uint c = 0; c < 256; ++c) {
+    list[c] = c;
+  }
+  for (size_t k = 0; k < n; ++k) {
+    uchar idx = data[k];
+    uchar symbol = list[idx];
+    std::copy_backward(list, list + idx, list + idx + 1);
+    list[0] = symbol;
+    data[k] = symbol;
+  }
+}
+
+using MoveToFrontPipes =
+    PipeArray<class MtfP, FlagBundle<uchar>, 256, kMaxCoders>;
+using MoveToFrontOutPipes = PipeArray<class MtfOP, uchar, 4, kMaxCoders>;
+
+// MoveToFront of the symbols of InPipe to OutPipe, one per cycle. The list
+// lives in registers: every entry compares with the symbol at once, and the
+// entries in front of it shift by one.
+template <typename InPipe, typename OutPipe, uint kNSymbol>
+struct MoveToFrontEncoder {
+  void operator()() const {
+    uchar list[kNSymbol];
+#pragma unroll
+    for (uint j = 0; j < kNSymbol; ++j) {
+      list[j] = j;
+    }
+    bool done = false;
+    while (!done) {
+      auto in = InPipe::read();
+      done = in.done;
+      uchar idx = 0;
+#pragma unroll
+      for (uint j = 0; j < kNSymbol; ++j) {
+        if (list[j] == in.data) {
+          idx = j;
+        }
+      }
+#pragma unroll
+      for (uint j = kNSymbol - 1; j > 0; --j) {
+        if (j <= idx) {
+          list[j] = list[j - 1];
+        }
+      }
+      list[0] = in.data;
+      OutPipe::write({idx, done});
+    }
+  }
+};
+
+// MoveToFrontEncoder with the model size picked at launch.
+template <typename InPipe, typename OutPipe, typename Alphabets>
+struct AlphabetMoveToFrontEncoder {
+  uint alphabet;  // index into Alphabets
+
+  void operator()() const {
+    fpga_tools::UnrolledLoop<Alphabets::kCount>([&](auto a) {
+      if (a == alphabet) {
+        MoveToFrontEncoder<InPipe, OutPipe, Alphabets::Size(a)>{}();
+      }
+    });
+  }
+};
+
+// The inverse of MoveToFrontEncoder for lane kLane, between the decoder's
+// SymbolOutPipes and MoveToFrontOutPipes.
+template <uint kNSymbol, uint kLane = 0>
+struct MoveToFrontDecoder {
+  uint n_symbols;
+
+  void operator()() const {
+    uchar list[kNSymbol];
+#pragma unroll
+    for (uint j = 0; j < kNSymbol; ++j) {
+      list[j] = j;
+    }
+    for (uint k = 0; k < n_symbols; ++k) {
+      uchar idx = SymbolOutPipes::read<kLane>();
+      uchar symbol = 0;
+#pragma unroll
+      for (uint j = 0; j < kNSymbol; ++j) {
+        if (j == idx) {
+          symbol = list[j];
+        }
+      }
+#pragma unroll
+      for (uint j = kNSymbol - 1; j > 0; --j) {
+        if (j <= idx) {
+          list[j] = list[j - 1];
+        }
+      }
+      list[0] = symbol;
+      MoveToFrontOutPipes::write<kLane>(symbol);
+    }
+  }
+};
+
+// MoveToFrontDecoder with the model size picked at launch.
+template <typename Alphabets, uint kLane = 0>
+struct AlphabetMoveToFrontDecoder {
+  uint alphabet;  // index into Alphabets
+  uint n_symbols;
+
+  void operator()() const {
+    fpga_tools::UnrolledLoop<Alphabets::kCount>([&](auto a) {
+      if (a == alphabet) {
+        MoveToFrontDecoder<Alphabets::Size(a), kLane>{n_symbols}();
+      }
+    });
+  }
+};
+
+#endif  // BLOCK_SORT_HPP_
@@ -0,0 +1,114 @@
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "codec_config.hpp"
+#include "corpus.hpp"
+#include "fast_host_decoder.hpp"
+#include "host_encoder.hpp"
+#include "range_codec.hpp"
+
+// Compresses and decompresses many small objects with one RangeCodec, the
+// way a service would, and reports the rate in objects per second.
+//   codec_bench [object size] [objects] [batch]
+// With a batch above 1, the objects go to CompressBatch that many at a time.
+// The objects cycle through the corpora of bench. Every container must
+// match HostStreamEncoder byte for byte and decode with both the codec and
+// the fast host decoder.
+
+#ifdef FPGA_EMULATOR
+constexpr size_t kDefaultObjects = 50;
+#else
+constexpr size_t kDefaultObjects = 20000;
+#endif
+
+int main(int argc, char **argv) {
+  size_t object_size = argc > 1 ? std::stoul(argv[1]) : 4096;
+  size_t n_objects = argc > 2 ? std::stoul(argv[2]) : kDefaultObjects;
+  size_t batch = argc > 3 ? std::max(std::stoul(argv[3]), 1ul) : 1;
+
+  std::vector<std::vector<uchar>> objects(n_objects);
+  // the objects also packed one after the other, for CompressBatch
+  std::vector<uchar> packed;
+  std::vector<size_t> offsets{0};
+  for (size_t k = 0; k < n_objects; ++k) {
+    CorpusGenerator generator(CorpusKind(k % uint(CorpusKind::kCount)), k);
+    // sizes vary a little, as objects do
+    objects[k].resize(object_size - k % 7 * object_size / 16);
+    generator.Fill(objects[k].data(), objects[k].size());
+    packed.insert(packed.end(), objects[k].begin(), objects[k].end());
+    offsets.push_back(packed.size());
+  }
+
+  RangeCodec<kNCoders, Alphabets, kOrder, SymbolSearch, Precision> codec(
+      object_size * batch, batch);
+  std::vector<MultiStream> streams;
+  auto start = std::chrono::steady_clock::now();
+  if (batch == 1) {
+    for (const auto &object : objects) {
+      streams.push_back(codec.Compress(object.data(), object.size()));
+    }
+  } else {
+    for (size_t k = 0; k < n_objects; k += batch) {
+      auto batch_streams = codec.CompressBatch(
+          packed.data(), offsets.data() + k, std::min(batch, n_objects - k));
+      for (auto &stream : batch_streams) {
+        streams.push_back(std::move(stream));
+      }
+    }
+  }
+  std::chrono::duration<double> compress_seconds =
+      std::chrono::steady_clock::now() - start;
+  size_t total_in = packed.size();
+  size_t total_out = 0;
+  for (const auto &stream : streams) {
+    total_out += stream.size();
+  }
+
+  std::vector<std::vector<uchar>> decoded(n_objects);
+  start = std::chrono::steady_clock::now();
+  for (size_t k = 0; k < n_objects; ++k) {
+    decoded[k] = codec.Decompress(streams[k]);
+  }
+  std::chrono::duration<double> decompress_seconds =
+      std::chrono::steady_clock::now() - start;
+
+  bool codec_ok = decoded == objects;
+  bool host_ok = true;
+  bool same_as_host_encoder = true;
+  for (size_t k = 0; k < n_objects; ++k) {
+    std::vector<uchar> host_out(streams[k].NumSymbols());
+    FastHostDecodeMultiStream(streams[k], host_out.data());
+    host_ok &= host_out == objects[k];
+
+    std::istringstream in(
+        std::string(objects[k].begin(), objects[k].end()));
+    HostStreamEncoder<kNCoders, Alphabets> encoder(
+        std::max(objects[k].size(), size_t(1)), 1, kOrder, Precision::kId);
+    encoder.Encode(in, [&](const MultiStream &stream, const uchar *, size_t) {
+      same_as_host_encoder &=
+          stream.size() == streams[k].size() &&
+          memcmp(stream.data(), streams[k].data(), stream.size()) == 0;
+    });
+  }
+
+  printf("%zu objects of up to %zu bytes, ratio: %.4f\n", n_objects,
+         object_size, total_out * 1.0 / total_in);
+  printf("compress:   %.1f objects/s, %.4f M/s\n",
+         n_objects / compress_seconds.count(),
+         total_in / compress_seconds.count() / 1024 / 1024);
+  printf("decompress: %.1f objects/s, %.4f M/s\n",
+         n_objects / decompress_seconds.count(),
+         total_in / decompress_seconds.count() / 1024 / 1024);
+  if (kPerfCounters) {
+    codec.Perf().Print(stdout);
+  }
+  printf(same_as_host_encoder ? "codec matches host encoder\n"
+                              : "codec differs from host encoder\n");
+  printf(codec_ok ? "codec round trip successfully\n"
+                  : "codec round trip failed\n");
+  printf(host_ok ? "host decode successfully\n" : "host decode failed\n");
+  return codec_ok && host_ok && same_as_host_encoder ? 0 : 1;
+}
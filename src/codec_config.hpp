@@ -0,0 +1,139 @@
+#ifndef CODEC_CONFIG_HPP_
+#define CODEC_CONFIG_HPP_
+#include "binary_coder.hpp"
+#include "block_sort.hpp"
+#include "fastq_encoder.hpp"
+#include "range_decoder.hpp"
+#include "rans_coder.hpp"
+#include "run_length.hpp"
+#include "stream_encoder.hpp"
+
+// Kernel configuration of a device image, chosen by the build options. The
+// decoder and bench executables share it so that both measure the same
+// image.
+
+#ifdef FPGA_REPORT
+using Alphabets = AlphabetSet<4, 32>;
+constexpr uint kNCoders = 2;
+#else
+using Alphabets = AlphabetSet<4, 16, 64, 256>;
+constexpr uint kNCoders = 4;
+#endif
+
+#ifdef ORDER1_MODEL
+constexpr ContextOrder kOrder = ContextOrder::kOrder1;
+#else
+constexpr ContextOrder kOrder = ContextOrder::kOrder0;
+#endif
+
+#ifdef LINEAR_SYMBOL_SEARCH
+using SymbolSearch = LinearSymbolSearch;
+#else
+using SymbolSearch = TreeSymbolSearch;
+#endif
+
+// FIXED_POINT_RECIPROCAL spends a wide multiplier per lane in the coder and
+// the decoders on a closer range / total_freq (see CoderPrecision).
+// POWER_OF_TWO_TOTAL holds total_freq at a power of two instead, so that
+// range / total_freq is a shift and the reciprocal ROM drops out.
+#if defined(FIXED_POINT_RECIPROCAL) && defined(POWER_OF_TWO_TOTAL)
+#error "FIXED_POINT_RECIPROCAL and POWER_OF_TWO_TOTAL are two precisions"
+#elif defined(FIXED_POINT_RECIPROCAL)
+using Precision = FixedPoint32Reciprocal;
+#elif defined(POWER_OF_TWO_TOTAL)
+using Precision = PowerOfTwoTotal;
+#else
+using Precision = Mantissa24Reciprocal;
+#endif
+
+// BARREL_DECODER decodes with one BarrelDecoderKernel of kBarrelDepth slots
+// instead of a RangeDecoderKernel per lane. The slots take the lanes of as
+// many containers of one model size as it takes to fill them, see
+// KernelDecodeMultiStreams, so that BARREL_DEPTH can be the latency of the
+// decoder recurrence whatever the lane count.
+#ifdef BARREL_DEPTH
+constexpr uint kBarrelDepth = BARREL_DEPTH;
+#else
+constexpr uint kBarrelDepth = 32;
+#endif
+#ifdef BARREL_DECODER
+#ifdef FASTQ_MODE
+#error "the barrel decoder needs lanes of one model size, not FASTQ_MODE"
+#endif
+constexpr bool kBarrelDecoder = true;
+#else
+constexpr bool kBarrelDecoder = false;
+#endif
+
+// SYMBOLS_PER_CYCLE above 1 codes that many symbols per lane and cycle
+// with one FusedCoder, instead of a model kernel per lane and a RangeCoder.
+// With RANS_CODER, the RansCoder takes that many per lane and cycle into as
+// many of its states, and has kRansStates times that many states per lane,
+// which the container records. The FASTQ encoder keeps its own kernels.
+#ifdef SYMBOLS_PER_CYCLE
+constexpr uint kSymbolsPerCycle = SYMBOLS_PER_CYCLE;
+#else
+constexpr uint kSymbolsPerCycle = 1;
+#endif
+
+// BINARY_CODER codes and decodes with the binary engine of binary_coder.hpp
+// instead of SimpleModel and the range coder. RANS_CODER does with the
+// interleaved rANS engine of rans_coder.hpp, which trades the adaptive model
+// for a static table per lane and a decoder without a symbol search.
+#ifdef BINARY_CODER
+#if defined(ORDER1_MODEL) || defined(FASTQ_MODE) || defined(BARREL_DECODER)
+#error "the binary engine has no order 1, FASTQ or barrel decoder"
+#endif
+constexpr CoderEngine kEngine = CoderEngine::kBinary;
+#elif defined(RANS_CODER)
+#if defined(ORDER1_MODEL) || defined(FASTQ_MODE) || defined(BARREL_DECODER)
+#error "the rANS engine has no order 1, FASTQ or barrel decoder"
+#endif
+constexpr CoderEngine kEngine = CoderEngine::kRans;
+#else
+constexpr CoderEngine kEngine = CoderEngine::kRange;
+#endif
+
+// RUN_LENGTH codes the lanes as literals and run lengths, see
+// run_length.hpp. It goes through the model kernels of the range engine.
+// BLOCK_SORT codes the move-to-front indices of the BWT of every lane
+// instead, see block_sort.hpp, with the range engine too.
+#if defined(RUN_LENGTH) && defined(BLOCK_SORT)
+#error "one symbol transform at a time"
+#endif
+#if defined(BLOCK_SORT) && \
+    (defined(BINARY_CODER) || defined(RANS_CODER) || defined(FASTQ_MODE))
+#error "the block sort needs the range engine and the plain layout"
+#endif
+#ifdef RUN_LENGTH
+#if defined(BINARY_CODER) || defined(RANS_CODER) || defined(BARREL_DECODER)
+#error "run lengths need the range engine and a decoder per lane"
+#endif
+constexpr SymbolTransform kTransform = SymbolTransform::kRunLength;
+#elif defined(BLOCK_SORT)
+constexpr SymbolTransform kTransform = SymbolTransform::kBlockSort;
+#else
+constexpr SymbolTransform kTransform = SymbolTransform::kNone;
+#endif
+
+// FASTQ_MODE codes records with one lane per field, each with its own
+// alphabet, instead of kNCoders equal lanes. Chunks that are not FASTQ keep
+// the plain layout with as many lanes.
+#ifdef FASTQ_MODE
+constexpr bool kFastqMode = true;
+constexpr uint kNLanes = kFastqLanes;
+template <uint kLane>
+using LaneAlphabets = AlphabetSet<FastqLaneSymbols(kLane)>;
+using Encoder = FastqEncoder<kOrder, Precision, kTransform>;
+#else
+constexpr bool kFastqMode = false;
+constexpr uint kNLanes = kNCoders;
+template <uint kLane>
+using LaneAlphabets = Alphabets;
+using Encoder = StreamingEncoder<kNCoders, Alphabets, kOrder, Precision,
+                                 kSymbolsPerCycle, kEngine, kTransform>;
+#endif
+
+constexpr size_t kChunkSize = 64 << 20;
+
+#endif  // CODEC_CONFIG_HPP_
@@ -0,0 +1,393 @@
+#ifndef CONTAINER_HPP_
+#define CONTAINER_HPP_
+#include <array>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "range_coding.h"
+
+// Layout of a multi-lane stream:
+//   ContainerHeader | LaneEntry[n_lanes] | lane 0 | lane 1 | ...
+// Every lane payload starts on a RangeVector word boundary and is followed by
+// kPadWords zero words, since the kernel decoder reads ahead of the bytes it
+// has consumed. With the rANS engine a lane payload starts with the lane's
+// frequency table (see rans_coder.hpp).
+
+// How the decoded lanes form the output: kPlain concatenates them, kFastq
+// interleaves them into records (see fastq.hpp).
+enum class StreamLayout : uchar { kPlain = 0, kFastq = 1 };
+
+// How the lanes were coded: kRange with SimpleModel and the multi-symbol
+// RangeCoder, kBinary as bit trees of binary decisions (see
+// binary_coder.hpp), kRans with interleaved rANS states and a static table
+// per lane (see rans_coder.hpp).
+enum class CoderEngine : uchar { kRange = 0, kBinary = 1, kRans = 2, kCount };
+
+inline const char *EngineName(CoderEngine engine) {
+  switch (engine) {
+    case CoderEngine::kRange:
+      return "range";
+    case CoderEngine::kBinary:
+      return "binary";
+    case CoderEngine::kRans:
+      return "rans";
+    default:
+      throw std::runtime_error("unknown coder engine");
+  }
+}
+
+// The engine called name, as EngineName gives it.
+inline CoderEngine ParseEngine(const std::string &name) {
+  for (uint id = 0; id < uint(CoderEngine::kCount); ++id) {
+    if (name == EngineName(CoderEngine(id))) {
+      return CoderEngine(id);
+    }
+  }
+  throw std::runtime_error("unknown coder engine " + name);
+}
+
+// What the lanes code: kNone the symbols themselves, kRunLength literals and
+// run lengths (see run_length.hpp), kBlockSort the move-to-front indices of
+// the lane's BWT (see block_sort.hpp).
+enum class SymbolTransform : uchar {
+  kNone = 0,
+  kRunLength = 1,
+  kBlockSort = 2,
+  kCount
+};
+
+inline const char *TransformName(SymbolTransform transform) {
+  switch (transform) {
+    case SymbolTransform::kNone:
+      return "none";
+    case SymbolTransform::kRunLength:
+      return "rle";
+    case SymbolTransform::kBlockSort:
+      return "bwt";
+    default:
+      throw std::runtime_error("unknown symbol transform");
+  }
+}
+
+// The transform called name, as TransformName gives it.
+inline SymbolTransform ParseTransform(const std::string &name) {
+  for (uint id = 0; id < uint(SymbolTransform::kCount); ++id) {
+    if (name == TransformName(SymbolTransform(id))) {
+      return SymbolTransform(id);
+    }
+  }
+  throw std::runtime_error("unknown symbol transform " + name);
+}
+
+// The byte values a chunk uses, one bit each. With the plain layout every
+// byte is coded as its rank among the used ones.
+struct UsedBytes {
+  uint bits[8];
+
+  static UsedBytes All() { return {{~0u, ~0u, ~0u, ~0u, ~0u, ~0u, ~0u, ~0u}}; }
+  static UsedBytes Of(const uchar *data, size_t size) {
+    UsedBytes used{};
+    for (size_t k = 0; k < size; ++k) {
+      used.bits[data[k] >> 5] |= 1u << (data[k] & 31);
+    }
+    return used;
+  }
+
+  bool Has(uint c) const { return (bits[c >> 5] >> (c & 31)) & 1; }
+  uint Count() const {
+    uint n = 0;
+    for (uint c = 0; c < 256; ++c) {
+      n += Has(c);
+    }
+    return n;
+  }
+  // byte -> rank
+  std::array<uchar, 256> Ranks() const {
+    std::array<uchar, 256> ranks{};
+    for (uint c = 0, r = 0; c < 256; ++c) {
+      ranks[c] = r;
+      r += Has(c);
+    }
+    return ranks;
+  }
+  // rank -> byte
+  std::array<uchar, 256> Bytes() const {
+    std::array<uchar, 256> bytes{};
+    for (uint c = 0, r = 0; c < 256; ++c) {
+      if (Has(c)) {
+        bytes[r++] = c;
+      }
+    }
+    return bytes;
+  }
+};
+
+struct ContainerHeader {
+  uint magic;
+  uchar n_lanes;
+  StreamLayout layout;
+  ContextOrder order;  // of the model every lane was coded with
+  uchar max_symbol;  // the lane models have max_symbol + 1 symbols
+  CoderPrecision precision;  // of range / total_freq in coder and decoder
+  CoderEngine engine;
+  SymbolTransform transform;  // of the lane symbols before coding
+  uchar rans_states;  // of every lane with the rANS engine, else 0
+  uchar reserved[4];  // keeps the lane entries 8-byte aligned
+  UsedBytes used;
+};
+
+struct LaneEntry {
+  uint n_symbols;  // decoded, which with run lengths is more than coded
+  uint size;  // payload bytes
+  ulong offset;  // from the start of the container
+};
+
+// Bytes of each of the n_lanes lanes a chunk of chunk_size bytes is split
+// into. Throws for a chunk whose symbols a LaneEntry could not count.
+inline size_t ChunkLaneSize(size_t chunk_size, uint n_lanes) {
+  if (chunk_size > std::numeric_limits<uint>::max()) {
+    throw std::runtime_error("chunk larger than the symbol count of a lane");
+  }
+  return (chunk_size + n_lanes - 1) / n_lanes;
+}
+
+class MultiStream {
+ public:
+  static constexpr uint kMagic = 0x32435253;  // "SRC2"
+  static constexpr uint kPadWords = 2;
+
+  // Starts an empty container that will hold n_lanes lanes.
+  explicit MultiStream(uint n_lanes,
+                       ContextOrder order = ContextOrder::kOrder0,
+                       StreamLayout layout = StreamLayout::kPlain,
+                       CoderPrecision precision = CoderPrecision::kMantissa24,
+                       CoderEngine engine = CoderEngine::kRange,
+                       SymbolTransform transform = SymbolTransform::kNone)
+      : bytes_(HeaderSize(n_lanes), 0) {
+    Header() = {kMagic,    uchar(n_lanes), layout,    order, 255,
+                precision, engine,         transform, 0,     {},
+                UsedBytes::All()};
+  }
+
+  // Takes ownership of a serialized container.
+  explicit MultiStream(std::vector<uchar> &&bytes) : bytes_(std::move(bytes)) {
+    if (bytes_.size() < sizeof(ContainerHeader) || Header().magic != kMagic ||
+        bytes_.size() < HeaderSize(Header().n_lanes)) {
+      throw std::runtime_error("not a multi-stream container");
+    }
+    if (Order() != ContextOrder::kOrder0 && Order() != ContextOrder::kOrder1) {
+      throw std::runtime_error("unknown context order");
+    }
+    if (Precision() >= CoderPrecision::kCount) {
+      throw std::runtime_error("unknown coder precision");
+    }
+    if (Engine() >= CoderEngine::kCount) {
+      throw std::runtime_error("unknown coder engine");
+    }
+    if (Engine() != CoderEngine::kRange && Layout() != StreamLayout::kPlain) {
+      throw std::runtime_error("only the range engine codes FASTQ lanes");
+    }
+    if ((Engine() == CoderEngine::kRans) != (RansStates() > 0)) {
+      throw std::runtime_error("rANS states that do not match the engine");
+    }
+    if (Transform() >= SymbolTransform::kCount) {
+      throw std::runtime_error("unknown symbol transform");
+    }
+    if (Engine() != CoderEngine::kRange &&
+        Transform() != SymbolTransform::kNone) {
+      throw std::runtime_error("only the range engine codes transforms");
+    }
+    if (Layout() != StreamLayout::kPlain &&
+        Transform() == SymbolTransform::kBlockSort) {
+      throw std::runtime_error("FASTQ lanes are not block sorted");
+    }
+    if (Layout() != StreamLayout::kPlain && Layout() != StreamLayout::kFastq) {
+      throw std::runtime_error("unknown stream layout");
+    }
+    // a header, a base and a quality lane, see fastq.hpp
+    if (Layout() == StreamLayout::kFastq && NumLanes() != 3) {
+      throw std::runtime_error("FASTQ layout without its three lanes");
+    }
+    for (uint i = 0; i < NumLanes(); ++i) {
+      // offset + PaddedSize(size) could wrap for a crafted offset
+      if (Lane(i).offset > bytes_.size() ||
+          PaddedSize(Lane(i).size) > bytes_.size() - Lane(i).offset) {
+        throw std::runtime_error("truncated multi-stream container");
+      }
+      // the kernel feeders address a lane by its word
+      if (Lane(i).offset % kRangeOutSize != 0) {
+        throw std::runtime_error("lane off a word boundary");
+      }
+      if (Lane(i).size < TransformPrefix()) {
+        throw std::runtime_error("lane without its transform prefix");
+      }
+      // a rANS lane holds its table and final states, and 16-bit units
+      if (Engine() == CoderEngine::kRans &&
+          (Lane(i).size % 2 != 0 ||
+           Lane(i).size < 2 * ModelSymbols() + 4 * RansStates())) {
+        throw std::runtime_error("rANS lane without its table and states");
+      }
+      // the row of the end of the block is row 0, so the primary row of a
+      // block of n symbols is in [1, n], and 0 without symbols
+      if (Transform() == SymbolTransform::kBlockSort &&
+          (Lane(i).n_symbols > 0 ? BlockSortIndex(i) == 0 ||
+                                       BlockSortIndex(i) > Lane(i).n_symbols
+                                 : BlockSortIndex(i) != 0)) {
+        throw std::runtime_error("BWT primary index outside of its lane");
+      }
+    }
+  }
+
+  // Sets the payload of lane idx. Lanes must be filled in order.
+  void SetLane(uint idx, uint n_symbols, const void *data, uint size) {
+    SetLane(idx, n_symbols, nullptr, 0, data, size);
+  }
+
+  // Same as above for a payload of prefix_size bytes at prefix followed by
+  // size bytes at data.
+  void SetLane(uint idx, uint n_symbols, const void *prefix, uint prefix_size,
+               const void *data, uint size) {
+    LaneEntry entry{n_symbols, prefix_size + size, bytes_.size()};
+    bytes_.resize(bytes_.size() + PaddedSize(entry.size), 0);
+    if (prefix_size > 0) {
+      std::memcpy(bytes_.data() + entry.offset, prefix, prefix_size);
+    }
+    std::memcpy(bytes_.data() + entry.offset + prefix_size, data, size);
+    Lane(idx) = entry;
+  }
+
+  // Records that the lanes code the ranks of the used bytes with models of
+  // model_symbols symbols.
+  void SetAlphabet(const UsedBytes &used, uint model_symbols) {
+    Header().used = used;
+    Header().max_symbol = model_symbols - 1;
+  }
+
+  // Records that every lane was coded with n_states rANS states.
+  void SetRansStates(uint n_states) { Header().rans_states = n_states; }
+
+  // Turns decoded ranks back into bytes, in place.
+  void Unrank(uchar *data, size_t size) const {
+    if (Used().Count() == 256) {
+      return;
+    }
+    auto bytes = Used().Bytes();
+    for (size_t k = 0; k < size; ++k) {
+      data[k] = bytes[data[k]];
+    }
+  }
+
+  uint NumLanes() const { return Header().n_lanes; }
+  uint ModelSymbols() const { return Header().max_symbol + 1u; }
+  const UsedBytes &Used() const { return Header().used; }
+  ContextOrder Order() const { return Header().order; }
+  CoderPrecision Precision() const { return Header().precision; }
+  CoderEngine Engine() const { return Header().engine; }
+  SymbolTransform Transform() const { return Header().transform; }
+  uint RansStates() const { return Header().rans_states; }
+  StreamLayout Layout() const { return Header().layout; }
+  LaneEntry &Lane(uint idx) { return Entries()[idx]; }
+  const LaneEntry &Lane(uint idx) const { return Entries()[idx]; }
+  const uchar *LaneData(uint idx) const { return data() + Lane(idx).offset; }
+  // End of the bytes the decoders of lane idx may read, its padding
+  // included, which the constructor keeps inside the container.
+  const uchar *LaneEnd(uint idx) const {
+    return LaneData(idx) + PaddedSize(Lane(idx).size);
+  }
+
+  // Bytes the transform keeps at the start of every lane payload.
+  uint TransformPrefix() const {
+    return Transform() == SymbolTransform::kBlockSort ? 4 : 0;
+  }
+
+  // The coded symbols of lane idx, after the transform prefix.
+  const uchar *LaneCode(uint idx) const {
+    return LaneData(idx) + TransformPrefix();
+  }
+
+  // The BWT primary index of block-sorted lane idx.
+  uint BlockSortIndex(uint idx) const {
+    uint primary;
+    std::memcpy(&primary, LaneData(idx), sizeof(primary));
+    return primary;
+  }
+
+  // Index of the first symbol of lane idx in the decoded output.
+  size_t LaneStart(uint idx) const {
+    size_t start = 0;
+    for (uint i = 0; i < idx; ++i) {
+      start += Lane(i).n_symbols;
+    }
+    return start;
+  }
+  size_t NumSymbols() const { return LaneStart(NumLanes()); }
+  // Room the decoded output needs: the symbols, and with the FASTQ layout a
+  // newline after every quality line, which has a line of bases in lane 1.
+  size_t MaxOutputSize() const {
+    return NumSymbols() +
+           (Layout() == StreamLayout::kFastq ? Lane(1).n_symbols : 0);
+  }
+
+  // Throws unless the decoded output fits capacity bytes. The decoders write
+  // their lanes straight into the output, so a symbol count is checked here,
+  // once, before any of them runs.
+  void CheckOutput(size_t capacity) const {
+    if (MaxOutputSize() > capacity) {
+      throw std::runtime_error("container larger than its output");
+    }
+  }
+
+  const uchar *data() const { return bytes_.data(); }
+  size_t size() const { return bytes_.size(); }
+
+  // A chunked archive is a sequence of frames, each holding the container
+  // size followed by the container.
+  void WriteFrame(std::ostream &out) const {
+    ulong size = bytes_.size();
+    out.write((const char *)&size, sizeof(size));
+    out.write((const char *)bytes_.data(), size);
+  }
+
+  // Returns false at the end of the archive.
+  static bool ReadFrame(std::istream &in, std::vector<uchar> &bytes) {
+    ulong size = 0;
+    if (!in.read((char *)&size, sizeof(size))) {
+      return false;
+    }
+    bytes.resize(size);
+    if (!in.read((char *)bytes.data(), size)) {
+      throw std::runtime_error("truncated chunk frame");
+    }
+    return true;
+  }
+
+  // In size_t, since CountVecs takes a uint and wraps for a size near 2^32.
+  static size_t PaddedSize(size_t size) {
+    return ((size + kRangeOutSize - 1) / kRangeOutSize + kPadWords) *
+           kRangeOutSize;
+  }
+
+ private:
+  static size_t HeaderSize(uint n_lanes) {
+    return sizeof(ContainerHeader) + n_lanes * sizeof(LaneEntry);
+  }
+  ContainerHeader &Header() { return *(ContainerHeader *)bytes_.data(); }
+  const ContainerHeader &Header() const {
+    return *(const ContainerHeader *)bytes_.data();
+  }
+  LaneEntry *Entries() {
+    return (LaneEntry *)(bytes_.data() + sizeof(ContainerHeader));
+  }
+  const LaneEntry *Entries() const {
+    return (const LaneEntry *)(bytes_.data() + sizeof(ContainerHeader));
+  }
+
+  std::vector<uchar> bytes_;
+};
+
+#endif  // CONTAINER_HPP_
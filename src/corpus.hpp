@@ -0,0 +1,166 @@
+#ifndef CORPUS_HPP_
+#define CORPUS_HPP_
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "range_coding.h"
+
+// Deterministic synthetic inputs for the benchmark. A corpus is a function of
+// its kind, seed and size only. mt19937_64 is specified bit for bit, and the
+// distributions below are computed from its raw output, so every build and
+// platform sees the same bytes.
+enum class CorpusKind : uchar {
+  kUniform,         // uniform over 64 printable bytes
+  kZipf,            // 256 bytes with p(k) ~ 1 / (k + 1)^1.2
+  kRuns,            // runs of 1..1024 of one of 8 bytes
+  kFastq,           // 4-line records of 100 bases
+  kIncompressible,  // uniform over all 256 bytes
+  kCount
+};
+
+inline const char *CorpusName(CorpusKind kind) {
+  constexpr const char *kNames[] = {"uniform", "zipf", "runs", "fastq",
+                                    "incompressible"};
+  return kNames[uint(kind)];
+}
+
+class CorpusGenerator {
+ public:
+  explicit CorpusGenerator(CorpusKind kind, ulong seed = 1)
+      : kind_(kind), rng_(seed) {
+    double sum = 0;
+    for (uint k = 0; k < 256; ++k) {
+      sum += std::pow(k + 1.0, -1.2);
+      zipf_cdf_[k] = sum;
+    }
+    for (auto &c : zipf_cdf_) {
+      c /= sum;
+    }
+  }
+
+  // Writes the next size bytes of the corpus.
+  void Fill(uchar *out, size_t size) {
+    for (size_t k = 0; k < size;) {
+      if (pending_pos_ == pending_.size()) {
+        Refill();
+      }
+      size_t n = std::min(size - k, pending_.size() - pending_pos_);
+      memcpy(out + k, pending_.data() + pending_pos_, n);
+      pending_pos_ += n;
+      k += n;
+    }
+  }
+
+ private:
+  // in [0, 1) with 53 random bits
+  double Unit() { return (rng_() >> 11) * 0x1.0p-53; }
+  uint Below(uint n) { return rng_() % n; }
+
+  // Appends the next piece of the corpus to pending_.
+  void Refill() {
+    constexpr char kPrintable[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 \n";
+    pending_.clear();
+    pending_pos_ = 0;
+    switch (kind_) {
+      case CorpusKind::kUniform:
+        for (uint k = 0; k < 4096; ++k) {
+          pending_.push_back(kPrintable[Below(64)]);
+        }
+        break;
+      case CorpusKind::kZipf:
+        for (uint k = 0; k < 4096; ++k) {
+          pending_.push_back(
+              std::upper_bound(zipf_cdf_.begin(), zipf_cdf_.end() - 1,
+                               Unit()) -
+              zipf_cdf_.begin());
+        }
+        break;
+      case CorpusKind::kRuns:
+        pending_.assign(1 + Below(1024), "ACGTacgt"[Below(8)]);
+        break;
+      case CorpusKind::kFastq:
+        AppendFastqRecord();
+        break;
+      case CorpusKind::kIncompressible:
+        for (uint k = 0; k < 4096; ++k) {
+          pending_.push_back(rng_());
+        }
+        break;
+      default:
+        throw std::runtime_error("unknown corpus kind");
+    }
+  }
+
+  // Qualities drift along the read like a sequencer's, and low qualities
+  // come with N bases.
+  void AppendFastqRecord() {
+    constexpr uint kReadLength = 100;
+    std::string header = "@bench." + std::to_string(n_records_++) +
+                         " length=" + std::to_string(kReadLength) + "\n";
+    pending_.assign(header.begin(), header.end());
+    char quals[kReadLength];
+    int q = 38;
+    for (uint k = 0; k < kReadLength; ++k) {
+      q = std::clamp(q + int(Below(5)) - 2 - (k > 70 && Below(4) == 0), 2, 41);
+      quals[k] = char('!' + q);
+      pending_.push_back(q < 5 ? 'N' : "ACGT"[Below(4)]);
+    }
+    pending_.push_back('\n');
+    pending_.push_back('+');
+    pending_.push_back('\n');
+    pending_.insert(pending_.end(), quals, quals + kReadLength);
+    pending_.push_back('\n');
+  }
+
+  CorpusKind kind_;
+  std::mt19937_64 rng_;
+  std::array<double, 256> zipf_cdf_;
+  std::vector<uchar> pending_;
+  size_t pending_pos_ = 0;
+  size_t n_records_ = 0;
+};
+
+// Reads the first size bytes of a corpus as an input stream without holding
+// them in memory, so the encoders can take corpora larger than the host
+// memory.
+class CorpusBuf : public std::streambuf {
+ public:
+  CorpusBuf(CorpusKind kind, size_t size, ulong seed = 1)
+      : generator_(kind, seed), left_(size), buffer_(1 << 20) {}
+
+  // Time spent generating, for the reader to leave out of its timings.
+  double GenerateSeconds() const { return generate_seconds_; }
+
+ protected:
+  int_type underflow() override {
+    if (left_ == 0) {
+      return traits_type::eof();
+    }
+    size_t n = std::min(left_, buffer_.size());
+    auto start = std::chrono::steady_clock::now();
+    generator_.Fill((uchar *)buffer_.data(), n);
+    generate_seconds_ +=
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+            .count();
+    left_ -= n;
+    setg(buffer_.data(), buffer_.data(), buffer_.data() + n);
+    return traits_type::to_int_type(buffer_[0]);
+  }
+
+ private:
+  CorpusGenerator generator_;
+  size_t left_;
+  std::vector<char> buffer_;
+  double generate_seconds_ = 0;
+};
+
+#endif  // CORPUS_HPP_
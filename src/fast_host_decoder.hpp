@@ -0,0 +1,156 @@
+#ifndef FAST_HOST_DECODER_HPP
+#define FAST_HOST_DECODER_HPP
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "container.hpp"
+#include "host_binary_coder.hpp"
+#include "host_model.hpp"
+#include "block_sort.hpp"
+#include "host_rans_coder.hpp"
+#include "lane_threads.hpp"
+#include "run_length.hpp"
+
+// Decodes the same streams as HostDecoder + SIMPLE_MODEL, bit for bit, but
+// without a division or a linear pass per symbol. The reciprocal comes from
+// the model's ReciprocalRom, and the symbol search descends the Fenwick tree
+// of HostSimpleModel. It also decodes the other precisions. It reads no
+// further than rc_end, and throws when a corrupt lane would take it there.
+template <uint kNSymbol, typename Precision = Mantissa24Reciprocal>
+class FastHostDecoder {
+ public:
+  FastHostDecoder(const void *rc_ptr, const uchar *rc_end,
+                  ContextOrder order = ContextOrder::kOrder0)
+      : in_buf_((const uchar *)rc_ptr), in_end_(rc_end), contexts_(order) {
+    range_ = (uint)-1;
+    code_ = 0;
+    for (uint i = 0; i < 8; ++i) {
+      code_ = (code_ << 8) | *in_buf_++;
+    }
+  }
+
+  uchar DecodeSymbol() {
+    uchar symbol = Decode(contexts_.Current());
+    contexts_.Next(symbol);
+    return symbol;
+  }
+
+  // Decodes a symbol with a model of the caller's instead, and updates it.
+  template <typename Model>
+  uchar Decode(Model &model) {
+    uint range_unit = model.RangeUnit(range_);
+    uint cum;
+    uchar symbol = model.Find(code_, range_unit, cum);
+    code_ -= cum * range_unit;
+    range_ = range_unit * model.Freq(symbol);
+    Normalize();
+    model.Update(symbol);
+    return symbol;
+  }
+
+ private:
+  void Normalize() {
+    if ((range_ & 0xff000000) != 0) {
+      return;
+    }
+    if (in_end_ - in_buf_ < 3) {
+      throw std::runtime_error("range decoder past the end of its lane");
+    }
+    if ((range_ & 0xffffff00) == 0) {
+      code_ = (code_ << 24) | (in_buf_[0] << 16) | (in_buf_[1] << 8) |
+              in_buf_[2];
+      in_buf_ += 3;
+      range_ <<= 24;
+    } else if ((range_ & 0xffff0000) == 0) {
+      code_ = (code_ << 16) | (in_buf_[0] << 8) | in_buf_[1];
+      in_buf_ += 2;
+      range_ <<= 16;
+    } else {
+      code_ = (code_ << 8) | *in_buf_++;
+      range_ <<= 8;
+    }
+  }
+
+  uint code_;
+  uint range_;
+  const uchar *in_buf_;
+  const uchar *in_end_;
+  HostContexts<kNSymbol, Precision> contexts_;
+};
+
+template <uint kNSymbol>
+void FastHostDecodeLane(const uchar *rc, const uchar *rc_end, uint n_symbols,
+                        uchar *out, ContextOrder order = ContextOrder::kOrder0,
+                        CoderPrecision precision = CoderPrecision::kMantissa24,
+                        SymbolTransform transform = SymbolTransform::kNone) {
+  DispatchPrecision(precision, [&](auto p) {
+    FastHostDecoder<kNSymbol, decltype(p)> decoder(rc, rc_end, order);
+    if (transform != SymbolTransform::kRunLength) {
+      for (uint i = 0; i < n_symbols; ++i) {
+        out[i] = decoder.DecodeSymbol();
+      }
+      return;
+    }
+    // the literals go through the decoder's contexts, the counts through
+    // their own model, and a count is written out as its run right away,
+    // after checking that it ends inside the lane
+    typename HostContexts<kRunSymbols, decltype(p)>::Model runs;
+    RunLengthState state;
+    state.Init();
+    for (uint i = 0; i < n_symbols || state.IsCount();) {
+      uchar token;
+      if (state.IsCount()) {
+        token = decoder.Decode(runs);
+        if (token > n_symbols - i) {
+          throw std::runtime_error("run past the end of the lane");
+        }
+        std::fill(out + i, out + i + token, state.last);
+      } else {
+        token = decoder.DecodeSymbol();
+        out[i] = token;
+      }
+      i += state.Symbols(token);
+      state.Next(token);
+    }
+  });
+}
+
+// Decodes a plain-layout stream of any engine, one thread per lane, which
+// also undoes the block sort of its lane.
+inline void FastHostDecodeMultiStream(const MultiStream &stream, uchar *out) {
+  DispatchModelSymbols(stream.ModelSymbols(), [&](auto n_symbols) {
+    LaneThreads workers;
+    for (uint i = 0; i < stream.NumLanes(); ++i) {
+      if (stream.Engine() == CoderEngine::kBinary) {
+        workers.Run(HostBinaryDecodeLane<n_symbols>, stream.LaneData(i),
+                    stream.LaneEnd(i), stream.Lane(i).n_symbols,
+                    out + stream.LaneStart(i));
+        continue;
+      }
+      if (stream.Engine() == CoderEngine::kRans) {
+        DispatchRansStates(stream.RansStates(), [&](auto n_states) {
+          workers.Run(HostRansDecodeLane<n_symbols, n_states>,
+                      stream.LaneData(i), stream.Lane(i).size,
+                      stream.Lane(i).n_symbols, out + stream.LaneStart(i));
+        });
+        continue;
+      }
+      workers.Run([&stream, out, i] {
+        uint n = stream.Lane(i).n_symbols;
+        uchar *lane = out + stream.LaneStart(i);
+        FastHostDecodeLane<decltype(n_symbols)::value>(
+            stream.LaneCode(i), stream.LaneEnd(i), n, lane, stream.Order(),
+            stream.Precision(), stream.Transform());
+        if (stream.Transform() == SymbolTransform::kBlockSort) {
+          UndoMoveToFront(lane, n);
+          UndoBlockSort(lane, n, stream.BlockSortIndex(i));
+        }
+      });
+    }
+    workers.Join();
+  });
+  stream.Unrank(out, stream.NumSymbols());
+}
+
+#endif  // FAST_HOST_DECODER_HPP
@@ -0,0 +1,260 @@
+#ifndef FASTQ_HPP_
+#define FASTQ_HPP_
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "container.hpp"
+#include "lane_threads.hpp"
+#include "unrolled_loop.hpp"
+
+// A FASTQ chunk is coded as three lanes, each with an alphabet sized for its
+// field:
+//   lane 0: header and '+' lines, as bytes, with their newlines
+//   lane 1: bases, A C G T N as 0..4, and 5 for the end of the line
+//   lane 2: qualities as q - 33, without newlines (a quality line is as long
+//           as its bases)
+// A chunk that does not parse as 4-line records over these alphabets goes
+// whole into lane 0, and its container keeps the plain layout.
+constexpr uint kFastqLanes = 3;
+constexpr uint kFastqBaseNewline = 5;
+constexpr uchar kFastqQualityOffset = 33;
+
+constexpr uint FastqLaneSymbols(uint lane) {
+  return lane == 0 ? 256 : lane == 1 ? 8 : 64;
+}
+
+// 0xff for every byte that is not a base or the end of the line
+inline uchar FastqBaseCode(uchar c) {
+  return c == 'A'    ? 0
+         : c == 'C'  ? 1
+         : c == 'G'  ? 2
+         : c == 'T'  ? 3
+         : c == 'N'  ? 4
+         : c == '\n' ? kFastqBaseNewline
+                     : 0xff;
+}
+
+inline uchar FastqBase(uchar code) {
+  constexpr char kBases[] = "ACGTN\n";
+  return kBases[code];
+}
+
+// Length of the complete records at the start of data, 0 if there is none.
+inline size_t FastqRecordsEnd(const uchar *data, size_t size) {
+  size_t end = 0;
+  uint lines = 0;
+  for (size_t k = 0; k < size; ++k) {
+    if (data[k] == '\n' && ++lines % 4 == 0) {
+      end = k + 1;
+    }
+  }
+  return end;
+}
+
+// Checks that data is made of complete FASTQ records and counts the symbols
+// of every lane. When lanes is given, the lane symbols are also stored there.
+inline bool ScanFastq(const uchar *data, size_t size,
+                      size_t (&counts)[kFastqLanes],
+                      std::vector<uchar> *lanes = nullptr) {
+  for (uint i = 0; i < kFastqLanes; ++i) {
+    counts[i] = 0;
+    if (lanes) {
+      lanes[i].clear();
+    }
+  }
+  auto put = [&](uint lane, uchar symbol) {
+    counts[lane]++;
+    if (lanes) {
+      lanes[lane].push_back(symbol);
+    }
+  };
+
+  size_t k = 0;
+  while (k < size) {
+    // header line, then bases, then '+' line, then qualities
+    if (data[k] != '@') {
+      return false;
+    }
+    for (; k < size && data[k] != '\n'; ++k) {
+      put(0, data[k]);
+    }
+    if (k == size) {
+      return false;
+    }
+    put(0, data[k++]);
+
+    size_t n_bases = 0;
+    for (; k < size && data[k] != '\n'; ++k, ++n_bases) {
+      uchar code = FastqBaseCode(data[k]);
+      if (code >= kFastqBaseNewline) {
+        return false;
+      }
+      put(1, code);
+    }
+    if (k == size) {
+      return false;
+    }
+    put(1, kFastqBaseNewline);
+    k++;
+
+    if (k == size || data[k] != '+') {
+      return false;
+    }
+    for (; k < size && data[k] != '\n'; ++k) {
+      put(0, data[k]);
+    }
+    if (k == size) {
+      return false;
+    }
+    put(0, data[k++]);
+
+    for (size_t q = 0; q < n_bases; ++q, ++k) {
+      if (k == size || data[k] < kFastqQualityOffset ||
+          data[k] >= kFastqQualityOffset + FastqLaneSymbols(2)) {
+        return false;
+      }
+      put(2, data[k] - kFastqQualityOffset);
+    }
+    if (k == size || data[k] != '\n') {
+      return false;
+    }
+    k++;
+  }
+  return true;
+}
+
+// Interleaves the decoded lanes back into records in the capacity bytes at
+// out. Returns the output size. Throws when the lanes do not join into whole
+// records or the records do not fit, so that a corrupt container never reads
+// past the end of a lane nor writes past the end of out.
+inline size_t JoinFastq(const std::vector<uchar> (&lanes)[kFastqLanes],
+                        uchar *out, size_t capacity) {
+  const uchar *header = lanes[0].data();
+  const uchar *header_end = header + lanes[0].size();
+  const uchar *bases = lanes[1].data();
+  const uchar *bases_end = bases + lanes[1].size();
+  const uchar *quals = lanes[2].data();
+  const uchar *quals_end = quals + lanes[2].size();
+  auto mismatch = [] {
+    throw std::runtime_error("FASTQ lanes that do not join into records");
+  };
+  uchar *p = out;
+  uchar *out_end = out + capacity;
+  auto reserve = [&](size_t n) {
+    if (size_t(out_end - p) < n) {
+      throw std::runtime_error("FASTQ records past the end of the output");
+    }
+  };
+  auto copy_line = [&] {
+    const uchar *end = std::find(header, header_end, '\n');
+    if (end == header_end) {
+      mismatch();
+    }
+    reserve(end + 1 - header);
+    p = std::copy(header, end + 1, p);
+    header = end + 1;
+  };
+  while (header < header_end) {
+    copy_line();
+    const uchar *line_end = std::find_if(
+        bases, bases_end, [](uchar b) { return b >= kFastqBaseNewline; });
+    if (line_end == bases_end || *line_end != kFastqBaseNewline) {
+      mismatch();
+    }
+    size_t n_bases = line_end - bases;
+    reserve(n_bases + 1);
+    p = std::transform(bases, line_end, p, FastqBase);
+    *p++ = '\n';
+    bases = line_end + 1;
+    copy_line();
+    if (size_t(quals_end - quals) < n_bases) {
+      mismatch();
+    }
+    reserve(n_bases + 1);
+    for (size_t q = 0; q < n_bases; ++q) {
+      *p++ = *quals++ + kFastqQualityOffset;
+    }
+    *p++ = '\n';
+  }
+  if (bases != bases_end || quals != quals_end) {
+    mismatch();
+  }
+  return p - out;
+}
+
+// Forms the decoded output of stream from its decoded lanes in the capacity
+// bytes at out, which MultiStream::CheckOutput has checked for the plain
+// layout. Returns the output size.
+inline size_t JoinLanes(const MultiStream &stream,
+                        const std::vector<uchar> *lanes, uchar *out,
+                        size_t capacity) {
+  if (stream.Layout() == StreamLayout::kFastq) {
+    return JoinFastq(*(const std::vector<uchar>(*)[kFastqLanes])lanes, out,
+                     capacity);
+  }
+  uchar *p = out;
+  for (uint i = 0; i < stream.NumLanes(); ++i) {
+    p = std::copy(lanes[i].begin(), lanes[i].end(), p);
+  }
+  stream.Unrank(out, p - out);
+  return p - out;
+}
+
+// Decodes every lane of a FASTQ container with
+//   decode_lane(std::integral_constant<uint, kNSymbol>, rc, rc_end,
+//               n_symbols, out, order, precision, transform)
+// on its own thread, then interleaves the lanes into the capacity bytes at
+// out. Returns the output size.
+template <typename LaneDecoder>
+size_t DecodeFastqStream(const MultiStream &stream, uchar *out,
+                         size_t capacity, LaneDecoder decode_lane) {
+  std::vector<uchar> lanes[kFastqLanes];
+  LaneThreads workers;
+  fpga_tools::UnrolledLoop<kFastqLanes>([&](auto i) {
+    lanes[i].resize(stream.Lane(i).n_symbols);
+    workers.Run([&, i] {
+      decode_lane(std::integral_constant<uint, FastqLaneSymbols(i)>(),
+                  stream.LaneData(i), stream.LaneEnd(i),
+                  stream.Lane(i).n_symbols, lanes[i].data(), stream.Order(),
+                  stream.Precision(), stream.Transform());
+    });
+  });
+  workers.Join();
+  return JoinFastq(lanes, out, capacity);
+}
+
+// Front end of the FASTQ encoder. It walks the chunk one byte per cycle and
+// sends every byte to the model of its lane, or everything to lane 0 when
+// the chunk is coded raw.
+template <typename SymbolPipes, typename Accessor>
+struct SplitFastq {
+  Accessor acc;
+  uint size;
+  bool raw;
+
+  void operator()() const {
+    ac_int<2, false> line = 0;
+    for (uint k = 0; k < size; ++k) {
+      uchar c = acc[k];
+      bool to_bases = !raw && line == 1;
+      bool to_quals = !raw && line == 3 && c != '\n';
+      if (to_bases) {
+        SymbolPipes::template write<1>({FastqBaseCode(c), false});
+      } else if (to_quals) {
+        SymbolPipes::template write<2>(
+            {uchar(c - kFastqQualityOffset), false});
+      } else if (raw || line != 3) {
+        SymbolPipes::template write<0>({c, false});
+      }
+      if (c == '\n') {
+        line++;
+      }
+    }
+    fpga_tools::UnrolledLoop<kFastqLanes>(
+        [&](auto i) { SymbolPipes::template write<i>({0, true}); });
+  }
+};
+
+#endif  // FASTQ_HPP_
@@ -0,0 +1,196 @@
+#ifndef FASTQ_ENCODER_HPP_
+#define FASTQ_ENCODER_HPP_
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "fastq.hpp"
+#include "stream_encoder.hpp"
+
+// Encodes a FASTQ input in chunks of whole records, with the header,
+// sequence and quality fields on their own lanes (see fastq.hpp). The
+// overlap of loading, coding and reading back, and the in-place input,
+// follow StreamingEncoder, and so does the run-length transform.
+template <ContextOrder kOrder = ContextOrder::kOrder0,
+          typename Precision = Mantissa24Reciprocal,
+          SymbolTransform kTransform = SymbolTransform::kNone>
+class FastqEncoder {
+  static constexpr bool kRunLength = kTransform == SymbolTransform::kRunLength;
+  static_assert(kTransform != SymbolTransform::kBlockSort,
+                "FASTQ lanes are not block sorted");
+
+ public:
+  FastqEncoder(queue &q, size_t chunk_size)
+      : q_(q),
+        chunk_size_(chunk_size),
+        fq_buffer_{buffer<uchar, 1>{range<1>(chunk_size)},
+                   buffer<uchar, 1>{range<1>(chunk_size)}},
+        staging_{std::make_unique<uchar[]>(chunk_size),
+                 std::make_unique<uchar[]>(chunk_size)},
+        store_(chunk_size) {}
+
+  // Same contracts as StreamingEncoder::Encode.
+  template <typename Sink>
+  size_t Encode(std::istream &in, Sink &&sink) {
+    return EncodeChunks<false>([&](bool slot) { Load(in, slot); }, sink);
+  }
+
+  template <typename Sink>
+  size_t Encode(const uchar *data, size_t size, Sink &&sink) {
+    size_t pos = 0;
+    return EncodeChunks<true>(
+        [&](bool slot) {
+          size_t end = std::min(chunk_size_, size - pos);
+          if (end == chunk_size_) {
+            size_t records_end = FastqRecordsEnd(data + pos, end);
+            end = records_end > 0 ? records_end : end;
+          }
+          chunk_in_[slot] = data + pos;
+          pos += end;
+          Split(slot, end);
+        },
+        sink);
+  }
+
+  double EncodingSeconds() const { return encoding_seconds_; }
+  const PerfReport &Perf() const { return perf_; }
+
+ private:
+  template <bool kInPlace, typename Loader, typename Sink>
+  size_t EncodeChunks(Loader &&load, Sink &sink) {
+    size_t total = 0;
+    bool slot = 0;
+    load(slot);
+    if (chunk_bytes_[slot] > 0) {
+      Launch<kInPlace>(slot);
+    }
+    while (chunk_bytes_[slot] > 0) {
+      load(!slot);
+      if (chunk_bytes_[!slot] > 0) {
+        Launch<kInPlace>(!slot);
+      }
+      Finish(slot, sink);
+      total += chunk_bytes_[slot];
+      slot = !slot;
+    }
+    return total;
+  }
+
+  // Fills the slot with the bytes left over from the previous chunk and new
+  // input, and keeps back a trailing partial record for the next chunk.
+  void Load(std::istream &in, bool slot) {
+    h2d_event_[slot].wait();
+    uchar *staging = staging_[slot].get();
+    std::copy(carry_.begin(), carry_.end(), staging);
+    in.read((char *)staging + carry_.size(), chunk_size_ - carry_.size());
+    size_t size = carry_.size() + in.gcount();
+
+    size_t end = size;
+    if (size == chunk_size_) {
+      end = FastqRecordsEnd(staging, size);
+      // a record longer than a chunk is coded raw in pieces
+      end = end > 0 ? end : size;
+    }
+    carry_.assign(staging + end, staging + size);
+    chunk_in_[slot] = staging;
+    Split(slot, end);
+    if (end > 0) {
+      h2d_event_[slot] = q_.submit([&](handler &h) {
+        auto acc = fq_buffer_[slot].get_access<access::mode::write>(h);
+        h.copy(staging, acc);
+      });
+    }
+  }
+
+  // Counts the lane symbols of the size bytes of the slot, or marks them raw.
+  void Split(bool slot, size_t size) {
+    chunk_bytes_[slot] = size;
+    raw_[slot] = !ScanFastq(chunk_in_[slot], size, lane_symbols_[slot]);
+    if (raw_[slot]) {
+      lane_symbols_[slot][0] = size;
+      lane_symbols_[slot][1] = lane_symbols_[slot][2] = 0;
+    }
+  }
+
+  template <bool kInPlace>
+  void Launch(bool slot) {
+    fpga_tools::UnrolledLoop<kFastqLanes>([&](auto i) {
+      if constexpr (kRunLength) {
+        q_.single_task(RunLengthEncoder<SymbPipes::PipeAt<i>,
+                                        RunTokenPipes::PipeAt<i>>{});
+        q_.single_task(RunLengthModelKernel<RunTokenPipes::PipeAt<i>,
+                                            FrequncePipes::PipeAt<i>,
+                                            FastqLaneSymbols(i), kOrder,
+                                            Precision>{});
+      } else {
+        q_.single_task(SimpleModelKernel<SymbPipes::PipeAt<i>,
+                                         FrequncePipes::PipeAt<i>,
+                                         FastqLaneSymbols(i), kOrder,
+                                         Precision>{});
+      }
+    });
+    store_.Launch(q_, slot);
+
+    uint size = chunk_bytes_[slot];
+    bool raw = raw_[slot];
+    q_.submit([&](handler &h) {
+      if constexpr (kInPlace) {
+        const uchar *in = chunk_in_[slot];
+        h.single_task(SplitFastq<SymbPipes, const uchar *>{in, size, raw});
+      } else {
+        auto acc = fq_buffer_[slot].get_access<access::mode::read>(h);
+        h.single_task(SplitFastq<SymbPipes, decltype(acc)>{acc, size, raw});
+      }
+    });
+    coder_event_[slot] =
+        q_.single_task(RangeCoder<kFastqLanes, Precision>{});
+  }
+
+  template <typename Sink>
+  void Finish(bool slot, Sink &sink) {
+    auto start = coder_event_[slot]
+                     .get_profiling_info<info::event_profiling::command_start>();
+    auto end = coder_event_[slot]
+                   .get_profiling_info<info::event_profiling::command_end>();
+    encoding_seconds_ += (end - start) / 1e9;
+
+    MultiStream stream(kFastqLanes, kOrder,
+                       raw_[slot] ? StreamLayout::kPlain : StreamLayout::kFastq,
+                       Precision::kId, CoderEngine::kRange, kTransform);
+    {
+      auto rc_sizes = store_.rc_size_buffer[slot].get_host_access();
+      for (uint i = 0; i < kFastqLanes; ++i) {
+        stream.SetLane(
+            i, lane_symbols_[slot][i],
+            store_.rc_buffer[slot][i].get_host_access().get_pointer(),
+            rc_sizes[i]);
+      }
+    }
+    using ModelPipes = std::conditional_t<kRunLength, RunTokenPipes, SymbPipes>;
+    fpga_tools::UnrolledLoop<kFastqLanes>([&](auto i) {
+      perf_.Collect<typename ModelPipes::template PipeAt<i>>(
+          q_, "model " + std::to_string(i));
+    });
+    perf_.Collect<FrequncePipes>(q_, "coder");
+    perf_.Collect<RangePipe<kFastqLanes>>(q_, "store");
+    sink(stream, chunk_in_[slot], chunk_bytes_[slot]);
+  }
+
+  queue &q_;
+  size_t chunk_size_;
+  buffer<uchar, 1> fq_buffer_[2];
+  std::unique_ptr<uchar[]> staging_[2];
+  std::vector<uchar> carry_;
+  const uchar *chunk_in_[2] = {nullptr, nullptr};
+  size_t chunk_bytes_[2] = {0, 0};
+  bool raw_[2] = {false, false};
+  size_t lane_symbols_[2][kFastqLanes];
+  event h2d_event_[2];
+  event coder_event_[2];
+  double encoding_seconds_ = 0;
+  PerfReport perf_;
+  DoubleBufferingStore<kFastqLanes> store_;
+};
+
+#endif  // FASTQ_ENCODER_HPP_
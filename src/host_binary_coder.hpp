@@ -0,0 +1,111 @@
+#ifndef HOST_BINARY_CODER_HPP_
+#define HOST_BINARY_CODER_HPP_
+#include <stdexcept>
+#include <vector>
+
+#include "binary_coder.hpp"
+
+// Encodes one lane into the same bytes as BinaryCoder -> Store, the way
+// HostEncodeLane does for the range engine.
+template <uint kNSymbol>
+void HostBinaryEncodeLane(const uchar *in, uint n_symbols,
+                          std::vector<uchar> &out) {
+  BitTreeModel<kNSymbol> model;
+  model.Init();
+  ulong low = 0;
+  uint range = (uint)-1;
+  out.clear();
+
+  for (uint k = 0; k < n_symbols; ++k) {
+    uint node = 1;
+    for (int b = BitTreeModel<kNSymbol>::kBits - 1; b >= 0; --b) {
+      bool bit = (in[k] >> b) & 1;
+      ushort prob = model.probs[node];
+      uint bound = BinaryBound(range, prob);
+      if (bit) {
+        if (low + bound < low) {
+          for (auto it = out.rbegin(); it != out.rend() && ++*it == 0; ++it) {
+          }
+        }
+        low += bound;
+        range -= bound;
+      } else {
+        range = bound;
+      }
+      model.probs[node] = AdaptProb(prob, bit);
+      node = node * 2 + bit;
+
+      // AdaptProb keeps prob in [31, 4065], so a decision keeps at least
+      // 31/4096 of range, over 2^16 of it, and one byte restores 2^24
+      if (range < (1u << 24)) {
+        out.push_back(low >> 56);
+        low <<= 8;
+        range <<= 8;
+      }
+    }
+  }
+
+  for (int s = 56; s >= 0; s -= 8) {
+    out.push_back(low >> s);
+  }
+}
+
+// Decodes the lanes of BinaryCoder on the host. Like FastHostDecoder, the
+// 32-bit code starts at the second word, and it reads no further than
+// rc_end.
+template <uint kNSymbol>
+class HostBinaryDecoder {
+ public:
+  HostBinaryDecoder(const void *rc_ptr, const uchar *rc_end)
+      : in_buf_((const uchar *)rc_ptr), in_end_(rc_end) {
+    model_.Init();
+    range_ = (uint)-1;
+    code_ = 0;
+    for (uint i = 0; i < 8; ++i) {
+      code_ = (code_ << 8) | *in_buf_++;
+    }
+  }
+
+  uchar DecodeSymbol() {
+    uint node = 1;
+    while (node < kNSymbol) {
+      ushort prob = model_.probs[node];
+      uint bound = BinaryBound(range_, prob);
+      bool bit = code_ >= bound;
+      if (bit) {
+        code_ -= bound;
+        range_ -= bound;
+      } else {
+        range_ = bound;
+      }
+      model_.probs[node] = AdaptProb(prob, bit);
+      node = node * 2 + bit;
+      if (range_ < (1u << 24)) {
+        if (in_buf_ == in_end_) {
+          throw std::runtime_error("binary decoder past the end of its lane");
+        }
+        code_ = (code_ << 8) | *in_buf_++;
+        range_ <<= 8;
+      }
+    }
+    return node - kNSymbol;
+  }
+
+ private:
+  uint code_;
+  uint range_;
+  const uchar *in_buf_;
+  const uchar *in_end_;
+  BitTreeModel<kNSymbol> model_;
+};
+
+template <uint kNSymbol>
+void HostBinaryDecodeLane(const uchar *rc, const uchar *rc_end,
+                          uint n_symbols, uchar *out) {
+  HostBinaryDecoder<kNSymbol> decoder(rc, rc_end);
+  for (uint i = 0; i < n_symbols; ++i) {
+    out[i] = decoder.DecodeSymbol();
+  }
+}
+
+#endif  // HOST_BINARY_CODER_HPP_
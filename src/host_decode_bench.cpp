@@ -0,0 +1,92 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "fast_host_decoder.hpp"
+#include "host_decoder.hpp"
+
+// Compares HostDecoder + SIMPLE_MODEL with FastHostDecoder on an archive
+// written by the decoder executable (its second argument). Lanes are decoded
+// one after another on a single thread so that the numbers are per core.
+//   host_decode_bench <archive> [repeats]
+
+template <typename LaneDecoder>
+double TimeDecode(const std::vector<MultiStream> &chunks,
+                  std::vector<std::vector<uchar>> &outs, uint repeats,
+                  LaneDecoder decode_lane) {
+  auto start = std::chrono::steady_clock::now();
+  for (uint r = 0; r < repeats; ++r) {
+    for (size_t c = 0; c < chunks.size(); ++c) {
+      const auto &stream = chunks[c];
+      DispatchModelSymbols(stream.ModelSymbols(), [&](auto n_symbols) {
+        for (uint i = 0; i < stream.NumLanes(); ++i) {
+          decode_lane(n_symbols, stream.LaneData(i), stream.LaneEnd(i),
+                      stream.Lane(i).n_symbols,
+                      outs[c].data() + stream.LaneStart(i), stream.Order(),
+                      stream.Precision());
+        }
+      });
+      stream.Unrank(outs[c].data(), stream.NumSymbols());
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / repeats;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("usage: %s <archive> [repeats]\n", argv[0]);
+    return 1;
+  }
+  std::ifstream archive(argv[1], std::ios::binary);
+  if (!archive) {
+    throw std::runtime_error("cannot open archive");
+  }
+  uint repeats = argc > 2 ? std::stoul(argv[2]) : 1;
+
+  std::vector<MultiStream> chunks;
+  std::vector<uchar> bytes;
+  size_t n_symbols = 0;
+  while (MultiStream::ReadFrame(archive, bytes)) {
+    chunks.emplace_back(std::move(bytes));
+    if (chunks.back().Layout() != StreamLayout::kPlain) {
+      printf("only archives with the plain layout are supported\n");
+      return 1;
+    }
+    if (chunks.back().Engine() != CoderEngine::kRange ||
+        chunks.back().Precision() != CoderPrecision::kMantissa24 ||
+        chunks.back().Transform() != SymbolTransform::kNone) {
+      printf("only archives of the range engine with the mantissa precision "
+             "and no symbol transform are supported\n");
+      return 1;
+    }
+    n_symbols += chunks.back().NumSymbols();
+  }
+
+  std::vector<std::vector<uchar>> ref_outs, fast_outs;
+  for (const auto &stream : chunks) {
+    ref_outs.emplace_back(stream.NumSymbols());
+    fast_outs.emplace_back(stream.NumSymbols());
+  }
+
+  double ref_seconds = TimeDecode(
+      chunks, ref_outs, repeats,
+      [](auto n_symbols, auto... args) { HostDecodeLane<n_symbols>(args...); });
+  double fast_seconds = TimeDecode(
+      chunks, fast_outs, repeats, [](auto n_symbols, auto... args) {
+        FastHostDecodeLane<n_symbols>(args...);
+      });
+
+  printf("%zu chunks, %zu symbols, %u repeats\n", chunks.size(), n_symbols,
+         repeats);
+  printf("host decoder thpt:      %.4f M/s\n",
+         n_symbols / ref_seconds / 1024 / 1024);
+  printf("fast host decoder thpt: %.4f M/s (%.2fx)\n",
+         n_symbols / fast_seconds / 1024 / 1024, ref_seconds / fast_seconds);
+  printf(ref_outs == fast_outs ? "fast host decoder matches\n"
+                               : "fast host decoder mismatch\n");
+  return ref_outs == fast_outs ? 0 : 1;
+}
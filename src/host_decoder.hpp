@@ -1,7 +1,12 @@
 #ifndef HOST_DECODER_HPP
 #define HOST_DECODER_HPP
+#include <stdexcept>
 #include <vector>
 
+#include "block_sort.hpp"
+#include "container.hpp"
+#include "host_model.hpp"
+#include "lane_threads.hpp"
 #include "range_encoder.hpp"
 using std::vector;
 
@@ -9,9 +14,11 @@ struct HostDecoder {
   uint code;
   uint range;
   uchar *in_buf;
+  const uchar *in_end;  // throws rather than read past it
 
-  HostDecoder(void *rc_ptr) {
+  HostDecoder(void *rc_ptr, const uchar *rc_end) {
     in_buf = (uchar *)rc_ptr;
+    in_end = rc_end;
     range = (uint)-1;
     for (uint i = 0; i < 8; ++i) {
       uchar c = *in_buf++;
@@ -33,6 +40,9 @@ struct HostDecoder {
     bool b_range_8bits = (range & 0xffffff00) == 0;
     bool b_range_16bits = (range & 0xffff0000) == 0;
     bool b_range_24bits = (range & 0xff000000) == 0;
+    if (b_range_24bits && in_end - in_buf < 3) {
+      throw std::runtime_error("range decoder past the end of its lane");
+    }
 
     if (b_range_8bits) {
       code = (code << 8) | *in_buf++;
@@ -121,4 +131,69 @@ struct SIMPLE_MODEL {
   }
 };
 
+// The reference decoder divides through the float reciprocal, so it only
+// takes the 24-bit mantissa precision, and it codes symbols, not run lengths.
+// A block-sorted lane codes plain symbols, which the caller turns back.
+template <int NSYM>
+void HostDecodeLane(const uchar *rc, const uchar *rc_end, uint n_symbols,
+                    uchar *out, ContextOrder order = ContextOrder::kOrder0,
+                    CoderPrecision precision = CoderPrecision::kMantissa24,
+                    SymbolTransform transform = SymbolTransform::kNone) {
+  if (precision != CoderPrecision::kMantissa24) {
+    throw std::runtime_error("the reference decoder only takes the mantissa");
+  }
+  if (transform == SymbolTransform::kRunLength) {
+    throw std::runtime_error("the reference decoder takes no run lengths");
+  }
+  HostDecoder decoder((void *)rc, rc_end);
+  bool order1 = order == ContextOrder::kOrder1;
+  vector<SIMPLE_MODEL<NSYM>> models(order1 ? NSYM : 1);
+  uchar context = 0;
+  for (uint i = 0; i < n_symbols; ++i) {
+    out[i] = models[context].decodeSymbol(decoder);
+    if (order1) {
+      context = out[i];
+    }
+  }
+}
+
+// Throws unless HostDecodeLane takes the lanes of stream, so that no lane
+// thread has to.
+inline void CheckReferenceDecoder(const MultiStream &stream) {
+  if (stream.Engine() != CoderEngine::kRange ||
+      stream.Precision() != CoderPrecision::kMantissa24) {
+    throw std::runtime_error("the reference decoder only takes the mantissa");
+  }
+  if (stream.Transform() == SymbolTransform::kRunLength) {
+    throw std::runtime_error("the reference decoder takes no run lengths");
+  }
+}
+
+// Lanes are independent streams, so each one gets its own thread, which also
+// undoes the block sort of its lane.
+inline void HostDecodeMultiStream(const MultiStream &stream, uchar *out) {
+  CheckReferenceDecoder(stream);
+  if (stream.Layout() != StreamLayout::kPlain) {
+    throw std::runtime_error("not a stream with the plain layout");
+  }
+  DispatchModelSymbols(stream.ModelSymbols(), [&](auto n_symbols) {
+    LaneThreads workers;
+    for (uint i = 0; i < stream.NumLanes(); ++i) {
+      workers.Run([&stream, out, i] {
+        uint n = stream.Lane(i).n_symbols;
+        uchar *lane = out + stream.LaneStart(i);
+        HostDecodeLane<decltype(n_symbols)::value>(
+            stream.LaneCode(i), stream.LaneEnd(i), n, lane, stream.Order(),
+            stream.Precision(), stream.Transform());
+        if (stream.Transform() == SymbolTransform::kBlockSort) {
+          UndoMoveToFront(lane, n);
+          UndoBlockSort(lane, n, stream.BlockSortIndex(i));
+        }
+      });
+    }
+    workers.Join();
+  });
+  stream.Unrank(out, stream.NumSymbols());
+}
+
 #endif  // RANGE_DECODING_HPP
\ No newline at end of file
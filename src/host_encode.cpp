@@ -0,0 +1,71 @@
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "host_encoder.hpp"
+
+// Writes the same archive as the decoder executable, without a device.
+//   host_encoder <input> <archive> [chunk MiB] [threads] [order] [precision]
+//                [engine] [transform] [rans states]
+// order is 0 (default) or 1, the context order of the model. precision is
+// mantissa24 (default), fixed32, exact or pow2, see CoderPrecision. Only the
+// decoders of the same precision take the archive, and exact has no kernel
+// decoder. engine is range (default), binary or rans, see CoderEngine, and
+// only range takes order 1. transform is none (default), rle or bwt, see
+// SymbolTransform, and only range takes rle and bwt. rans states is the
+// number of states of a rANS lane, 8 (default) times the symbols per cycle
+// of the device image, see RansLaneStates.
+
+using Alphabets = AlphabetSet<4, 16, 64, 256>;
+constexpr uint kNCoders = 4;
+constexpr size_t kChunkSize = 64 << 20;
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    printf("usage: %s <input> <archive> [chunk MiB] [threads] [order] "
+           "[precision] [engine] [transform] [rans states]\n",
+           argv[0]);
+    return 1;
+  }
+  std::ifstream input_file(argv[1], std::ios::binary);
+  if (!input_file) {
+    throw std::runtime_error("cannot open input file");
+  }
+  std::ofstream out_file(argv[2], std::ios::binary);
+  size_t chunk_size = argc > 3 ? std::stoul(argv[3]) << 20 : kChunkSize;
+  uint n_threads =
+      argc > 4 ? std::stoul(argv[4]) : std::thread::hardware_concurrency();
+  auto order = argc > 5 && std::stoul(argv[5]) == 1 ? ContextOrder::kOrder1
+                                                     : ContextOrder::kOrder0;
+  auto precision =
+      argc > 6 ? ParsePrecision(argv[6]) : CoderPrecision::kMantissa24;
+  auto engine = argc > 7 ? ParseEngine(argv[7]) : CoderEngine::kRange;
+  auto transform = argc > 8 ? ParseTransform(argv[8]) : SymbolTransform::kNone;
+  uint rans_states = argc > 9 ? std::stoul(argv[9]) : kRansStates;
+
+  size_t n_chunks = 0;
+  size_t compressed_size = 0;
+  HostStreamEncoder<kNCoders, Alphabets> encoder(
+      chunk_size, n_threads, order, precision, engine, transform,
+      rans_states);
+  auto start = std::chrono::steady_clock::now();
+  size_t file_size = encoder.Encode(
+      input_file, [&](const MultiStream &stream, const uchar *, size_t) {
+        n_chunks++;
+        compressed_size += stream.size();
+        stream.WriteFrame(out_file);
+      });
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  printf("host encoding thpt: %.4f M/s with %u threads\n",
+         file_size / elapsed.count() / 1024 / 1024, n_threads);
+  printf("%u lanes, %zu chunks of %zu bytes, compressed size: %zu, "
+         "ratio: %.4f, %s, %s\n",
+         kNCoders, n_chunks, chunk_size, compressed_size,
+         compressed_size * 1.0 / file_size,
+         engine == CoderEngine::kRange ? PrecisionName(precision)
+                                       : EngineName(engine),
+         TransformName(transform));
+}
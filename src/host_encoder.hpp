@@ -0,0 +1,273 @@
+#ifndef HOST_ENCODER_HPP
+#define HOST_ENCODER_HPP
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <istream>
+#include <vector>
+
+#include "block_sort.hpp"
+#include "container.hpp"
+#include "host_binary_coder.hpp"
+#include "host_model.hpp"
+#include "host_rans_coder.hpp"
+#include "lane_threads.hpp"
+#include "run_length.hpp"
+
+// The coder of HostEncodeLane, which codes every symbol with a model of the
+// caller's. range_unit * freq equals UpdateRange modulo 2^32, so the coder
+// keeps the kernel's truncation. A carry is added to the bytes already
+// written, which is what CarryResolver does in the Store kernel. At the end
+// the 64-bit low is flushed as two 4-byte words.
+class HostRangeEncoder {
+ public:
+  explicit HostRangeEncoder(std::vector<uchar> &out) : out_(out) {
+    out_.clear();
+  }
+
+  // Codes symbol with model, then updates the model.
+  template <typename Model>
+  void Encode(Model &model, uchar symbol) {
+    uint range_unit = model.RangeUnit(range_);
+    ulong next_low = low_ + range_unit * model.CumulativeFreq(symbol);
+    if (next_low < low_) {
+      for (auto it = out_.rbegin(); it != out_.rend() && ++*it == 0; ++it) {
+      }
+    }
+    low_ = next_low;
+    range_ = range_unit * model.Freq(symbol);
+    model.Update(symbol);
+
+    uint shift = (range_ & 0xffffff00) == 0   ? 24
+                 : (range_ & 0xffff0000) == 0 ? 16
+                 : (range_ & 0xff000000) == 0 ? 8
+                                              : 0;
+    for (uint s = 0; s < shift; s += 8) {
+      out_.push_back(low_ >> (56 - s));
+    }
+    low_ <<= shift;
+    range_ <<= shift;
+  }
+
+  void Flush() {
+    for (int s = 56; s >= 0; s -= 8) {
+      out_.push_back(low_ >> s);
+    }
+  }
+
+ private:
+  ulong low_ = 0;
+  uint range_ = (uint)-1;
+  std::vector<uchar> &out_;
+};
+
+// Encodes one lane into the same bytes as SimpleModelKernel -> RangeCoder ->
+// Store.
+template <uint kNSymbol, typename Precision = Mantissa24Reciprocal>
+void HostEncodeLane(const uchar *in, uint n_symbols, std::vector<uchar> &out,
+                    ContextOrder order = ContextOrder::kOrder0) {
+  HostContexts<kNSymbol, Precision> contexts(order);
+  HostRangeEncoder coder(out);
+  for (uint k = 0; k < n_symbols; ++k) {
+    coder.Encode(contexts.Current(), in[k]);
+    contexts.Next(in[k]);
+  }
+  coder.Flush();
+}
+
+// Same as above through RunLengthEncoder -> RunLengthModelKernel.
+template <uint kNSymbol, typename Precision = Mantissa24Reciprocal>
+void HostRunLengthEncodeLane(const uchar *in, uint n_symbols,
+                             std::vector<uchar> &out,
+                             ContextOrder order = ContextOrder::kOrder0) {
+  std::vector<uchar> tokens;
+  RunLengthTokens(in, n_symbols, tokens);
+  HostContexts<kNSymbol, Precision> contexts(order);
+  typename HostContexts<kRunSymbols, Precision>::Model runs;
+  RunLengthState state;
+  state.Init();
+  HostRangeEncoder coder(out);
+  for (uchar token : tokens) {
+    if (state.IsCount()) {
+      coder.Encode(runs, token);
+    } else {
+      coder.Encode(contexts.Current(), token);
+      contexts.Next(token);
+    }
+    state.Next(token);
+  }
+  coder.Flush();
+}
+
+// Same as HostEncodeLane through BlockSort and MoveToFrontEncoder, with the
+// primary index of the lane in front of its code.
+template <uint kNSymbol, typename Precision = Mantissa24Reciprocal>
+void HostBlockSortEncodeLane(const uchar *in, uint n_symbols,
+                             std::vector<uchar> &out,
+                             ContextOrder order = ContextOrder::kOrder0) {
+  std::vector<uchar> indices(n_symbols);
+  uint primary = BlockSort(in, n_symbols, indices.data());
+  MoveToFront(indices.data(), n_symbols);
+  std::vector<uchar> code;
+  HostEncodeLane<kNSymbol, Precision>(indices.data(), n_symbols, code, order);
+  out.resize(sizeof(primary));
+  std::memcpy(out.data(), &primary, sizeof(primary));
+  out.insert(out.end(), code.begin(), code.end());
+}
+
+// Host counterpart of StreamingEncoder. It reduces the alphabet and splits
+// chunks into lanes the same way, so it writes the same containers, and
+// archives from either one decode with every decoder. Lanes of up to
+// n_threads / kNCoders chunks at a time are shared out to n_threads workers.
+// Every precision codes here, exact division included, and so do the binary
+// and rANS engines, which have no precision or context order. The range
+// engine also takes the run-length and block-sort transforms. rANS lanes
+// have rans_states states, RansLaneStates of the device image's width.
+template <uint kNCoders, typename Alphabets>
+class HostStreamEncoder {
+ public:
+  HostStreamEncoder(size_t chunk_size, uint n_threads,
+                    ContextOrder order = ContextOrder::kOrder0,
+                    CoderPrecision precision = CoderPrecision::kMantissa24,
+                    CoderEngine engine = CoderEngine::kRange,
+                    SymbolTransform transform = SymbolTransform::kNone,
+                    uint rans_states = kRansStates)
+      : chunk_size_(chunk_size),
+        lane_size_(ChunkLaneSize(chunk_size, kNCoders)),
+        n_threads_(std::max(n_threads, 1u)),
+        batch_((n_threads_ + kNCoders - 1) / kNCoders),
+        order_(order),
+        precision_(precision),
+        engine_(engine),
+        transform_(transform),
+        rans_states_(rans_states) {
+    if (engine != CoderEngine::kRange && order != ContextOrder::kOrder0) {
+      throw std::runtime_error("only the range engine has order 1");
+    }
+    if (engine != CoderEngine::kRange &&
+        transform != SymbolTransform::kNone) {
+      throw std::runtime_error("only the range engine codes transforms");
+    }
+    if (engine == CoderEngine::kRans) {
+      // throws for a count the lanes cannot have, which also keeps it within
+      // the byte of ContainerHeader::rans_states
+      DispatchRansStates(rans_states, [](auto) {});
+    }
+  }
+
+  // Same contract as StreamingEncoder::Encode.
+  template <typename Sink>
+  size_t Encode(std::istream &in, Sink &&sink) {
+    std::vector<std::vector<uchar>> inputs(batch_);
+    std::vector<std::vector<uchar>> ranked(batch_);
+    std::vector<UsedBytes> used(batch_);
+    std::vector<uint> model_symbols(batch_);
+    std::vector<std::vector<uchar>> lanes(batch_ * kNCoders);
+    size_t total = 0;
+    while (true) {
+      uint n_chunks = 0;
+      for (; n_chunks < batch_; ++n_chunks) {
+        auto &chunk = inputs[n_chunks];
+        chunk.resize(chunk_size_);
+        in.read((char *)chunk.data(), chunk_size_);
+        chunk.resize(in.gcount());
+        if (chunk.empty()) {
+          break;
+        }
+        used[n_chunks] = UsedBytes::Of(chunk.data(), chunk.size());
+        uint alphabet = Alphabets::Select(used[n_chunks].Count());
+        if (alphabet == Alphabets::kCount) {
+          throw std::runtime_error("chunk uses more symbols than any model");
+        }
+        model_symbols[n_chunks] = Alphabets::Size(alphabet);
+        auto ranks = used[n_chunks].Ranks();
+        ranked[n_chunks].resize(chunk.size());
+        for (size_t k = 0; k < chunk.size(); ++k) {
+          ranked[n_chunks][k] = ranks[chunk[k]];
+        }
+      }
+      if (n_chunks == 0) {
+        return total;
+      }
+
+      std::atomic<uint> next_job(0);
+      auto worker = [&] {
+        for (uint job; (job = next_job++) < n_chunks * kNCoders;) {
+          const auto &chunk = ranked[job / kNCoders];
+          uint lane = job % kNCoders;
+          size_t begin = LaneBegin(chunk.size(), lane);
+          uint n_symbols = LaneBegin(chunk.size(), lane + 1) - begin;
+          DispatchModelSymbols(model_symbols[job / kNCoders], [&](auto n) {
+            if (engine_ == CoderEngine::kBinary) {
+              HostBinaryEncodeLane<n>(chunk.data() + begin, n_symbols,
+                                      lanes[job]);
+              return;
+            }
+            if (engine_ == CoderEngine::kRans) {
+              DispatchRansStates(rans_states_, [&](auto n_states) {
+                HostRansEncodeLane<n, n_states>(chunk.data() + begin,
+                                                n_symbols, lanes[job]);
+              });
+              return;
+            }
+            DispatchPrecision(precision_, [&](auto precision) {
+              if (transform_ == SymbolTransform::kRunLength) {
+                HostRunLengthEncodeLane<n, decltype(precision)>(
+                    chunk.data() + begin, n_symbols, lanes[job], order_);
+              } else if (transform_ == SymbolTransform::kBlockSort) {
+                HostBlockSortEncodeLane<n, decltype(precision)>(
+                    chunk.data() + begin, n_symbols, lanes[job], order_);
+              } else {
+                HostEncodeLane<n, decltype(precision)>(
+                    chunk.data() + begin, n_symbols, lanes[job], order_);
+              }
+            });
+          });
+        }
+      };
+      // a job that throws is rethrown here, not left to terminate its thread
+      LaneThreads workers;
+      for (uint t = 1; t < n_threads_; ++t) {
+        workers.Run(worker);
+      }
+      worker();
+      workers.Join();
+
+      for (uint c = 0; c < n_chunks; ++c) {
+        const auto &chunk = inputs[c];
+        MultiStream stream(kNCoders, order_, StreamLayout::kPlain, precision_,
+                           engine_, transform_);
+        stream.SetAlphabet(used[c], model_symbols[c]);
+        if (engine_ == CoderEngine::kRans) {
+          stream.SetRansStates(rans_states_);
+        }
+        for (uint i = 0; i < kNCoders; ++i) {
+          const auto &lane = lanes[c * kNCoders + i];
+          stream.SetLane(i,
+                         LaneBegin(chunk.size(), i + 1) -
+                             LaneBegin(chunk.size(), i),
+                         lane.data(), lane.size());
+        }
+        sink(stream, chunk.data(), chunk.size());
+        total += chunk.size();
+      }
+    }
+  }
+
+ private:
+  size_t LaneBegin(size_t chunk_bytes, uint lane) const {
+    return std::min(size_t(lane) * lane_size_, chunk_bytes);
+  }
+
+  size_t chunk_size_;
+  size_t lane_size_;
+  uint n_threads_;
+  uint batch_;
+  ContextOrder order_;
+  CoderPrecision precision_;
+  CoderEngine engine_;
+  SymbolTransform transform_;
+  uint rans_states_;
+};
+
+#endif  // HOST_ENCODER_HPP
@@ -0,0 +1,86 @@
+#ifndef HOST_MEMORY_HPP_
+#define HOST_MEMORY_HPP_
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <CL/sycl.hpp>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+using namespace sycl;
+
+// Host memory that kernels read and write in place, so that no buffer copy
+// stands between a file and the kernels.
+
+struct UsmFree {
+  context ctx;
+  void operator()(void *p) const { free(p, ctx); }
+};
+
+// A USM host allocation aligned for T, freed when the owner lets it go.
+template <typename T>
+using HostPtr = std::unique_ptr<T[], UsmFree>;
+
+template <typename T>
+HostPtr<T> AllocHost(queue &q, size_t n) {
+  T *p = aligned_alloc_host<T>(alignof(T), std::max(n, size_t(1)), q);
+  if (!p) {
+    throw std::runtime_error("cannot allocate USM host memory");
+  }
+  return HostPtr<T>(p, UsmFree{q.get_context()});
+}
+
+// Whether kernels can take p as it is, without a buffer.
+inline bool IsHostUsm(queue &q, const void *p) {
+  return get_pointer_type(p, q.get_context()) == usm::alloc::host;
+}
+
+// An input file the kernels can read directly. It is mmap-ed and used in
+// place if the device takes system allocations. Otherwise nothing is read
+// here: inputs of many GB do not fit in pinned memory, so the caller streams
+// the file through the encoder's chunk slots instead (see Mapped).
+class HostInput {
+ public:
+  HostInput(queue &q, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("cannot open input file");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw std::runtime_error("cannot stat input file");
+    }
+    size_ = st.st_size;
+    if (q.get_device().has(aspect::usm_system_allocations) && size_ > 0) {
+      void *map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        madvise(map, size_, MADV_SEQUENTIAL);
+        map_ = (uchar *)map;
+      }
+    }
+    close(fd);
+  }
+  ~HostInput() {
+    if (map_) {
+      munmap(map_, size_);
+    }
+  }
+  HostInput(const HostInput &) = delete;
+  HostInput &operator=(const HostInput &) = delete;
+
+  // the mapped file, or nullptr if it is not Mapped
+  const uchar *data() const { return map_; }
+  size_t size() const { return size_; }
+  // true if the kernels read the file in place from its mapping
+  bool Mapped() const { return map_ != nullptr; }
+
+ private:
+  size_t size_ = 0;
+  uchar *map_ = nullptr;
+};
+
+#endif  // HOST_MEMORY_HPP_
@@ -0,0 +1,281 @@
+#ifndef HOST_MODEL_HPP
+#define HOST_MODEL_HPP
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "range_coding.h"
+
+// MantissaMultiply without the 32-step loop. The product adds one truncated
+// term per bit of a, so it splits over the bytes of a. The mantissa always
+// has its low 7 bits clear (m = mantissa >> 7), so the top byte of a
+// contributes exactly (a >> 24) * m. A lower byte v meets M = m >> (17 - 8k):
+// the part of M above bit 7 contributes v * (M >> 7), and only the 7 bits
+// below need the truncated per-bit sum. That sum is under 256 for every
+// (v, M & 127), so it comes from a 32 KB table.
+class TruncatedProduct {
+ public:
+  static uint Multiply(uint a, uint mantissa) {
+    static const Table table;
+    uint m = mantissa >> 7;
+    uint res = (a >> 24) * m;
+    for (uint k = 0; k < 3; ++k) {
+      uint v = (a >> (8 * k)) & 0xff;
+      uint big_m = m >> (17 - 8 * k);
+      res += v * (big_m >> 7) + table.sums[v << 7 | (big_m & 127)];
+    }
+    return res;
+  }
+
+ private:
+  struct Table {
+    std::array<uchar, 256 * 128> sums;
+    Table() {
+      for (uint v = 0; v < 256; ++v) {
+        for (uint low = 0; low < 128; ++low) {
+          uint sum = 0;
+          for (uint q = 0; q < 8; ++q) {
+            sum += ((v >> q) & 1) * (low >> (7 - q));
+          }
+          sums[v << 7 | low] = sum;
+        }
+      }
+    }
+  };
+};
+
+// Host mirror of SimpleModel. The cumulative frequencies sit in a Fenwick
+// tree, so a lookup or an update costs O(log n) instead of a pass over the
+// alphabet, except on the steps where the model normalizes.
+template <uint kNSymbol, typename Precision = Mantissa24Reciprocal>
+class HostSimpleModel {
+  using Model = SimpleModel<kNSymbol>;
+  static constexpr uint kTopBit = 1u << (BitLength(kNSymbol) - 1);
+
+ public:
+  HostSimpleModel() {
+    step_ = 0;
+    for (uint i = 0; i < kNSymbol; ++i) {
+      freqs_[i] = 1;
+    }
+    BuildTree();
+  }
+
+  // Precision::RangeUnit, with TruncatedProduct for the mantissa
+  uint RangeUnit(uint range) const {
+    uint reciprocal = kReciprocalRom<Model, Precision>.reciprocal[step_];
+    if constexpr (std::is_same_v<Precision, Mantissa24Reciprocal>) {
+      return TruncatedProduct::Multiply(range, reciprocal);
+    } else {
+      return Precision::RangeUnit(range, reciprocal);
+    }
+  }
+  uint Freq(uchar symbol) const { return freqs_[symbol]; }
+
+  uint CumulativeFreq(uchar symbol) const {
+    uint cum = 0;
+    for (uint i = symbol; i > 0; i -= i & -i) {
+      cum += tree_[i];
+    }
+    return cum;
+  }
+
+  // Largest symbol with CumulativeFreq(symbol) * range_unit <= code, which is
+  // the same test as CumulativeFreq(symbol) <= code / range_unit.
+  uchar Find(uint code, uint range_unit, uint &cum) const {
+    uint pos = 0;
+    cum = 0;
+    for (uint bit = kTopBit; bit > 0; bit >>= 1) {
+      uint next = pos + bit;
+      if (next <= kNSymbol && (cum + tree_[next]) * range_unit <= code) {
+        pos = next;
+        cum += tree_[next];
+      }
+    }
+    return pos;
+  }
+
+  void Update(uchar symbol) {
+    bool need_norm = kReciprocalRom<Model>.need_norm[step_];
+    step_ = Model::Rom::NextStep(step_);
+    if (need_norm) {
+      for (uint i = 0; i < kNSymbol; ++i) {
+        freqs_[i] = (freqs_[i] >> 1) | 1;
+      }
+      freqs_[symbol] += Model::kStep;
+      BuildTree();
+    } else {
+      freqs_[symbol] += Model::kStep;
+      for (uint i = symbol + 1; i <= kNSymbol; i += i & -i) {
+        tree_[i] += Model::kStep;
+      }
+    }
+  }
+
+ private:
+  void BuildTree() {
+    for (uint i = 1; i <= kNSymbol; ++i) {
+      tree_[i] = freqs_[i - 1];
+    }
+    for (uint i = 1; i <= kNSymbol; ++i) {
+      uint parent = i + (i & -i);
+      if (parent <= kNSymbol) {
+        tree_[parent] += tree_[i];
+      }
+    }
+  }
+
+  RomStep step_;
+  uint freqs_[kNSymbol];
+  uint tree_[kNSymbol + 1];
+};
+
+// Host mirror of SimpleModel under a Precision with kFixedTotal. Every step
+// moves all frequencies, so a Fenwick tree would be rebuilt per symbol.
+// The frequencies are kept flat instead, with the sum of every kBlock of
+// them: the update is one pass over the alphabet that the compiler
+// vectorizes, and a lookup scans the block sums, then one block.
+template <uint kNSymbol, typename Precision>
+class HostFixedTotalModel {
+  static constexpr uint kTotal = 1 << Precision::kTotalBits;
+  static constexpr uint kRate = Precision::kRateBits;
+  static constexpr uint kBlock = std::min(kNSymbol, 16u);
+  static constexpr uint kBlocks = kNSymbol / kBlock;
+
+ public:
+  HostFixedTotalModel() {
+    std::fill(freqs_, freqs_ + kNSymbol, kTotal / kNSymbol);
+    std::fill(sums_, sums_ + kBlocks, kTotal / kBlocks);
+  }
+
+  uint RangeUnit(uint range) const { return Precision::RangeUnit(range, 0); }
+  uint Freq(uchar symbol) const { return freqs_[symbol]; }
+
+  uint CumulativeFreq(uchar symbol) const {
+    uint cum = 0;
+    uint first = symbol / kBlock * kBlock;
+    for (uint b = 0; b < symbol / kBlock; ++b) {
+      cum += sums_[b];
+    }
+    for (uint i = first; i < symbol; ++i) {
+      cum += freqs_[i];
+    }
+    return cum;
+  }
+
+  // Same contract as HostSimpleModel::Find.
+  uchar Find(uint code, uint range_unit, uint &cum) const {
+    uint i = 0;
+    cum = 0;
+    for (uint b = 0; b + 1 < kBlocks && (cum + sums_[b]) * range_unit <= code;
+         ++b, i += kBlock) {
+      cum += sums_[b];
+    }
+    for (uint last = i + kBlock - 1;
+         i < last && (cum + freqs_[i]) * range_unit <= code; ++i) {
+      cum += freqs_[i];
+    }
+    return i;
+  }
+
+  // SimpleModel::MoveFreqs. The pass takes the share of the coded symbol
+  // too, and what the others leave of kTotal is the right amount for it.
+  void Update(uchar symbol) {
+    uint total = 0;
+    for (uint b = 0; b < kBlocks; ++b) {
+      ushort sum = 0;
+      for (uint i = b * kBlock; i < (b + 1) * kBlock; ++i) {
+        freqs_[i] -= (freqs_[i] + (1 << kRate) - 2) >> kRate;
+        sum += freqs_[i];
+      }
+      sums_[b] = sum;
+      total += sum;
+    }
+    freqs_[symbol] += kTotal - total;
+    sums_[symbol / kBlock] += kTotal - total;
+  }
+
+ private:
+  ushort freqs_[kNSymbol];
+  ushort sums_[kBlocks];
+};
+
+// Host mirror of ModelContexts, with the order picked at run time.
+template <uint kNSymbol, typename Precision = Mantissa24Reciprocal>
+class HostContexts {
+ public:
+  explicit HostContexts(ContextOrder order)
+      : order_(order),
+        models_(order == ContextOrder::kOrder1 ? kNSymbol : 1),
+        context_(0) {}
+
+  using Model =
+      std::conditional_t<Precision::kFixedTotal,
+                         HostFixedTotalModel<kNSymbol, Precision>,
+                         HostSimpleModel<kNSymbol, Precision>>;
+
+  Model &Current() { return models_[context_]; }
+  void Next(uchar symbol) {
+    if (order_ == ContextOrder::kOrder1) {
+      context_ = symbol;
+    }
+  }
+
+ private:
+  ContextOrder order_;
+  std::vector<Model> models_;
+  uchar context_;
+};
+
+// Calls f(std::integral_constant<uint, n_symbols>()). The host code takes
+// every power-of-two model size a build can be prebuilt for.
+template <typename F>
+void DispatchModelSymbols(uint n_symbols, F &&f) {
+  bool found = false;
+  fpga_tools::UnrolledLoop<1, 9>([&](auto log) {
+    if (n_symbols == (1u << log)) {
+      f(std::integral_constant<uint, (1u << log)>());
+      found = true;
+    }
+  });
+  if (!found) {
+    throw std::runtime_error("unsupported model size");
+  }
+}
+
+// Calls f(Precision()) with the precision type of id.
+template <typename F>
+void DispatchPrecision(CoderPrecision id, F &&f) {
+  switch (id) {
+    case CoderPrecision::kMantissa24:
+      return f(Mantissa24Reciprocal());
+    case CoderPrecision::kFixedPoint32:
+      return f(FixedPoint32Reciprocal());
+    case CoderPrecision::kExactDivision:
+      return f(ExactDivision());
+    case CoderPrecision::kPowerOfTwo:
+      return f(PowerOfTwoTotal());
+  }
+  throw std::runtime_error("unsupported coder precision");
+}
+
+inline const char *PrecisionName(CoderPrecision id) {
+  const char *name;
+  DispatchPrecision(id, [&](auto p) { name = decltype(p)::kName; });
+  return name;
+}
+
+// The precision called name, as PrecisionName gives it.
+inline CoderPrecision ParsePrecision(const std::string &name) {
+  for (uint id = 0; id < uint(CoderPrecision::kCount); ++id) {
+    if (name == PrecisionName(CoderPrecision(id))) {
+      return CoderPrecision(id);
+    }
+  }
+  throw std::runtime_error("unknown coder precision " + name);
+}
+
+#endif  // HOST_MODEL_HPP
@@ -0,0 +1,172 @@
+#ifndef HOST_RANS_CODER_HPP_
+#define HOST_RANS_CODER_HPP_
+#include <cmath>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "container.hpp"
+#include "rans_coder.hpp"
+
+// The table RansCoder codes a lane of n_symbols ranks with.
+template <uint kNSymbol>
+void RansTable(const uchar *in, uint n_symbols, ushort *freqs) {
+  uint counts[kNSymbol] = {0};
+  for (uint k = 0; k < n_symbols; ++k) {
+    counts[in[k]]++;
+  }
+  NormalizeFreqs(counts, kNSymbol, freqs);
+}
+
+// Calls f(std::integral_constant<uint, n_states>()) for the state counts of
+// RansLaneStates.
+template <typename F>
+void DispatchRansStates(uint n_states, F &&f) {
+  switch (n_states) {
+    case RansLaneStates(1):
+      return f(std::integral_constant<uint, RansLaneStates(1)>());
+    case RansLaneStates(2):
+      return f(std::integral_constant<uint, RansLaneStates(2)>());
+    case RansLaneStates(4):
+      return f(std::integral_constant<uint, RansLaneStates(4)>());
+    case RansLaneStates(8):
+      return f(std::integral_constant<uint, RansLaneStates(8)>());
+    case RansLaneStates(16):
+      return f(std::integral_constant<uint, RansLaneStates(16)>());
+  }
+  throw std::runtime_error("unsupported number of rANS states");
+}
+
+// Throws unless the n frequencies of the table at lane sum to kRansTotal,
+// which the decoders' lookup of a symbol by its slot relies on.
+inline void CheckRansTable(const uchar *lane, uint n) {
+  uint total = 0;
+  for (uint s = 0; s < n; ++s) {
+    total += lane[2 * s] | lane[2 * s + 1] << 8;
+  }
+  if (total != kRansTotal) {
+    throw std::runtime_error("rANS table that does not sum to the total");
+  }
+}
+
+// Whether the table of every lane of stream is the counts of its ranks in
+// the chunk in, scaled to kRansTotal. Rounding moves a frequency by at most
+// the model size from its exact share.
+inline bool RansTablesFit(const MultiStream &stream, const uchar *in) {
+  auto ranks = stream.Used().Ranks();
+  uint n = stream.ModelSymbols();
+  std::vector<uint> counts(n);
+  for (uint i = 0; i < stream.NumLanes(); ++i) {
+    uint n_symbols = stream.Lane(i).n_symbols;
+    const uchar *lane_in = in + stream.LaneStart(i);
+    const uchar *table = stream.LaneData(i);
+    std::fill(counts.begin(), counts.end(), 0);
+    for (uint k = 0; k < n_symbols; ++k) {
+      counts[ranks[lane_in[k]]]++;
+    }
+    for (uint s = 0; s < n && n_symbols > 0; ++s) {
+      uint freq = table[2 * s] | table[2 * s + 1] << 8;
+      double exact = double(counts[s]) * kRansTotal / n_symbols;
+      if ((counts[s] > 0) != (freq > 0) || std::abs(freq - exact) > n) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Encodes one lane into the same bytes as RansCoder -> Store, the table
+// included, with a plain division where the kernel has the reciprocal.
+template <uint kNSymbol, uint kStates = kRansStates>
+void HostRansEncodeLane(const uchar *in, uint n_symbols,
+                        std::vector<uchar> &out) {
+  ushort freqs[kNSymbol];
+  ushort cum[kNSymbol];
+  RansTable<kNSymbol>(in, n_symbols, freqs);
+  out.clear();
+  for (uint s = 0, start = 0; s < kNSymbol; start += freqs[s++]) {
+    cum[s] = start;
+    out.push_back(freqs[s]);
+    out.push_back(freqs[s] >> 8);
+  }
+
+  uint x[kStates];
+  std::fill(x, x + kStates, kRansL);
+  for (uint k = 0; k < n_symbols; ++k) {
+    uchar symbol = in[n_symbols - 1 - k];
+    uint &state = x[k % kStates];
+    uint freq = freqs[symbol];
+    if (state >= (kRansL >> kRansScaleBits << kRansUnitBits) * ulong(freq)) {
+      out.push_back(state);
+      out.push_back(state >> 8);
+      state >>= kRansUnitBits;
+    }
+    state = (state / freq << kRansScaleBits) + state % freq + cum[symbol];
+  }
+  for (uint j = 0; j < kStates; ++j) {
+    for (uint b = 0; b < 4; ++b) {
+      out.push_back(x[j] >> (8 * b));
+    }
+  }
+}
+
+// Decodes a lane of size bytes of RansCoder on the host. Every block of
+// kStates symbols is decoded in two passes: the first steps all states
+// without touching the stream, which leaves it free of dependences between
+// iterations for the compiler to vectorize, and the second renormalizes
+// them in symbol order, which is the order the units were written in.
+// The lane must hold its table and states, as MultiStream checks.
+template <uint kNSymbol, uint kStates = kRansStates>
+void HostRansDecodeLane(const uchar *lane, uint size, uint n_symbols,
+                        uchar *out) {
+  CheckRansTable(lane, kNSymbol);
+  ushort freq[kNSymbol];
+  ushort cum[kNSymbol];
+  uchar slot_symbol[kRansTotal];
+  for (uint s = 0, start = 0; s < kNSymbol; start += freq[s++]) {
+    freq[s] = lane[2 * s] | lane[2 * s + 1] << 8;
+    cum[s] = start;
+    std::fill(slot_symbol + start, slot_symbol + start + freq[s], s);
+  }
+
+  const uchar *units = lane + 2 * kNSymbol;
+  const uchar *in = lane + size;
+  uint x[kStates];
+  for (int j = kStates - 1; j >= 0; --j) {
+    in -= 4;
+    x[j] = in[0] | in[1] << 8 | in[2] << 16 | uint(in[3]) << 24;
+  }
+  auto step = [&](uint &state) {
+    uint slot = state & (kRansTotal - 1);
+    uchar symbol = slot_symbol[slot];
+    state = freq[symbol] * (state >> kRansScaleBits) + slot - cum[symbol];
+    return symbol;
+  };
+  auto renorm = [&](uint &state) {
+    if (state < kRansL) {
+      if (in - units < 2) {
+        throw std::runtime_error("rANS lane that runs into its table");
+      }
+      in -= 2;
+      state = state << kRansUnitBits | in[0] | in[1] << 8;
+    }
+  };
+
+  // symbol k goes to state (n_symbols - 1 - k) % kStates, so after the
+  // first n_symbols % kStates the blocks start at the last state
+  uint head = n_symbols % kStates;
+  for (uint k = 0; k < head; ++k) {
+    out[k] = step(x[head - 1 - k]);
+    renorm(x[head - 1 - k]);
+  }
+  for (uint k = head; k < n_symbols; k += kStates) {
+    for (uint t = 0; t < kStates; ++t) {
+      out[k + t] = step(x[kStates - 1 - t]);
+    }
+    for (uint t = 0; t < kStates; ++t) {
+      renorm(x[kStates - 1 - t]);
+    }
+  }
+}
+
+#endif  // HOST_RANS_CODER_HPP_
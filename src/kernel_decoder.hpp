@@ -0,0 +1,384 @@
+#ifndef KERNEL_DECODER_HPP_
+#define KERNEL_DECODER_HPP_
+#include <algorithm>
+#include <vector>
+
+#include "codec_config.hpp"
+#include "fast_host_decoder.hpp"
+#include "host_decoder.hpp"
+#include "host_memory.hpp"
+#include "lane_threads.hpp"
+#include "test_utils.h"
+
+template <uint kLane>
+class ReadRC;
+template <uint kLane, typename Out>
+class StoreDecoded;
+template <uint kSlot>
+class ReadBarrelRC;
+template <uint kSlot, typename Out>
+class StoreBarrelSlot;
+
+// Wall time from the first kernel start to the last kernel end.
+inline double ElapsedSeconds(event* events, uint n) {
+  using info::event_profiling::command_end;
+  using info::event_profiling::command_start;
+  auto start = events[0].get_profiling_info<command_start>();
+  auto end = events[0].get_profiling_info<command_end>();
+  for (uint i = 1; i < n; ++i) {
+    start = std::min(start, events[i].get_profiling_info<command_start>());
+    end = std::max(end, events[i].get_profiling_info<command_end>());
+  }
+  return (end - start) / 1e9;
+}
+
+// Throws unless the image decodes stream: the lanes, layout, order, engine,
+// precision, rANS states and transform it was built for, and rANS tables
+// that sum to kRansTotal, which the kernels cannot reject.
+inline void CheckKernelStream(const MultiStream& stream) {
+  if (stream.NumLanes() != kNLanes) {
+    throw std::runtime_error("stream coded with another number of lanes");
+  }
+  if (stream.Layout() == StreamLayout::kFastq && !kFastqMode) {
+    throw std::runtime_error("stream with the FASTQ layout");
+  }
+  if (stream.Order() != kOrder) {
+    throw std::runtime_error("stream coded with another context order");
+  }
+  if (stream.Engine() != kEngine) {
+    throw std::runtime_error("stream coded with another engine");
+  }
+  if (kEngine == CoderEngine::kRange && stream.Precision() != Precision::kId) {
+    throw std::runtime_error("stream coded with another precision");
+  }
+  if (kEngine == CoderEngine::kRans &&
+      stream.RansStates() != RansLaneStates(kSymbolsPerCycle)) {
+    throw std::runtime_error("stream coded with another number of rANS states");
+  }
+  for (uint i = 0; i < stream.NumLanes() && kEngine == CoderEngine::kRans;
+       ++i) {
+    CheckRansTable(stream.LaneData(i), stream.ModelSymbols());
+  }
+  if (stream.Transform() != kTransform) {
+    throw std::runtime_error("stream coded with another symbol transform");
+  }
+}
+
+// Decodes the kLanes lanes of stream on the device with one
+// RangeDecoderKernel per lane, or a BinaryDecoderKernel or a
+// RansDecoderKernel per lane with the binary or rANS engine, and returns the
+// decoding time. Run lengths are decoded by a RunLengthDecoderKernel per lane
+// and expanded by a RunLengthExpander on the way to the store. The kernel
+// counters go to perf.
+// When out is USM host memory, the lanes of the plain layout are written
+// straight to their place in it, instead of through per-lane buffers. out has
+// room for capacity bytes.
+template <uint kLanes>
+double KernelDecodeLanes(queue& q, const MultiStream& stream, uchar* out,
+                         size_t capacity, PerfReport& perf) {
+  constexpr uint kRansLaneStates = RansLaneStates(kSymbolsPerCycle);
+  using RCWord = RangeVector::AcIntType;
+  buffer<RCWord, 1> rc_buffer((RCWord*)stream.data(),
+                              range<1>(stream.size() / kRangeOutSize));
+  bool in_place =
+      stream.Layout() == StreamLayout::kPlain && IsHostUsm(q, out);
+  auto sym_buffers = CreateArray<kLanes>([&](size_t i) {
+    return buffer<uchar, 1>(range<1>(
+        in_place ? 1 : std::max(stream.Lane(i).n_symbols, 1u)));
+  });
+  event e_decoding[kLanes];
+  event e_store[kLanes];
+
+  fpga_tools::UnrolledLoop<kLanes>([&](auto i) {
+    uint num_symbols = stream.Lane(i).n_symbols;
+    // FASTQ lanes have one model size each, and an empty lane only has to
+    // drain its words, which any model size does, unless it has a table
+    uint alphabet =
+        stream.Layout() == StreamLayout::kFastq ||
+                (num_symbols == 0 && kEngine != CoderEngine::kRans)
+            ? 0
+            : LaneAlphabets<i>::IndexOf(stream.ModelSymbols());
+    if (alphabet == LaneAlphabets<i>::kCount) {
+      throw std::runtime_error("no decoder for the model size of the stream");
+    }
+    uint prefix = stream.TransformPrefix();
+    uint rc_begin = (stream.Lane(i).offset + prefix) / kRangeOutSize;
+    uint rc_end = rc_begin +
+                  CountVecs<kRangeOutSize>(stream.Lane(i).size - prefix) +
+                  MultiStream::kPadWords;
+    uint rc_size = stream.Lane(i).size;
+    uint n_table = stream.ModelSymbols();
+
+    q.submit([&](handler& h) {
+      auto rc_ptr = rc_buffer.get_access<access::mode::read>(h);
+      h.single_task<ReadRC<i>>([=]() {
+        if constexpr (kEngine == CoderEngine::kRans) {
+          FeedRansDecoder<i, kRansLaneStates>(rc_ptr, rc_begin, rc_size,
+                                              num_symbols, n_table);
+        } else {
+          FeedRangeDecoder<i>(rc_ptr, rc_begin, rc_end, num_symbols);
+        }
+      });
+    });
+
+    e_store[i] = q.submit([&](handler& h) {
+      auto store = [&](auto sym_ptr) {
+        h.single_task<StoreDecoded<i, decltype(sym_ptr)>>([=]() {
+          for (uint k = 0; k < num_symbols; ++k) {
+            if constexpr (kTransform == SymbolTransform::kBlockSort) {
+              sym_ptr[k] = MoveToFrontOutPipes::read<i>();
+            } else {
+              sym_ptr[k] = SymbolOutPipes::read<i>();
+            }
+            if (k % 12800 == 0) {
+              KERNEL_PRINTF("lane %u decoding %u: %c\n", uint(i), k,
+                            char(sym_ptr[k]));
+            }
+          }
+        });
+      };
+      if (in_place) {
+        store(out + stream.LaneStart(i));
+      } else {
+        store(sym_buffers[i].get_access(h));
+      }
+    });
+
+    if constexpr (kTransform == SymbolTransform::kBlockSort) {
+      q.single_task(AlphabetMoveToFrontDecoder<LaneAlphabets<i>, i>{
+          alphabet, num_symbols});
+    }
+    if constexpr (kTransform == SymbolTransform::kRunLength) {
+      e_decoding[i] = q.single_task(
+          AlphabetRunLengthDecoderKernel<LaneAlphabets<i>, i, kOrder,
+                                         SymbolSearch, Precision>{alphabet});
+      q.single_task(RunLengthExpander<i>{num_symbols});
+    } else if constexpr (kEngine == CoderEngine::kBinary) {
+      e_decoding[i] = q.single_task(
+          AlphabetBinaryDecoderKernel<LaneAlphabets<i>, i>{alphabet});
+    } else if constexpr (kEngine == CoderEngine::kRans) {
+      e_decoding[i] = q.single_task(
+          AlphabetRansDecoderKernel<LaneAlphabets<i>, i, kRansLaneStates>{
+              alphabet});
+    } else {
+      e_decoding[i] = q.single_task(
+          AlphabetDecoderKernel<LaneAlphabets<i>, i, kOrder, SymbolSearch,
+                                Precision>{alphabet});
+    }
+  });
+  auto elapsed = ElapsedSeconds(e_decoding, kLanes);
+  fpga_tools::UnrolledLoop<kLanes>([&](auto i) {
+    perf.Collect<RCDataInPipes::PipeAt<i>>(q, "decoder " + std::to_string(i));
+  });
+
+  // the BWT of every lane is undone on the host, one thread each
+  auto undo_block_sorts = [&](auto lane_data) {
+    if constexpr (kTransform == SymbolTransform::kBlockSort) {
+      LaneThreads workers;
+      for (uint i = 0; i < kLanes; ++i) {
+        workers.Run(UndoBlockSort, lane_data(i), stream.Lane(i).n_symbols,
+                    stream.BlockSortIndex(i));
+      }
+      workers.Join();
+    }
+  };
+
+  if (in_place) {
+    for (auto& e : e_store) {
+      e.wait();
+    }
+    undo_block_sorts([&](uint i) { return out + stream.LaneStart(i); });
+    stream.Unrank(out, stream.NumSymbols());
+    return elapsed;
+  }
+  vector<uchar> lanes[kLanes];
+  for (uint i = 0; i < kLanes; ++i) {
+    auto dec_ptr = sym_buffers[i].get_host_access().get_pointer();
+    lanes[i].assign(dec_ptr, dec_ptr + stream.Lane(i).n_symbols);
+  }
+  undo_block_sorts([&](uint i) { return lanes[i].data(); });
+  JoinLanes(stream, lanes, out, capacity);
+  return elapsed;
+}
+
+
+// Containers per KernelDecodeMultiStreams call that fill the barrel.
+constexpr uint kDecodeBatch =
+    kBarrelDecoder ? (kBarrelDepth + kNLanes - 1) / kNLanes : 1;
+
+// Decodes the containers streams[0, n) into outs[0, n) with
+// BarrelDecoderKernel launches of kDepth slots, and returns the decoding
+// time. The lanes of all containers with one model size fill the slots of
+// the same launches, in order, so that a launch only has idle slots when
+// fewer than kDepth lanes of its size are left. A slot takes a lane like
+// RangeDecoderKernel does, from its own FeedRangeDecoder, and gives it to
+// its own store kernel, straight into out when out is USM host memory, else
+// through a buffer per lane. The
+// move-to-front indices and the BWT of block-sorted lanes are undone on the
+// host, one thread per lane.
+template <uint kDepth>
+double KernelDecodeBarrel(queue& q, const MultiStream* streams,
+                          uchar* const* outs, size_t n, PerfReport& perf) {
+  using RCWord = RangeVector::AcIntType;
+  std::vector<buffer<RCWord, 1>> rc_buffers;
+  // lanes with symbols, as container and lane index, by model size
+  std::vector<std::pair<size_t, uint>> by_alphabet[Alphabets::kCount];
+  for (size_t c = 0; c < n; ++c) {
+    const auto& stream = streams[c];
+    rc_buffers.emplace_back((RCWord*)stream.data(),
+                            range<1>(stream.size() / kRangeOutSize));
+    if (stream.NumSymbols() == 0) {
+      continue;
+    }
+    uint alphabet = Alphabets::IndexOf(stream.ModelSymbols());
+    if (alphabet == Alphabets::kCount) {
+      throw std::runtime_error("no decoder for the model size of the stream");
+    }
+    for (uint i = 0; i < stream.NumLanes(); ++i) {
+      if (stream.Lane(i).n_symbols > 0) {
+        by_alphabet[alphabet].push_back({c, i});
+      }
+    }
+  }
+
+  double elapsed = 0;
+  for (uint alphabet = 0; alphabet < Alphabets::kCount; ++alphabet) {
+    const auto& lanes = by_alphabet[alphabet];
+    for (size_t first = 0; first < lanes.size(); first += kDepth) {
+      uint n_slots = std::min<size_t>(kDepth, lanes.size() - first);
+      // lanes that do not go straight to USM host memory, and their buffers
+      std::vector<std::pair<uchar*, buffer<uchar, 1>>> lane_buffers;
+      event e_store[kDepth];
+      fpga_tools::UnrolledLoop<kDepth>([&](auto k) {
+        if (k >= n_slots) {
+          return;
+        }
+        auto [c, i] = lanes[first + k];
+        const auto& stream = streams[c];
+        uint num_symbols = stream.Lane(i).n_symbols;
+        uint prefix = stream.TransformPrefix();
+        uint rc_begin = (stream.Lane(i).offset + prefix) / kRangeOutSize;
+        uint rc_end = rc_begin +
+                      CountVecs<kRangeOutSize>(stream.Lane(i).size - prefix) +
+                      MultiStream::kPadWords;
+        q.submit([&](handler& h) {
+          auto rc_ptr =
+              rc_buffers[c].template get_access<access::mode::read>(h);
+          h.single_task<ReadBarrelRC<k>>([=]() {
+            FeedRangeDecoder<k, BarrelInitPipes, BarrelDataInPipes>(
+                rc_ptr, rc_begin, rc_end, num_symbols);
+          });
+        });
+
+        uchar* lane_out = outs[c] + stream.LaneStart(i);
+        e_store[k] = q.submit([&](handler& h) {
+          auto store = [&](auto sym_ptr) {
+            h.single_task<StoreBarrelSlot<k, decltype(sym_ptr)>>([=]() {
+              for (uint j = 0; j < num_symbols; ++j) {
+                sym_ptr[j] = BarrelSymbolOutPipes::read<k>();
+              }
+            });
+          };
+          if (IsHostUsm(q, lane_out)) {
+            store(lane_out);
+          } else {
+            lane_buffers.emplace_back(lane_out, range<1>(num_symbols));
+            store(lane_buffers.back().second.get_access(h));
+          }
+        });
+      });
+      event e_decoding = q.single_task(
+          AlphabetBarrelDecoderKernel<Alphabets, kDepth, kOrder, SymbolSearch,
+                                      Precision>{alphabet, n_slots});
+      for (uint k = 0; k < n_slots; ++k) {
+        e_store[k].wait();
+      }
+      elapsed += ElapsedSeconds(&e_decoding, 1);
+      perf.Collect<BarrelDataInPipes>(q, "barrel decoder");
+      for (auto& [lane_out, lane_buffer] : lane_buffers) {
+        auto dec_ptr = lane_buffer.get_host_access().get_pointer();
+        std::copy(dec_ptr, dec_ptr + lane_buffer.size(), lane_out);
+      }
+    }
+  }
+
+  for (size_t c = 0; c < n; ++c) {
+    const auto& stream = streams[c];
+    if constexpr (kTransform == SymbolTransform::kBlockSort) {
+      LaneThreads workers;
+      for (uint i = 0; i < stream.NumLanes(); ++i) {
+        workers.Run([&stream, out = outs[c], i] {
+          uint n_symbols = stream.Lane(i).n_symbols;
+          uchar* lane = out + stream.LaneStart(i);
+          UndoMoveToFront(lane, n_symbols);
+          UndoBlockSort(lane, n_symbols, stream.BlockSortIndex(i));
+        });
+      }
+      workers.Join();
+    }
+    stream.Unrank(outs[c], stream.NumSymbols());
+  }
+  return elapsed;
+}
+
+// Decodes the containers streams[0, n) into outs[0, n), of capacity bytes
+// each, and returns the decoding time. The barrel decoder fills its slots
+// with the lanes of all of them, and the decoders per lane take one container
+// at a time.
+inline double KernelDecodeMultiStreams(queue& q, const MultiStream* streams,
+                                       uchar* const* outs, size_t n,
+                                       size_t capacity, PerfReport& perf) {
+  for (size_t c = 0; c < n; ++c) {
+    CheckKernelStream(streams[c]);
+    streams[c].CheckOutput(capacity);
+  }
+  if constexpr (kBarrelDecoder) {
+    return KernelDecodeBarrel<kBarrelDepth>(q, streams, outs, n, perf);
+  } else {
+    double elapsed = 0;
+    for (size_t c = 0; c < n; ++c) {
+      elapsed += KernelDecodeLanes<kNLanes>(q, streams[c], outs[c], capacity,
+                                            perf);
+    }
+    return elapsed;
+  }
+}
+
+// One container, which only gives the barrel decoder its own lanes.
+inline double KernelDecodeMultiStream(queue& q, const MultiStream& stream,
+                                      uchar* out, size_t capacity,
+                                      PerfReport& perf) {
+  return KernelDecodeMultiStreams(q, &stream, &out, 1, capacity, perf);
+}
+
+// Host decoding of either layout with the reference or the fast decoder.
+// The reference decoder only takes the range engine with the 24-bit mantissa
+// precision, without run lengths. The fast one takes the binary and rANS
+// engines and run lengths too. Both take block-sorted streams. out has room
+// for capacity bytes.
+inline void HostDecode(const MultiStream& stream, uchar* out,
+                       size_t capacity) {
+  CheckReferenceDecoder(stream);
+  stream.CheckOutput(capacity);
+  if (stream.Layout() == StreamLayout::kFastq) {
+    DecodeFastqStream(stream, out, capacity, [](auto n_symbols, auto... args) {
+      HostDecodeLane<n_symbols>(args...);
+    });
+  } else {
+    HostDecodeMultiStream(stream, out);
+  }
+}
+
+inline void FastHostDecode(const MultiStream& stream, uchar* out,
+                           size_t capacity) {
+  stream.CheckOutput(capacity);
+  if (stream.Layout() == StreamLayout::kFastq) {
+    DecodeFastqStream(stream, out, capacity, [](auto n_symbols, auto... args) {
+      FastHostDecodeLane<n_symbols>(args...);
+    });
+  } else {
+    FastHostDecodeMultiStream(stream, out);
+  }
+}
+
+#endif  // KERNEL_DECODER_HPP_
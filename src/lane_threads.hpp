@@ -0,0 +1,59 @@
+#ifndef LANE_THREADS_HPP_
+#define LANE_THREADS_HPP_
+#include <deque>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <utility>
+
+// One thread per lane for the host decoders, and the workers of the host
+// encoder. An exception that leaves a thread function terminates the
+// process, so every thread keeps the one it threw, and Join rethrows the
+// first of them on the calling thread, once all threads are done. A corrupt
+// container is then rejected like any other.
+class LaneThreads {
+ public:
+  LaneThreads() = default;
+  LaneThreads(const LaneThreads &) = delete;
+  LaneThreads &operator=(const LaneThreads &) = delete;
+  ~LaneThreads() { JoinAll(); }
+
+  // Runs f(args...) on a thread of its own.
+  template <typename F, typename... Args>
+  void Run(F &&f, Args &&...args) {
+    // a deque keeps the places of the errors as threads are added
+    std::exception_ptr &error = errors_.emplace_back();
+    threads_.emplace_back(
+        [&error, task = std::bind(std::forward<F>(f),
+                                  std::forward<Args>(args)...)]() mutable {
+          try {
+            task();
+          } catch (...) {
+            error = std::current_exception();
+          }
+        });
+  }
+
+  void Join() {
+    JoinAll();
+    for (auto &error : errors_) {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+  }
+
+ private:
+  void JoinAll() {
+    for (auto &t : threads_) {
+      if (t.joinable()) {
+        t.join();
+      }
+    }
+  }
+
+  std::deque<std::thread> threads_;
+  std::deque<std::exception_ptr> errors_;
+};
+
+#endif  // LANE_THREADS_HPP_
@@ -1,146 +1,166 @@
-
-
+#include <algorithm>
 #include <chrono>
+#include <string>
 #include <vector>
 
-#include "host_decoder.hpp"
-#include "range_decoder.hpp"
-#include "range_encoder.hpp"
-#include "store.hpp"
-#include "test_utils.h"
+#include "host_encoder.hpp"
+#include "kernel_decoder.hpp"
 
-using SymbPipe = ext::intel::pipe<class SxxxqP, FlagBundle<uchar>, 256>;
-
-#ifdef FPGA_REPORT
-constexpr uint kNSymbols = 32;
-#else
-constexpr uint kNSymbols = 256;
-#endif
+// HostDecoder divides through the float reciprocal of the mantissa path
+constexpr bool kReferenceDecoder =
+    kEngine == CoderEngine::kRange &&
+    Precision::kId == CoderPrecision::kMantissa24 &&
+    kTransform != SymbolTransform::kRunLength;
 
 int main(int argc, char** argv) {
   auto q = CreateQueue();
 
-  struct stat fstat;
-  stat(argv[1], &fstat);
-  uint file_size = fstat.st_size;
-  if (file_size > 3L * 1024 * 1024 * 1024) {
-    throw std::runtime_error("file too large");
+  // read in place by the encoder kernels if it maps, see HostInput
+  HostInput input(q, argv[1]);
+  std::ifstream in_file;
+  if (!input.Mapped()) {
+    in_file.open(argv[1], std::ios::binary);
   }
-  std::ifstream input_file(argv[1]);
-  auto fq_host_buffer = std::make_unique<uchar[]>(file_size);
-  input_file.read((char*)fq_host_buffer.get(), file_size);
-  input_file.close();
-
-  buffer<uchar, 1> fq_buffer = {range<1>(file_size)};
-
-  q.submit([&](handler& h) {
-     auto acc = fq_buffer.get_access<access::mode::write>(h);
-     h.copy(fq_host_buffer.get(), acc);
-   }).wait();
-
-  // launch------------------
-
-  q.single_task<class Model>(
-      SimpleModelKernel<SymbPipe, FrequncePipes::PipeAt<0>, kNSymbols>{});
-  DoubleBufferingStore<1> store(file_size);
-  store.Launch(q, 0);
-
-  q.submit([&](handler& h) {
-    auto acc = fq_buffer.get_access<access::mode::read>(h);
-    h.single_task<class ReadSymbols>([=] {
-      for (uint i = 0; i < acc.get_size(); ++i) {
-        SymbPipe::write({acc[i], i == acc.get_size() - 1});
+  std::ofstream out_file;
+  if (argc > 2) {
+    out_file.open(argv[2], std::ios::binary);
+  }
+  size_t chunk_size = argc > 3 ? std::stoul(argv[3]) << 20 : kChunkSize;
+
+  size_t n_chunks = 0;
+  size_t compressed_size = 0;
+  double host_seconds = 0;
+  double fast_host_seconds = 0;
+  double kernel_seconds = 0;
+  bool host_encode_ok = true;
+  bool rans_tables_ok = true;
+  bool host_decode_ok = true;
+  bool fast_host_decode_ok = true;
+  bool kernel_decode_ok = true;
+  PerfReport decode_perf;
+  // USM host memory, so that the kernels decode straight into it
+  auto decoded = AllocHost<uchar>(q, chunk_size);
+  vector<uchar> host_lane;
+  vector<uchar> ranked;
+  vector<uchar> split_lanes[std::max(kNLanes, kFastqLanes)];
+  size_t split_counts[kFastqLanes];
+
+  Encoder encoder(q, chunk_size);
+  auto check_chunk = [&](const MultiStream& stream, const uchar* in,
+                         size_t size) {
+    n_chunks++;
+    compressed_size += stream.size();
+    if (out_file.is_open()) {
+      stream.WriteFrame(out_file);
+    }
+
+    bool fastq = stream.Layout() == StreamLayout::kFastq;
+    if (fastq) {
+      ScanFastq(in, size, split_counts, split_lanes);
+    } else {
+      auto ranks = stream.Used().Ranks();
+      ranked.resize(size);
+      for (size_t k = 0; k < size; ++k) {
+        ranked[k] = ranks[in[k]];
       }
-    });
-  });
-  auto e_encoding = q.single_task(RangeCoder<1>{});
-
-  store.ApplyCarry(0, 0);
-
-  auto start_enc =
-      e_encoding.get_profiling_info<info::event_profiling::command_start>() *
-      1.0 / 1e9;
-  auto end_enc =
-      e_encoding.get_profiling_info<info::event_profiling::command_end>() *
-      1.0 / 1e9;
-  auto thpt_enc = file_size * 1.0 / (end_enc - start_enc);
-
-  printf("encoding thpt: %.4f M/s\n", thpt_enc / 1024 / 1024);
+    }
+    if constexpr (kEngine == CoderEngine::kRans) {
+      rans_tables_ok &= RansTablesFit(stream, in);
+    }
+    for (uint i = 0; i < kNLanes; ++i) {
+      uint n_symbols = fastq ? FastqLaneSymbols(i) : stream.ModelSymbols();
+      const uchar* lane_in = fastq ? split_lanes[i].data()
+                                   : ranked.data() + stream.LaneStart(i);
+      DispatchModelSymbols(n_symbols, [&](auto n) {
+        if constexpr (kEngine == CoderEngine::kBinary) {
+          HostBinaryEncodeLane<n>(lane_in, stream.Lane(i).n_symbols,
+                                  host_lane);
+        } else if constexpr (kEngine == CoderEngine::kRans) {
+          HostRansEncodeLane<n, RansLaneStates(kSymbolsPerCycle)>(
+              lane_in, stream.Lane(i).n_symbols, host_lane);
+        } else if constexpr (kTransform == SymbolTransform::kRunLength) {
+          HostRunLengthEncodeLane<n, Precision>(
+              lane_in, stream.Lane(i).n_symbols, host_lane, kOrder);
+        } else if constexpr (kTransform == SymbolTransform::kBlockSort) {
+          HostBlockSortEncodeLane<n, Precision>(
+              lane_in, stream.Lane(i).n_symbols, host_lane, kOrder);
+        } else {
+          HostEncodeLane<n, Precision>(lane_in, stream.Lane(i).n_symbols,
+                                       host_lane, kOrder);
+        }
+      });
+      host_encode_ok &=
+          host_lane.size() == stream.Lane(i).size &&
+          std::equal(host_lane.begin(), host_lane.end(), stream.LaneData(i));
+    }
+
+    auto host_start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> host_elapsed;
+    if (kReferenceDecoder) {
+      HostDecode(stream, decoded.get(), chunk_size);
+      host_elapsed = std::chrono::steady_clock::now() - host_start;
+      host_seconds += host_elapsed.count();
+      host_decode_ok &= memcmp(decoded.get(), in, size) == 0;
+    }
+
+    host_start = std::chrono::steady_clock::now();
+    FastHostDecode(stream, decoded.get(), chunk_size);
+    host_elapsed = std::chrono::steady_clock::now() - host_start;
+    fast_host_seconds += host_elapsed.count();
+    fast_host_decode_ok &= memcmp(decoded.get(), in, size) == 0;
+
+    kernel_seconds += KernelDecodeMultiStream(q, stream, decoded.get(),
+                                              chunk_size, decode_perf);
+    if (memcmp(decoded.get(), in, size) != 0 && kernel_decode_ok) {
+      kernel_decode_ok = false;
+      std::ofstream dec_dump(std::string(argv[1]) + ".decode-dump");
+      dec_dump.write((char*)decoded.get(), size);
+      dec_dump.close();
+    }
+  };
+  size_t file_size =
+      input.Mapped()
+          ? encoder.Encode(input.data(), input.size(), check_chunk)
+          : encoder.Encode(in_file, check_chunk);
+
+  printf("encoding thpt: %.4f M/s\n",
+         file_size / encoder.EncodingSeconds() / 1024 / 1024);
+  printf("%u lanes, %zu chunks of %zu bytes, compressed size: %zu, "
+         "ratio: %.4f\n",
+         kNLanes, n_chunks, chunk_size,
+         compressed_size, compressed_size * 1.0 / file_size);
+
+  printf(host_encode_ok ? "host encoder matches kernel\n"
+                        : "host encoder mismatch\n");
+  if (kEngine == CoderEngine::kRans) {
+    printf(rans_tables_ok ? "rans tables fit the counts\n"
+                          : "rans tables do not fit the counts\n");
+  }
 
   printf("-----------host deocoding\n");
-
-  HostDecoder decoder(store.rc_buffer[0][0].get_host_access().get_pointer());
-  SIMPLE_MODEL<kNSymbols> model;
-  vector<uchar> decoded(file_size, 0);
-  for (uint i = 0; i < file_size - 1; ++i) {
-    decoded[i] = model.decodeSymbol(decoder);
-  }
-  if (memcmp(decoded.data(), fq_host_buffer.get(), file_size - 1) != 0) {
-    printf("decode failed\n");
-    printf("truth: {%.*s}\n", file_size, (char*)fq_host_buffer.get());
-    printf("decode: {%.*s}\n", file_size, (char*)decoded.data());
+  if (kReferenceDecoder) {
+    printf("host decoding thpt: %.4f M/s\n",
+           file_size / host_seconds / 1024 / 1024);
+    printf(host_decode_ok ? "host decode successfully\n"
+                          : "decode failed\n");
   } else {
-    printf("host decode successfully\n");
+    printf("host decoder skipped, it only takes the range engine with the "
+           "mantissa precision and no run lengths\n");
   }
+  printf("fast host decoding thpt: %.4f M/s\n",
+         file_size / fast_host_seconds / 1024 / 1024);
+  printf(fast_host_decode_ok ? "fast host decode successfully\n"
+                             : "fast host decode failed\n");
 
   printf("-----------kernel deocoding\n");
-
-  FreqUpdater<kNSymbols> fu;
-  q.single_task<decltype(fu)>([=] { fu(file_size); });
-
-  q.submit([&](handler& h) {
-    auto rc_ptr = store.rc_buffer[0][0].get_access(h);
-    auto rc_size = store.rc_size_buffer[0].get_host_access()[0];
-    h.single_task<class ReadRC>([=]() {
-      auto code_data = rc_ptr[1];
-      auto stream_init = rc_ptr[2];
-      uint code_init = 0;
-      uchar* p = (uchar*)&code_data;
-#pragma unroll
-      for (uint i = 0; i < 4; ++i) {
-        code_init = code_init << 8 | p[i];
-      }
-      RCInitPipe::write({file_size, code_init, stream_init});
-      for (uint i = 3; i < CountVecs<kRangeOutSize>(rc_size) + 2; ++i) {
-        UintRCVecx2 v = 0;
-        v |= rc_ptr[i];
-        RCDataInPipe::write(v);
-      }
-    });
-  });
-
-  buffer<uchar, 1> sym_buffer = {range<1>(file_size)};
-  q.submit([&](handler& h) {
-    auto sym_ptr = sym_buffer.get_access(h);
-    h.single_task<class StoreDecoded>([=]() {
-      for (uint i = 0; i < file_size; ++i) {
-        sym_ptr[i] = SymbolOutPipe::read();
-        if (i % 12800 == 0) {
-          KERNEL_PRINTF("decoding %u: %c\n", i, char(sym_ptr[i]));
-        }
-      }
-    });
-  });
-
-  auto e_decoding = q.single_task(RangeDecoderKernel<kNSymbols>());
-  auto start =
-      e_decoding.get_profiling_info<info::event_profiling::command_start>() *
-      1.0 / 1e9;
-  auto end =
-      e_decoding.get_profiling_info<info::event_profiling::command_end>() *
-      1.0 / 1e9;
-  auto thpt = file_size * 1.0 / (end - start);
-
-  printf("decoding elapsed: %.4f s\n", end - start);
-  printf("decoding thpt: %.4f M/s\n", thpt / 1024 / 1024);
-
-  auto dec_ptr = sym_buffer.get_host_access().get_pointer();
-  if (memcmp(dec_ptr, fq_host_buffer.get(), file_size - 1) != 0) {
-    printf("kernel decode failed\n");
-    std::ofstream dec_dump(std::string(argv[1]) + ".decode-dump");
-    dec_dump.write((char*)dec_ptr, file_size - 1);
-    dec_dump.close();
-  } else {
-    printf("kernel decode successfully\n");
+  printf("decoding elapsed: %.4f s\n", kernel_seconds);
+  printf("decoding thpt: %.4f M/s\n", file_size / kernel_seconds / 1024 / 1024);
+  printf(kernel_decode_ok ? "kernel decode successfully\n"
+                          : "kernel decode failed\n");
+
+  if (kPerfCounters) {
+    printf("-----------kernel counters\n");
+    encoder.Perf().Print(stdout);
+    decode_perf.Print(stdout);
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,179 @@
+#ifndef PERF_COUNTERS_HPP_
+#define PERF_COUNTERS_HPP_
+#include <CL/sycl.hpp>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <sycl/ext/intel/fpga_extensions.hpp>
+
+using namespace sycl;
+
+// Event counters of the coding kernels, compiled in with PERF_COUNTERS.
+// Without it every method is empty and the kernels are unchanged.
+//
+// A kernel counts into a PerfCounters in registers and, when it is done,
+// writes it to the PerfPipe of its key, the pipe the kernel reads its input
+// from. The host collects it from there with PerfReport::Collect after the
+// kernel has run. A kernel that finds the PerfPipe still full waits for the
+// host to collect the previous value.
+#ifdef PERF_COUNTERS
+constexpr bool kPerfCounters = true;
+#else
+constexpr bool kPerfCounters = false;
+#endif
+
+struct PerfCounters {
+  // main loop iterations, one per clock cycle at II=1
+  ulong cycles;
+  // non-blocking pipe reads of a live lane that found the pipe empty
+  ulong empty_reads;
+  // iterations that could not take input because output was still draining
+  ulong stalls;
+  // renormalizations by the number of bytes shifted out, 0 to 3
+  ulong renorms[4];
+  // overflows of low that had to be added to bytes already sent
+  ulong carries;
+  // model normalizations, where the frequencies are halved
+  ulong norms;
+
+  void Init() {
+    if constexpr (kPerfCounters) {
+      cycles = empty_reads = stalls = carries = norms = 0;
+#pragma unroll
+      for (uint i = 0; i < 4; ++i) {
+        renorms[i] = 0;
+      }
+    }
+  }
+  void Cycle() {
+    if constexpr (kPerfCounters) {
+      cycles++;
+    }
+  }
+  void EmptyRead(bool empty) {
+    if constexpr (kPerfCounters) {
+      empty_reads += empty;
+    }
+  }
+  void Stall(bool stall) {
+    if constexpr (kPerfCounters) {
+      stalls += stall;
+    }
+  }
+  void Renorm(bool coded, uint n_bytes) {
+    if constexpr (kPerfCounters) {
+#pragma unroll
+      for (uint i = 0; i < 4; ++i) {
+        renorms[i] += coded && n_bytes == i;
+      }
+    }
+  }
+  void Carry(bool carry) {
+    if constexpr (kPerfCounters) {
+      carries += carry;
+    }
+  }
+  void Norm(bool norm) {
+    if constexpr (kPerfCounters) {
+      norms += norm;
+    }
+  }
+
+  template <typename Key>
+  void Send() const;
+
+  void Add(const PerfCounters &o) {
+    cycles += o.cycles;
+    empty_reads += o.empty_reads;
+    stalls += o.stalls;
+    for (uint i = 0; i < 4; ++i) {
+      renorms[i] += o.renorms[i];
+    }
+    carries += o.carries;
+    norms += o.norms;
+  }
+};
+
+template <typename Key>
+class PerfPipeId;
+template <typename Key>
+using PerfPipe = ext::intel::pipe<PerfPipeId<Key>, PerfCounters, 1>;
+
+template <typename Key>
+void PerfCounters::Send() const {
+  if constexpr (kPerfCounters) {
+    PerfPipe<Key>::write(*this);
+  }
+}
+
+template <typename Key>
+class CollectPerfCounters;
+
+// Host side: the counters of every kernel, summed over the chunks.
+class PerfReport {
+ public:
+  // Reads the counters that the kernel keyed by Key sent, and adds them to
+  // the entry called name. Blocks until that kernel is done.
+  template <typename Key>
+  void Collect(queue &q, const std::string &name) {
+    if constexpr (kPerfCounters) {
+      // USM and an event wait rather than a buffer, so that collecting does
+      // not wait on other kernels, which may run for good (see RangeCodec)
+      PerfCounters *out = malloc_host<PerfCounters>(1, q);
+      q.single_task<CollectPerfCounters<Key>>(
+           [=] { *out = PerfPipe<Key>::read(); })
+          .wait();
+      Entry(name).Add(*out);
+      free(out, q);
+    }
+  }
+
+  void Add(const PerfReport &o) {
+    for (const auto &[name, c] : o.entries_) {
+      Entry(name).Add(c);
+    }
+  }
+
+  void Print(FILE *f) const {
+    for (const auto &[name, c] : entries_) {
+      fprintf(f,
+              "%-12s cycles %lu, empty reads %lu, stalls %lu, "
+              "renorms 0/1/2/3 bytes %lu/%lu/%lu/%lu, carries %lu, "
+              "norms %lu\n",
+              name.c_str(), c.cycles, c.empty_reads, c.stalls, c.renorms[0],
+              c.renorms[1], c.renorms[2], c.renorms[3], c.carries, c.norms);
+    }
+  }
+
+  // A JSON object with one member per kernel.
+  void WriteJson(FILE *f) const {
+    fprintf(f, "{");
+    for (size_t k = 0; k < entries_.size(); ++k) {
+      const auto &[name, c] = entries_[k];
+      fprintf(f,
+              "%s\"%s\": {\"cycles\": %lu, \"empty_reads\": %lu, "
+              "\"stalls\": %lu, \"renorms\": [%lu, %lu, %lu, %lu], "
+              "\"carries\": %lu, \"norms\": %lu}",
+              k > 0 ? ", " : "", name.c_str(), c.cycles, c.empty_reads,
+              c.stalls, c.renorms[0], c.renorms[1], c.renorms[2],
+              c.renorms[3], c.carries, c.norms);
+    }
+    fprintf(f, "}");
+  }
+
+ private:
+  PerfCounters &Entry(const std::string &name) {
+    for (auto &[n, c] : entries_) {
+      if (n == name) {
+        return c;
+      }
+    }
+    entries_.emplace_back(name, PerfCounters{});
+    return entries_.back().second;
+  }
+
+  std::vector<std::pair<std::string, PerfCounters>> entries_;
+};
+
+#endif  // PERF_COUNTERS_HPP_
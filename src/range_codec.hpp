@@ -0,0 +1,459 @@
+#ifndef RANGE_CODEC_HPP_
+#define RANGE_CODEC_HPP_
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "container.hpp"
+#include "host_memory.hpp"
+#include "range_decoder.hpp"
+#include "stream_encoder.hpp"
+#include "test_utils.h"
+
+// A compressor for many independent objects. The coding kernels are
+// launched once and stay resident, each serving one job descriptor per call
+// from its job pipe. Every call then costs a single small dispatch kernel
+// that hands out the descriptors and waits for the chain to finish, and its
+// buffers come from a pool of USM host memory held for the life of the
+// codec.
+//
+// CompressBatch codes many short messages, packed one after the other, with
+// one dispatch kernel. The kernels start every message from fresh model and
+// coder state, so each message still makes a container of its own.
+//
+// The codec owns the coding pipes while it lives, so it does not run next
+// to StreamingEncoder or KernelDecodeMultiStream in the same process.
+
+using RCWord = RangeVector::AcIntType;
+
+struct SymbolReadJob {
+  const uchar *in;
+  uint begin;
+  uint end;
+  bool exit;  // stops the persistent kernel
+};
+struct AlphabetJob {
+  uint alphabet;
+  bool exit;
+};
+template <uint kNCoders>
+struct StoreJob {
+  StoreBurst *out[kNCoders];
+  uint *sizes;
+  bool signal;  // writes StoreDonePipe when stored
+  bool exit;
+};
+struct RCReadJob {
+  const RCWord *rc;
+  uint begin;
+  uint end;
+  uint num_symbols;
+  bool exit;
+};
+struct DecodedStoreJob {
+  uchar *out;
+  uint num_symbols;
+  bool exit;
+};
+
+using SymbolReadJobPipes =
+    PipeArray<class SymRdJobP, SymbolReadJob, 2, kMaxCoders>;
+using ModelJobPipes = PipeArray<class ModelJobP, AlphabetJob, 2, kMaxCoders>;
+using CoderJobPipe = ext::intel::pipe<class CoderJobP, AlphabetJob, 2>;
+template <uint kNCoders>
+using StoreJobPipe = ext::intel::pipe<class StoreJobP, StoreJob<kNCoders>, 2>;
+using StoreDonePipe = ext::intel::pipe<class StoreDoneP, bool, 2>;
+using RCReadJobPipes = PipeArray<class RCRdJobP, RCReadJob, 2, kMaxCoders>;
+using DecoderJobPipes = PipeArray<class DecJobP, AlphabetJob, 2, kMaxCoders>;
+using DecodedStoreJobPipes =
+    PipeArray<class DecStJobP, DecodedStoreJob, 2, kMaxCoders>;
+using DecodeDonePipes = PipeArray<class DecDoneP, bool, 2, kMaxCoders>;
+
+// Runs action(job) for every job read from JobPipe, until one has exit set.
+// ForeverRun with a way to stop it.
+template <typename JobPipe, typename Action>
+void ServeJobs(Action &&action) {
+  while (true) {
+    auto job = JobPipe::read();
+    if (job.exit) {
+      break;
+    }
+    action(job);
+  }
+}
+
+// A USM pointer with the accessor interface that Store uses.
+template <typename T>
+struct UsmAccessor {
+  T *ptr;
+  T &operator[](size_t idx) const { return ptr[idx]; }
+  global_ptr<T> get_pointer() const { return global_ptr<T>(ptr); }
+};
+
+template <uint kLane>
+struct PersistentReadSymbols {
+  void operator()() const {
+    ServeJobs<SymbolReadJobPipes::PipeAt<kLane>>([](const SymbolReadJob &job) {
+      for (uint k = job.begin; k < job.end; ++k) {
+        SymbPipes::write<kLane>({job.in[k], false});
+      }
+      SymbPipes::write<kLane>({0, true});
+    });
+  }
+};
+
+template <uint kLane, typename Alphabets, ContextOrder kOrder,
+          typename Precision>
+struct PersistentModel {
+  void operator()() const {
+    ServeJobs<ModelJobPipes::PipeAt<kLane>>([](const AlphabetJob &job) {
+      AlphabetModelKernel<SymbPipes::PipeAt<kLane>,
+                          FrequncePipes::PipeAt<kLane>, Alphabets, kOrder,
+                          Precision>{job.alphabet}();
+    });
+  }
+};
+
+template <uint kNCoders, typename Precision>
+struct PersistentCoder {
+  void operator()() const {
+    ServeJobs<CoderJobPipe>(
+        [](const AlphabetJob &) { RangeCoder<kNCoders, Precision>{}(); });
+  }
+};
+
+template <uint kNCoders>
+struct PersistentStore {
+  void operator()() const {
+    ServeJobs<StoreJobPipe<kNCoders>>([](const StoreJob<kNCoders> &job) {
+      std::array<UsmAccessor<StoreBurst>, kNCoders> outs;
+#pragma unroll
+      for (uint i = 0; i < kNCoders; ++i) {
+        outs[i] = {job.out[i]};
+      }
+      UsmAccessor<uint> sizes{job.sizes};
+      Store<kNCoders>(outs, sizes);
+      if (job.signal) {
+        StoreDonePipe::write(true);
+      }
+    });
+  }
+};
+
+template <uint kLane>
+struct PersistentReadRC {
+  void operator()() const {
+    ServeJobs<RCReadJobPipes::PipeAt<kLane>>([](const RCReadJob &job) {
+      FeedRangeDecoder<kLane>(job.rc, job.begin, job.end, job.num_symbols);
+    });
+  }
+};
+
+template <uint kLane, typename Alphabets, ContextOrder kOrder,
+          typename SymbolSearch, typename Precision>
+struct PersistentDecoder {
+  void operator()() const {
+    ServeJobs<DecoderJobPipes::PipeAt<kLane>>([](const AlphabetJob &job) {
+      AlphabetDecoderKernel<Alphabets, kLane, kOrder, SymbolSearch,
+                            Precision>{job.alphabet}();
+    });
+  }
+};
+
+template <uint kLane>
+struct PersistentStoreDecoded {
+  void operator()() const {
+    ServeJobs<DecodedStoreJobPipes::PipeAt<kLane>>(
+        [](const DecodedStoreJob &job) {
+          for (uint k = 0; k < job.num_symbols; ++k) {
+            job.out[k] = SymbolOutPipes::read<kLane>();
+          }
+          DecodeDonePipes::write<kLane>(true);
+        });
+  }
+};
+
+template <typename Codec>
+class DispatchEncode;
+template <typename Codec>
+class DispatchBatch;
+template <typename Codec>
+class DispatchDecode;
+template <typename Codec>
+class StopCodec;
+
+template <uint kNCoders, typename Alphabets,
+          ContextOrder kOrder = ContextOrder::kOrder0,
+          typename SymbolSearch = TreeSymbolSearch,
+          typename Precision = Mantissa24Reciprocal>
+class RangeCodec {
+ public:
+  // max_size is the largest object Compress and Decompress take, and the
+  // largest total of a batch of at most max_messages messages.
+  explicit RangeCodec(size_t max_size, size_t max_messages = 1)
+      : q_(CreateQueue()),
+        max_size_(max_size),
+        max_messages_(max_messages),
+        // every message rounds its lane sizes up and flushes on its own
+        lane_bursts_(DoubleBufferingStore<kNCoders>::RCCapacity(
+                         CountVecs<kNCoders>(max_size) + max_messages) +
+                     2 * max_messages),
+        in_(AllocHost<uchar>(q_, max_size)),
+        msg_offsets_(AllocHost<uint>(q_, max_messages + 1)),
+        alphabets_(AllocHost<uint>(q_, max_messages)),
+        rc_(AllocHost<StoreBurst>(q_, kNCoders * lane_bursts_)),
+        rc_offsets_(AllocHost<uint>(q_, kNCoders * max_messages)),
+        rc_sizes_(AllocHost<uint>(q_, kNCoders * max_messages)),
+        container_(AllocHost<uchar>(q_, MaxContainerSize())),
+        out_(AllocHost<uchar>(q_, max_size)) {
+    fpga_tools::UnrolledLoop<kNCoders>([&](auto i) {
+      q_.single_task(PersistentReadSymbols<i>{});
+      q_.single_task(PersistentModel<i, Alphabets, kOrder, Precision>{});
+      q_.single_task(PersistentReadRC<i>{});
+      q_.single_task(
+          PersistentDecoder<i, Alphabets, kOrder, SymbolSearch, Precision>{});
+      q_.single_task(PersistentStoreDecoded<i>{});
+    });
+    q_.single_task(PersistentCoder<kNCoders, Precision>{});
+    q_.single_task(PersistentStore<kNCoders>{});
+  }
+
+  ~RangeCodec() {
+    q_.single_task<StopCodec<RangeCodec>>([=] {
+      fpga_tools::UnrolledLoop<kNCoders>([&](auto i) {
+        SymbolReadJobPipes::write<i>({nullptr, 0, 0, true});
+        ModelJobPipes::write<i>({0, true});
+        RCReadJobPipes::write<i>({nullptr, 0, 0, 0, true});
+        DecoderJobPipes::write<i>({0, true});
+        DecodedStoreJobPipes::write<i>({nullptr, 0, true});
+      });
+      CoderJobPipe::write({0, true});
+      StoreJobPipe<kNCoders>::write({{}, nullptr, false, true});
+    });
+    q_.wait();
+  }
+
+  RangeCodec(const RangeCodec &) = delete;
+  RangeCodec &operator=(const RangeCodec &) = delete;
+
+  // Codes size bytes into one container, split evenly over the lanes, with
+  // the alphabet reduced as StreamingEncoder does. Safe to call from several
+  // threads, which take turns on the device.
+  MultiStream Compress(const uchar *data, size_t size) {
+    size_t offsets[2] = {0, size};
+    return std::move(CompressBatch(data, offsets, 1)[0]);
+  }
+
+  // Codes message k, the bytes from data + offsets[k] to data + offsets[k+1],
+  // into container k for k < n_messages, as Compress would. The messages go
+  // through the kernels back to back from a single dispatch, with the offsets
+  // table in USM. The dispatch kernel lays out the coded lanes and writes
+  // where each one starts, and the store kernel writes their sizes.
+  std::vector<MultiStream> CompressBatch(const uchar *data,
+                                         const size_t *offsets,
+                                         size_t n_messages) {
+    if (n_messages > max_messages_) {
+      throw std::runtime_error("more messages than the codec capacity");
+    }
+    if (offsets[n_messages] - offsets[0] > max_size_) {
+      throw std::runtime_error("batch larger than the codec capacity");
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<MultiStream> streams;
+    std::vector<UsedBytes> used(n_messages);
+    size_t n_coded = 0;
+    uint last = 0;
+    for (size_t m = 0; m < n_messages; ++m) {
+      const uchar *message = data + offsets[m];
+      size_t size = offsets[m + 1] - offsets[m];
+      uint begin = offsets[m] - offsets[0];
+      msg_offsets_[m] = begin;
+      msg_offsets_[m + 1] = begin + size;
+      if (size == 0) {
+        continue;
+      }
+      used[m] = UsedBytes::Of(message, size);
+      alphabets_[m] = Alphabets::Select(used[m].Count());
+      if (alphabets_[m] == Alphabets::kCount) {
+        throw std::runtime_error("object uses more symbols than any model");
+      }
+      auto ranks = used[m].Ranks();
+      for (size_t k = 0; k < size; ++k) {
+        in_[begin + k] = ranks[message[k]];
+      }
+      n_coded++;
+      last = m;
+    }
+
+    if (n_coded > 0) {
+      const uchar *in = in_.get();
+      const uint *msg_offsets = msg_offsets_.get();
+      const uint *alphabets = alphabets_.get();
+      StoreBurst *rc = rc_.get();
+      uint *rc_offsets = rc_offsets_.get();
+      uint *rc_sizes = rc_sizes_.get();
+      size_t lane_bursts = lane_bursts_;
+      auto e = q_.single_task<DispatchBatch<RangeCodec>>([=] {
+        uint pos[kNCoders] = {0};
+        for (uint m = 0; m <= last; ++m) {
+          uint begin = msg_offsets[m];
+          uint size = msg_offsets[m + 1] - begin;
+          if (size == 0) {
+            continue;
+          }
+          uint alphabet = alphabets[m];
+          StoreJob<kNCoders> store_job{
+              {}, rc_sizes + m * kNCoders, m == last, false};
+          fpga_tools::UnrolledLoop<kNCoders>([&](auto i) {
+            uint lane_begin = LaneBegin(size, i);
+            uint lane_end = LaneBegin(size, i + 1);
+            SymbolReadJobPipes::write<i>(
+                {in, begin + lane_begin, begin + lane_end, false});
+            ModelJobPipes::write<i>({alphabet, false});
+            rc_offsets[m * kNCoders + i] = pos[i];
+            store_job.out[i] = rc + i * lane_bursts + pos[i];
+            pos[i] += DoubleBufferingStore<kNCoders>::RCCapacity(lane_end -
+                                                                lane_begin);
+          });
+          CoderJobPipe::write({alphabet, false});
+          StoreJobPipe<kNCoders>::write(store_job);
+        }
+        StoreDonePipe::read();
+      });
+      // every job sends its counters, which must be taken as they come
+      for (size_t k = 0; k < n_coded; ++k) {
+        fpga_tools::UnrolledLoop<kNCoders>([&](auto i) {
+          perf_.Collect<SymbPipes::PipeAt<i>>(q_,
+                                              "model " + std::to_string(i));
+        });
+        perf_.Collect<FrequncePipes>(q_, "coder");
+        perf_.Collect<RangePipe<kNCoders>>(q_, "store");
+      }
+      e.wait();
+    }
+
+    for (size_t m = 0; m < n_messages; ++m) {
+      uint size = msg_offsets_[m + 1] - msg_offsets_[m];
+      streams.emplace_back(kNCoders, kOrder, StreamLayout::kPlain,
+                           Precision::kId);
+      MultiStream &stream = streams.back();
+      if (size > 0) {
+        stream.SetAlphabet(used[m], Alphabets::Size(alphabets_[m]));
+      }
+      for (uint i = 0; i < kNCoders; ++i) {
+        uint lane = m * kNCoders + i;
+        if (size == 0) {
+          stream.SetLane(i, 0, in_.get(), 0);
+        } else {
+          stream.SetLane(i, LaneBegin(size, i + 1) - LaneBegin(size, i),
+                         rc_.get() + i * lane_bursts_ + rc_offsets_[lane],
+                         rc_sizes_[lane]);
+        }
+      }
+    }
+    return streams;
+  }
+
+  // Decodes a container from Compress into out, which has room for
+  // stream.NumSymbols() bytes, and returns that size. An out in USM host
+  // memory is decoded into in place.
+  size_t Decompress(const MultiStream &stream, uchar *out) {
+    if (stream.NumLanes() != kNCoders ||
+        stream.Layout() != StreamLayout::kPlain ||
+        stream.Order() != kOrder || stream.Precision() != Precision::kId ||
+        stream.Engine() != CoderEngine::kRange ||
+        stream.Transform() != SymbolTransform::kNone) {
+      throw std::runtime_error("container not made by this codec");
+    }
+    size_t n_symbols = stream.NumSymbols();
+    if (n_symbols > max_size_ || stream.size() > MaxContainerSize()) {
+      throw std::runtime_error("object larger than the codec capacity");
+    }
+    if (n_symbols == 0) {
+      return 0;
+    }
+    uint alphabet = Alphabets::IndexOf(stream.ModelSymbols());
+    if (alphabet == Alphabets::kCount) {
+      throw std::runtime_error("no decoder for the model size of the stream");
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    memcpy(container_.get(), stream.data(), stream.size());
+    uchar *dst = IsHostUsm(q_, out) ? out : out_.get();
+    std::array<RCReadJob, kNCoders> rc_jobs;
+    std::array<DecodedStoreJob, kNCoders> store_jobs;
+    for (uint i = 0; i < kNCoders; ++i) {
+      const auto &lane = stream.Lane(i);
+      uint begin = lane.offset / kRangeOutSize;
+      rc_jobs[i] = {(const RCWord *)container_.get(), begin,
+                    begin + CountVecs<kRangeOutSize>(lane.size) +
+                        MultiStream::kPadWords,
+                    lane.n_symbols, false};
+      store_jobs[i] = {dst + stream.LaneStart(i), lane.n_symbols, false};
+    }
+    q_.single_task<DispatchDecode<RangeCodec>>([=] {
+        fpga_tools::UnrolledLoop<kNCoders>([&](auto i) {
+          RCReadJobPipes::write<i>(rc_jobs[i]);
+          DecoderJobPipes::write<i>({alphabet, false});
+          DecodedStoreJobPipes::write<i>(store_jobs[i]);
+        });
+        fpga_tools::UnrolledLoop<kNCoders>(
+            [&](auto i) { DecodeDonePipes::read<i>(); });
+      }).wait();
+
+    if (dst != out) {
+      memcpy(out, dst, n_symbols);
+    }
+    stream.Unrank(out, n_symbols);
+    fpga_tools::UnrolledLoop<kNCoders>([&](auto i) {
+      perf_.Collect<RCDataInPipes::PipeAt<i>>(q_,
+                                              "decoder " + std::to_string(i));
+    });
+    return n_symbols;
+  }
+
+  std::vector<uchar> Decompress(const MultiStream &stream) {
+    std::vector<uchar> out(stream.NumSymbols());
+    Decompress(stream, out.data());
+    return out;
+  }
+
+  // Kernel counters over all calls, empty without PERF_COUNTERS.
+  const PerfReport &Perf() const { return perf_; }
+
+ private:
+  // Lanes split a message of size bytes evenly, as in StreamingEncoder.
+  static uint LaneBegin(uint size, uint lane) {
+    return std::min(lane * CountVecs<kNCoders>(size), size);
+  }
+
+  // The container of a max_size object with every lane at its worst case.
+  size_t MaxContainerSize() const {
+    return sizeof(ContainerHeader) + kNCoders * sizeof(LaneEntry) +
+           kNCoders *
+               MultiStream::PaddedSize(lane_bursts_ * kStoreBurstBytes);
+  }
+
+  queue q_;
+  size_t max_size_;
+  size_t max_messages_;
+  size_t lane_bursts_;  // room for the coded bursts of one lane
+  HostPtr<uchar> in_;
+  // where message k starts in in_, for k <= n_messages
+  HostPtr<uint> msg_offsets_;
+  HostPtr<uint> alphabets_;
+  HostPtr<StoreBurst> rc_;
+  // where lane i of message k starts in the lane i area of rc_, in bursts,
+  // and how many bytes it has, at k * kNCoders + i
+  HostPtr<uint> rc_offsets_;
+  HostPtr<uint> rc_sizes_;
+  HostPtr<uchar> container_;
+  HostPtr<uchar> out_;
+  std::mutex mutex_;
+  PerfReport perf_;
+};
+
+#endif  // RANGE_CODEC_HPP_
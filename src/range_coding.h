@@ -6,8 +6,10 @@
 
 #include <sycl/ext/intel/fpga_extensions.hpp>
 #include "onchip_memory_with_cache.hpp"
+#include "perf_counters.hpp"
 #include "shifting_array.hpp"
 #include "pipe_array.hpp"
+#include "unrolled_loop.hpp"
 
 using namespace sycl;
 using std::array;
@@ -16,34 +18,245 @@ using std::array;
 struct SymbolFrequence {
   ushort freq;
   ushort cumulative_freq;
-  uint total_freq;
+  // 1 / total_freq in the form of the coder's Precision
+  uint total_freq_reciprocal;
 };
 
+constexpr int BitLength(uint x) {
+  int n = 0;
+  for (int shift = 16; shift > 0; shift >>= 1) {
+    if (x >> shift) {
+      n += shift;
+      x >>= shift;
+    }
+  }
+  return n + x;
+}
+
+// 1.0f / total_freq rounded to nearest even, reduced to the bits that
+// ExtractMantissa keeps. Integer only, so that it can run at compile time.
+constexpr uint ReciprocalMantissa(uint total_freq) {
+  constexpr uint kManBits = 24;
+  // smallest k with 2^k / total_freq >= 2^23
+  int k = kManBits - 1 + BitLength(total_freq - 1);
+  ulong q = (1ull << k) / total_freq;
+  ulong r = (1ull << k) % total_freq;
+  if (2 * r > total_freq || (2 * r == total_freq && (q & 1))) {
+    q++;
+  }
+  if (q == (1ull << kManBits)) {
+    q >>= 1;
+    k--;
+  }
+  int tail_len = 2 * kManBits - 1 - k;
+  return uint(q >> (kManBits - 1 - tail_len)) << (31 - kManBits);
+}
+
+uint ExtractMantissa(uint fakeval) {
+  constexpr uint kManBits = 24;
+  uint tail = fakeval << 9;
+  int expo = (fakeval >> 23) - 127 + 1;
+  int tailLen = kManBits + expo - 1;
+  uint res = 1;
+  res <<= tailLen;
+  res |= (tail >> (32 - tailLen));
+  res <<= (31 - kManBits);
+  return res;
+}
+
+// a * 2^-31 * mantissa, truncated the way the shift-and-add datapath does
+uint MantissaMultiply(uint a, uint mantissa) {
+  uint res = 0;
+#pragma unroll
+  for (int i = 0; i < 32; ++i) {
+    bool abit = (a >> (31 - i)) & 0x1;
+    res += abit * (mantissa >> i);
+  }
+  return res;
+}
+
+uint ShiftDivide(uint a, uint b) {
+  // return a*b;
+  return MantissaMultiply(a, ExtractMantissa(b));
+}
+
+// How the coder and the decoder approximate range / total_freq. The model
+// hands out Reciprocal(total_freq) from its ReciprocalRom, and both sides
+// take range_unit = RangeUnit(range, reciprocal). range_unit * total_freq must
+// not exceed range, and the closer it gets, the fewer bits a symbol costs.
+// The kernels take the Precision as a template argument, and a container
+// records the one it was coded with. A Precision with kFixedTotal also
+// changes how the model adapts, so that total_freq never moves.
+enum class CoderPrecision : uchar {
+  kMantissa24 = 0,
+  kFixedPoint32 = 1,
+  kExactDivision = 2,
+  kPowerOfTwo = 3,
+  kCount = 4,
+};
+
+// 1.0f / total_freq cut to a 24-bit mantissa, times range through the
+// truncating shift-and-add of MantissaMultiply. No wide multiplier is
+// needed, but range_unit can land some 32 below range / total_freq.
+struct Mantissa24Reciprocal {
+  static constexpr CoderPrecision kId = CoderPrecision::kMantissa24;
+  static constexpr const char *kName = "mantissa24";
+  static constexpr bool kOnDevice = true;
+  static constexpr bool kFixedTotal = false;
+  static constexpr uint Reciprocal(uint total_freq) {
+    return ReciprocalMantissa(total_freq);
+  }
+  static uint RangeUnit(uint range, uint reciprocal) {
+    return MantissaMultiply(range, reciprocal);
+  }
+};
+
+// floor((2^32 - 1) / total_freq) and the top half of one 32x32 product.
+// range_unit is then at most 1 below range / total_freq, for the cost of a
+// wide multiplier per lane.
+struct FixedPoint32Reciprocal {
+  static constexpr CoderPrecision kId = CoderPrecision::kFixedPoint32;
+  static constexpr const char *kName = "fixed32";
+  static constexpr bool kOnDevice = true;
+  static constexpr bool kFixedTotal = false;
+  static constexpr uint Reciprocal(uint total_freq) {
+    return 0xffffffffu / total_freq;
+  }
+  static uint RangeUnit(uint range, uint reciprocal) {
+    return (ulong(range) * reciprocal) >> 32;
+  }
+};
+
+// range / total_freq itself. A divider per lane does not fit the kernels,
+// so this is the host reference that shows what the other two give up.
+struct ExactDivision {
+  static constexpr CoderPrecision kId = CoderPrecision::kExactDivision;
+  static constexpr const char *kName = "exact";
+  static constexpr bool kOnDevice = false;
+  static constexpr bool kFixedTotal = false;
+  static constexpr uint Reciprocal(uint total_freq) { return total_freq; }
+  static uint RangeUnit(uint range, uint total_freq) {
+    return range / total_freq;
+  }
+};
+
+// total_freq held at 2^kTotalBits, so range / total_freq is exactly a shift
+// and the reciprocal goes unused. Instead of counting, the model moves
+// probability towards the coded symbol: every other symbol gives up
+// 1/2^kRateBits of its frequency above 1, rounded up, and the coded symbol
+// takes what they gave up.
+struct PowerOfTwoTotal {
+  static constexpr CoderPrecision kId = CoderPrecision::kPowerOfTwo;
+  static constexpr const char *kName = "pow2";
+  static constexpr bool kOnDevice = true;
+  static constexpr bool kFixedTotal = true;
+  static constexpr uint kTotalBits = 15;
+  static constexpr uint kRateBits = 9;
+  static constexpr uint Reciprocal(uint total_freq) { return 0; }
+  static uint RangeUnit(uint range, uint) { return range >> kTotalBits; }
+};
+
+// The total_freq of an adaptive model only depends on how many symbols it
+// has seen, and it ends up cycling. This table holds the reciprocal and the
+// normalization flag for every step of that sequence, so neither the coder
+// nor the decoder needs a divider. After the last entry the sequence
+// continues at kLoopStart. The sequence is the same for every Precision,
+// only the reciprocals differ.
+using RomStep = ac_int<16, false>;
+
+template <typename Model, typename Precision = Mantissa24Reciprocal>
+struct ReciprocalRom {
+  struct Shape {
+    uint size;
+    uint loop_start;
+  };
+
+  // total_freq only repeats right after a normalization, so the first such
+  // value that was already seen closes the loop
+  static constexpr Shape FindShape() {
+    uint t = Model::kInitTotalFreq;
+    for (uint i = 0;; ++i) {
+      if (t >= Model::kBound) {
+        uint next = Model::NextTotalFreq(t);
+        uint u = Model::kInitTotalFreq;
+        for (uint j = 0; j <= i; ++j) {
+          if (u == next) {
+            return {i + 1, j};
+          }
+          u = Model::NextTotalFreq(u);
+        }
+      }
+      t = Model::NextTotalFreq(t);
+    }
+  }
+
+  static constexpr uint kSize = FindShape().size;
+  static constexpr uint kLoopStart = FindShape().loop_start;
+  static_assert(kSize <= (1 << RomStep::width), "RomStep is too narrow");
+
+  uint reciprocal[kSize];
+  bool need_norm[kSize];
+
+  constexpr ReciprocalRom() : reciprocal(), need_norm() {
+    uint t = Model::kInitTotalFreq;
+    for (uint i = 0; i < kSize; ++i) {
+      reciprocal[i] = Precision::Reciprocal(t);
+      need_norm[i] = t >= Model::kBound;
+      t = Model::NextTotalFreq(t);
+    }
+  }
+
+  static RomStep NextStep(RomStep step) {
+    return step == kSize - 1 ? RomStep(kLoopStart) : RomStep(step + 1);
+  }
+};
+
+template <typename Model, typename Precision = Mantissa24Reciprocal>
+constexpr ReciprocalRom<Model, Precision> kReciprocalRom{};
+
 template <uint kNSymbol, typename TFreq = ushort>
 struct SimpleModel {
   static constexpr uint kStep = std::is_same<ushort, TFreq>::value ? 8 : 1;
   static constexpr uint kBound =
       std::is_same<ushort, TFreq>::value ? (1 << 16) - 32 : (1 << 8) - 2;
+  static constexpr uint kInitTotalFreq = kNSymbol;
+
+  static constexpr uint NextTotalFreq(uint total_freq) {
+    return total_freq >= kBound ? (total_freq + kStep * 2 + kNSymbol * 2) >> 1
+                                : total_freq + kStep;
+  }
+
+  using Rom = ReciprocalRom<SimpleModel>;
 
   uint total_freq;
+  RomStep step;
   ShiftingArray<TFreq, kNSymbol> freqs;
 
+  template <typename Precision = Mantissa24Reciprocal>
   void Init() {
-    total_freq = kNSymbol;
+    step = 0;
+    if constexpr (Precision::kFixedTotal) {
+      total_freq = 1 << Precision::kTotalBits;
+    } else {
+      total_freq = kInitTotalFreq;
+    }
 #pragma unroll
     for (uint i = 0; i < kNSymbol; i++) {
-      freqs[i] = 1;
+      freqs[i] = total_freq / kNSymbol;
     }
   }
 
+  template <typename Precision = Mantissa24Reciprocal>
   SymbolFrequence Update(uchar symbol) {
-    auto sf = ExtractFreq(symbol);
-    UpdateFreqs(symbol);
+    auto sf = ExtractFreq<Precision>(symbol);
+    UpdateFreqs<Precision>(symbol);
     return sf;
   }
 
+  template <typename Precision = Mantissa24Reciprocal>
   SymbolFrequence ExtractFreq(uchar symbol) {
-    SymbolFrequence sf{0, 0, total_freq};
+    SymbolFrequence sf{0, 0,
+                       kReciprocalRom<SimpleModel, Precision>.reciprocal[step]};
 #pragma unroll
     for (uint j = 0; j < kNSymbol; ++j) {
       sf.cumulative_freq += freqs[j] * (j < symbol);
@@ -54,7 +267,12 @@ struct SimpleModel {
     return sf;
   }
 
+  template <typename Precision = Mantissa24Reciprocal>
   void UpdateFreqs(uchar symbol) {
+    if constexpr (Precision::kFixedTotal) {
+      MoveFreqs<Precision::kRateBits>(symbol);
+      return;
+    }
     bool need_norm = total_freq >= kBound;
 #pragma unroll
     for (uint i = 0; i < kNSymbol; ++i) {
@@ -65,53 +283,191 @@ struct SimpleModel {
         freqs[i] += kStep;
       }
     }
-    if (need_norm) {
-      total_freq = ((total_freq + kStep * 2 + kNSymbol * 2) >> 1);
-    } else {
-      total_freq = total_freq + kStep;
+    total_freq = NextTotalFreq(total_freq);
+    step = Rom::NextStep(step);
+  }
+
+  // Keeps the sum of freqs and every freq of at least 1. The sum of what
+  // the other symbols give up is one adder tree over the alphabet, next to
+  // the one of ExtractFreq.
+  template <uint kRateBits>
+  void MoveFreqs(uchar symbol) {
+    TFreq moved = 0;
+#pragma unroll
+    for (uint i = 0; i < kNSymbol; ++i) {
+      TFreq give = (freqs[i] + (1 << kRateBits) - 2) >> kRateBits;
+      if (symbol != i) {
+        freqs[i] -= give;
+        moved += give;
+      }
     }
+    freqs[symbol] += moved;
   }
 };
 
-template <typename InPipe, typename FreqOutPipe, uint kNSymbol>
+enum class ContextOrder : uchar { kOrder0 = 0, kOrder1 = 1 };
+
+// Iterations from reading an order-1 context model out of M20K to writing it
+// back: about 2 cycles for the M20K read, then UpdateFreqs, which halves and
+// bumps every frequency at once, or with a fixed total sums what the symbols
+// give up in a tree of log2(kNSymbol) adder levels. 8 covers that for 256
+// symbols with some margin. A loop over the contexts carries
+// [[intel::ivdep(kContextCacheDepth)]]: the cache forwards every write of the
+// last kContextCacheDepth iterations, so the table itself is only read again
+// once its write has landed. The loop analysis of the report targets
+// (decoder.report) shows whether that holds: a model kernel with an II above
+// 1 on the context table needs a deeper cache. In a decoder the decoded
+// symbol picks the next context, so its II stays bound by the symbol search,
+// as with order 0. A loop that writes the contexts several times per
+// iteration needs that many times the cache depth to cover the same
+// iterations (see FusedCoder).
+constexpr uint kContextCacheDepth = 8;
+
+// The SimpleModel of every context. Order 0 has one context, held in
+// registers. Order 1 is keyed by the previous symbol and keeps its tables in
+// M20K. The cache covers a context that comes back before its last write has
+// landed, so the read-modify-write of a model kernel can run at II=1 in a
+// loop with the ivdep of kContextCacheDepth. kCacheDepth is in writes.
+template <uint kNSymbol, ContextOrder kOrder,
+          uint kCacheDepth = kContextCacheDepth>
+struct ModelContexts;
+
+template <uint kNSymbol, uint kCacheDepth>
+struct ModelContexts<kNSymbol, ContextOrder::kOrder0, kCacheDepth> {
+  SimpleModel<kNSymbol> model;
+
+  template <typename Precision = Mantissa24Reciprocal>
+  void Init() {
+    model.template Init<Precision>();
+  }
+  SimpleModel<kNSymbol> Read(uchar context) { return model; }
+  void Write(uchar context, const SimpleModel<kNSymbol> &m) { model = m; }
+};
+
+template <uint kNSymbol, uint kCacheDepth>
+struct ModelContexts<kNSymbol, ContextOrder::kOrder1, kCacheDepth> {
+  fpga_tools::OnchipMemoryWithCache<SimpleModel<kNSymbol>, kNSymbol,
+                                    kCacheDepth>
+      tables;
+
+  template <typename Precision = Mantissa24Reciprocal>
+  void Init() {
+    SimpleModel<kNSymbol> m;
+    m.template Init<Precision>();
+    tables.init(m);
+  }
+  SimpleModel<kNSymbol> Read(uchar context) { return tables.read(context); }
+  void Write(uchar context, const SimpleModel<kNSymbol> &m) {
+    tables.write(context, m);
+  }
+};
+
+template <typename InPipe, typename FreqOutPipe, uint kNSymbol,
+          ContextOrder kOrder = ContextOrder::kOrder0,
+          typename Precision = Mantissa24Reciprocal>
 struct SimpleModelKernel {
   void operator()() const {
     bool done = false;
-    SimpleModel<kNSymbol> model;
-    model.Init();
+    ModelContexts<kNSymbol, kOrder> contexts;
+    contexts.template Init<Precision>();
+    uchar context = 0;
+    PerfCounters perf;
+    perf.Init();
+    [[intel::ivdep(kContextCacheDepth)]]
     while (!done) {
       auto in = InPipe::read();
       done = in.done;
-      auto f = model.Update(in.data);
+      auto model = contexts.Read(context);
+      perf.Cycle();
+      perf.Norm(!done && model.total_freq >= SimpleModel<kNSymbol>::kBound);
+      auto f = model.template Update<Precision>(in.data);
+      contexts.Write(context, model);
+      context = in.data;
       FreqOutPipe::write({f, done});
     }
+    perf.Send<InPipe>();
+  }
+};
+
+// The model sizes a build is prebuilt for. A chunk is coded with the
+// smallest one that holds the bytes it uses, each byte becoming its rank
+// among them.
+template <uint... kSizes>
+struct AlphabetSet {
+  static constexpr uint kCount = sizeof...(kSizes);
+  static constexpr uint kSizeList[kCount] = {kSizes...};
+
+  static constexpr uint Size(uint idx) { return kSizeList[idx]; }
+  static constexpr uint Largest() { return kSizeList[kCount - 1]; }
+
+  // Index of the smallest size of at least n_symbols, kCount if none is.
+  static constexpr uint Select(uint n_symbols) {
+    for (uint i = 0; i < kCount; ++i) {
+      if (kSizeList[i] >= n_symbols) {
+        return i;
+      }
+    }
+    return kCount;
+  }
+  static constexpr uint IndexOf(uint size) {
+    for (uint i = 0; i < kCount; ++i) {
+      if (kSizeList[i] == size) {
+        return i;
+      }
+    }
+    return kCount;
+  }
+};
+
+// SimpleModelKernel with the model size picked at launch. Every prebuilt
+// size has its own loop, and only the selected one runs.
+template <typename InPipe, typename FreqOutPipe, typename Alphabets,
+          ContextOrder kOrder = ContextOrder::kOrder0,
+          typename Precision = Mantissa24Reciprocal>
+struct AlphabetModelKernel {
+  uint alphabet;  // index into Alphabets
+
+  void operator()() const {
+    fpga_tools::UnrolledLoop<Alphabets::kCount>([&](auto a) {
+      if (a == alphabet) {
+        SimpleModelKernel<InPipe, FreqOutPipe, Alphabets::Size(a), kOrder,
+                          Precision>{}();
+      }
+    });
   }
 };
 
 constexpr uint kRangeOutSize = 4;
-struct RangeOutput {
-  using IdxType = ac_int<Log2(kRangeOutSize) + 1, false>;
+// The bytes one lane of a coder sends to the store per iteration. A coder
+// that codes several symbols per iteration sends more than kRangeOutSize.
+template <uint kBytes>
+struct RangeOutputOf {
+  using IdxType = ac_int<Log2(kBytes) + 1, false>;
   IdxType size;
-  ShiftingArray<uchar, kRangeOutSize> buffer;
+  ShiftingArray<uchar, kBytes> buffer;
+  // low overflowed before this output: add one to the bytes already sent
+  bool carry;
+
+  static RangeOutputOf Empty() {
+    RangeOutputOf out;
+    out.size = 0;
+    out.buffer.AcInt() = 0;
+    out.carry = false;
+    return out;
+  }
 };
+using RangeOutput = RangeOutputOf<kRangeOutSize>;
 
 
-template <uint num_coder>
-using RangePipe =
-    ext::intel::pipe<class ROutP, FlagBundle<array<RangeOutput, num_coder>>,
-                     128>;
+template <uint num_coder, uint kBytes = kRangeOutSize>
+using RangePipe = ext::intel::pipe<
+    class ROutP, FlagBundle<array<RangeOutputOf<kBytes>, num_coder>>, 128>;
 
-template <uint num_coder>
-using RangeCarryPipe =
-    ext::intel::pipe<class ROutP, FlagBundle<array<uint, num_coder>>, 128>;
+constexpr uint kMaxCoders = 22;
 
 using FrequncePipes =
-    PipeArray<class FreqPP, FlagBundle<SymbolFrequence>, 128, 22>;
+    PipeArray<class FreqPP, FlagBundle<SymbolFrequence>, 128, kMaxCoders>;
 
-struct FreqStat {
-  uint totalFreq;
-  bool needNorm;
-};
 using UintRCVecx2 = ac_int<kRangeOutSize * 8 * 2, false>;
 using UintRCVec = ac_int<kRangeOutSize * 8, false>;
 
@@ -120,33 +476,17 @@ struct RCInputStream {
   uchar size;
 };
 
-using SymbolOutPipe = ext::intel::pipe<class SYmOP, uchar, 4>;
-using RCDataInPipe = ext::intel::pipe<class RCInnP, UintRCVec, 8>;
-using RCInitPipe = ext::intel::pipe<class RCIP, uint3, 1>;
-using FreqInPipe = ext::intel::pipe<class FreqStatP, FreqStat, 8>;
-
-uint ExtractMantissa(uint fakeval) {
-  constexpr uint kManBits = 24;
-  uint tail = fakeval << 9;
-  int expo = (fakeval >> 23) - 127 + 1;
-  int tailLen = kManBits + expo - 1;
-  uint res = 1;
-  res <<= tailLen;
-  res |= (tail >> (32 - tailLen));
-  res <<= (31 - kManBits);
-  return res;
-}
+using SymbolOutPipes = PipeArray<class SYmOP, uchar, 4, kMaxCoders>;
+using RCDataInPipes = PipeArray<class RCInnP, UintRCVec, 8, kMaxCoders>;
+using RCInitPipes = PipeArray<class RCIP, uint4, 1, kMaxCoders>;
 
-uint ShiftDivide(uint a, uint b) {
-  // return a*b;
-  uint B = ExtractMantissa(b);
-  uint res = 0;
-#pragma unroll
-  for (int i = 0; i < 32; ++i) {
-    bool abit = (a >> (31 - i)) & 0x1;
-    res += abit * (B >> i);
-  }
-  return res;
-}
+// The slots of BarrelDecoderKernel, which take lanes the way the pipes above
+// give them to RangeDecoderKernel.
+constexpr uint kMaxBarrelDepth = 64;
+using BarrelSymbolOutPipes =
+    PipeArray<class BarrelSymOP, uchar, 4, kMaxBarrelDepth>;
+using BarrelDataInPipes =
+    PipeArray<class BarrelInnP, UintRCVec, 8, kMaxBarrelDepth>;
+using BarrelInitPipes = PipeArray<class BarrelIP, uint4, 1, kMaxBarrelDepth>;
 
 #endif  // RANGE_CODING_H_
\ No newline at end of file
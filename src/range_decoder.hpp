@@ -4,9 +4,7 @@
 
 #include "range_coding.h"
 #include "range_encoder.hpp"
-
-constexpr uint kStep = SimpleModel<0>::kStep;
-constexpr uint kMaxTotalFreq = SimpleModel<0>::kBound;
+#include "unrolled_loop.hpp"
 
 void UpdateRange(uint &range, uint &code, RCInputStream &input_stream) {
   bool range_bits[32];
@@ -53,26 +51,6 @@ void UpdateRange(uint &range, uint &code, RCInputStream &input_stream) {
   }
 }
 
-template <uint kNSymbol>
-struct FreqUpdater {
-  void operator()(uint sym_count) const {
-    uint totalFreq = kNSymbol;
-    for (uint i = 0; i < sym_count; ++i) {
-      FreqStat fs;
-      float f = 1.0f / totalFreq;
-      uint val = *(uint *)&f;
-      fs.totalFreq = val;
-      fs.needNorm = totalFreq >= (kMaxTotalFreq);
-      FreqInPipe::write(fs);
-      if (fs.needNorm) {
-        totalFreq = (totalFreq + kStep * 2 + kNSymbol * 2) >> 1;
-      } else {
-        totalFreq = totalFreq + kStep;
-      }
-    }
-  }
-};
-
 uint ShiftMultiply(uint a, ushort b) {
   ac_int<33, false> a33 = a;
   uint sum = 0;
@@ -85,65 +63,319 @@ uint ShiftMultiply(uint a, ushort b) {
   return sum;
 }
 
-template <uint kNSymbol>
-struct RangeDecoderKernel {
-  void operator()() const {
-    [[intel::fpga_register]] ushort freqs[kNSymbol];
+// Both searches return the decoded symbol, the largest s with
+// range_unit * cum(s) <= code, and its cumulative frequency cum(s).
+
+// Prefix sum over the alphabet and one comparison per symbol: 2 * kNSymbol
+// multipliers and a kNSymbol-deep chain.
+struct LinearSymbolSearch {
+  template <uint kNSymbol, typename Freqs>
+  static uchar Find(const Freqs &freqs, uint range_unit, uint code,
+                    ushort &cum) {
+    ushort acc_freq[kNSymbol + 1] = {0};
 #pragma unroll
-    for (int i = 0; i < kNSymbol; i++) {
-      freqs[i] = 1;
+    for (uint i = 1; i <= kNSymbol; ++i) {
+      acc_freq[i] = acc_freq[i - 1] + freqs[i - 1];
     }
-    uint range = (uint)-1;
-    uint3 init = RCInitPipe::read();
-    uint num_symbol = init[0];
-    uint code = init[1];
-    RCInputStream input_stream{init[2], kRangeOutSize};
 
-    for (uint s = 0; s < num_symbol; ++s) {
-      auto fs = FreqInPipe::read();
-      uint range_unit = ShiftDivide(range, fs.totalFreq);
+    uchar symbol = 0;
+    cum = 0;
+    bool no_symbol_appeared = true;
+#pragma unroll
+    for (uint i = 0; i < kNSymbol; ++i) {
+      uint cmuc = ShiftMultiply(range_unit, acc_freq[i + 1]);
+      bool is_symbol = cmuc > code && no_symbol_appeared;
+      no_symbol_appeared = cmuc <= code;
+      if (is_symbol) {
+        symbol = i;
+        cum = acc_freq[i];
+      }
+    }
+    return symbol;
+  }
+};
 
-      auto initial_code = code;
-      uchar symbol = 0;
-      bool no_symbol_appeared = true;
+// Pairwise sums of the frequencies form a segment tree, built with
+// kNSymbol - 1 adders in log2(kNSymbol) levels. The search walks it from the
+// root with one multiplier per level, so it costs log2(kNSymbol)
+// multipliers and a chain of the same depth.
+struct TreeSymbolSearch {
+  template <uint kNSymbol, typename Freqs>
+  static uchar Find(const Freqs &freqs, uint range_unit, uint code,
+                    ushort &cum) {
+    static_assert((kNSymbol & (kNSymbol - 1)) == 0,
+                  "the tree needs a power-of-two alphabet");
+    constexpr uint kLevels = Log2(kNSymbol);
+    // node i has children 2i and 2i + 1, leaves start at kNSymbol
+    ushort tree[2 * kNSymbol];
+#pragma unroll
+    for (uint i = 0; i < kNSymbol; ++i) {
+      tree[kNSymbol + i] = freqs[i];
+    }
+#pragma unroll
+    for (uint i = kNSymbol - 1; i > 0; --i) {
+      tree[i] = tree[2 * i] + tree[2 * i + 1];
+    }
 
-      ushort acc_freq[kNSymbol + 1] = {0};
+    // index of the current node within its level
+    uint idx = 0;
+    cum = 0;
+    fpga_tools::UnrolledLoop<kLevels>([&](auto level) {
+      constexpr uint kChildren = 2u << level;
+      ushort left = 0;
 #pragma unroll
-      for (uint i = 1; i <= kNSymbol; ++i) {
-        acc_freq[i] = acc_freq[i - 1] + freqs[i - 1];
+      for (uint j = 0; j < kChildren / 2; ++j) {
+        if (j == idx) {
+          left = tree[kChildren + 2 * j];
+        }
       }
+      ushort bound = cum + left;
+      bool go_right = ShiftMultiply(range_unit, bound) <= code;
+      cum = go_right ? bound : cum;
+      idx = 2 * idx + go_right;
+    });
+    return idx;
+  }
+};
 
+// Sends the words [begin, end) of a coded lane to RangeDecoderKernel<kLane>,
+// or to slot kLane of BarrelDecoderKernel with its pipes: the init words with
+// the symbol count first, then one word at a time. The 32-bit code starts at
+// the second word.
+template <uint kLane, typename InitPipes = RCInitPipes,
+          typename DataPipes = RCDataInPipes, typename RCWords>
+void FeedRangeDecoder(const RCWords &rc, uint begin, uint end,
+                      uint num_symbols) {
+  auto code_data = rc[begin + 1];
+  auto stream_init = rc[begin + 2];
+  uint code_init = 0;
+  uchar *p = (uchar *)&code_data;
 #pragma unroll
-      for (uint i = 0; i < kNSymbol; ++i) {
-        uint cmuc = ShiftMultiply(range_unit, acc_freq[i + 1]);
-        uint acc_range = ShiftMultiply(range_unit, acc_freq[i]);
+  for (uint k = 0; k < 4; ++k) {
+    code_init = code_init << 8 | p[k];
+  }
+  InitPipes::template write<kLane>(
+      {num_symbols, code_init, stream_init, end - begin - 3});
+  for (uint k = begin + 3; k < end; ++k) {
+    UintRCVecx2 v = 0;
+    v |= rc[k];
+    DataPipes::template write<kLane>(v);
+  }
+}
 
-        bool is_symbol = cmuc > initial_code && no_symbol_appeared;
-        no_symbol_appeared = cmuc <= initial_code;
+template <uint kNSymbol, uint kLane = 0,
+          ContextOrder kOrder = ContextOrder::kOrder0,
+          typename SymbolSearch = TreeSymbolSearch,
+          typename Precision = Mantissa24Reciprocal>
+struct RangeDecoderKernel {
+  static_assert(Precision::kOnDevice, "no kernel datapath for this precision");
 
-        if (is_symbol) {
-          symbol = i;
-          range = ShiftMultiply(range_unit, freqs[i]);
-          code = initial_code - acc_range;
-        }
-        if (fs.needNorm) {
-          freqs[i] = (freqs[i] >> 1) | 1;
-        }
-        if (is_symbol) {
-          freqs[i] += kStep;
-        }
-      }
+  void operator()() const {
+    const auto &rom = kReciprocalRom<SimpleModel<kNSymbol>, Precision>;
+    ModelContexts<kNSymbol, kOrder> contexts;
+    contexts.template Init<Precision>();
+    uchar context = 0;
+    uint range = (uint)-1;
+    uint4 init = RCInitPipes::read<kLane>();
+    uint num_symbol = init[0];
+    uint code = init[1];
+    RCInputStream input_stream{init[2], kRangeOutSize};
+    uint num_words = init[3];
+    uint words_read = 0;
+    PerfCounters perf;
+    perf.Init();
+
+    [[intel::ivdep(kContextCacheDepth)]]
+    for (uint s = 0; s < num_symbol; ++s) {
+      auto model = contexts.Read(context);
+      perf.Cycle();
+      perf.Norm(model.total_freq >= SimpleModel<kNSymbol>::kBound);
+      uint range_unit =
+          Precision::RangeUnit(range, rom.reciprocal[model.step]);
+
+      ushort cum;
+      uchar symbol = SymbolSearch::template Find<kNSymbol>(
+          model.freqs, range_unit, code, cum);
+      range = ShiftMultiply(range_unit, model.freqs[symbol]);
+      code -= ShiftMultiply(range_unit, cum);
 
+      model.template UpdateFreqs<Precision>(symbol);
+      contexts.Write(context, model);
+      context = symbol;
+
+      uchar stream_size = input_stream.size;
       UpdateRange(range, code, input_stream);
+      perf.Renorm(true, stream_size - input_stream.size);
 
       if (input_stream.size <= kRangeOutSize) {
-        UintRCVecx2 in = RCDataInPipe::read();
+        UintRCVecx2 in = RCDataInPipes::read<kLane>();
         input_stream.bits |= in << (input_stream.size * 8);
         input_stream.size += kRangeOutSize;
+        words_read++;
+      }
+
+      SymbolOutPipes::write<kLane>(symbol);
+    }
+    // leave the data pipe empty for the next stream
+    for (; words_read < num_words; ++words_read) {
+      RCDataInPipes::read<kLane>();
+    }
+    perf.Send<RCDataInPipes::PipeAt<kLane>>();
+  }
+};
+
+// RangeDecoderKernel with the model size picked at launch, the counterpart
+// of AlphabetModelKernel.
+template <typename Alphabets, uint kLane = 0,
+          ContextOrder kOrder = ContextOrder::kOrder0,
+          typename SymbolSearch = TreeSymbolSearch,
+          typename Precision = Mantissa24Reciprocal>
+struct AlphabetDecoderKernel {
+  uint alphabet;  // index into Alphabets
+
+  void operator()() const {
+    fpga_tools::UnrolledLoop<Alphabets::kCount>([&](auto a) {
+      if (a == alphabet) {
+        RangeDecoderKernel<Alphabets::Size(a), kLane, kOrder, SymbolSearch,
+                           Precision>{}();
+      }
+    });
+  }
+};
+
+// Decodes up to kDepth lanes of one model size in one pipeline, one symbol
+// of the lane in slot s on every kDepth-th iteration. The state of a slot is
+// only touched again kDepth iterations later, which the ivdep tells the
+// compiler, so the recurrence through range, code and the model gets that
+// many cycles while the slots share one symbol search. With kDepth at the
+// latency of the search and the renormalization, a few dozen cycles, the
+// loop runs at an II of 1 and every slot at 1/kDepth of the clock.
+// The first n_slots slots take a lane each, from BarrelInitPipes and
+// BarrelDataInPipes as RangeDecoderKernel takes one, and the rest stay
+// idle, as does a slot whose lane is done: the slots keep their turn, or a
+// row would come back sooner than the ivdep says.
+// The models live in on-chip memory, one row per slot and context. A row
+// comes back past the latency of the memory, so it needs no cache.
+template <uint kNSymbol, uint kDepth,
+          ContextOrder kOrder = ContextOrder::kOrder0,
+          typename SymbolSearch = TreeSymbolSearch,
+          typename Precision = Mantissa24Reciprocal>
+struct BarrelDecoderKernel {
+  static_assert(Precision::kOnDevice, "no kernel datapath for this precision");
+  static_assert(kDepth <= kMaxBarrelDepth, "more slots than barrel pipes");
+  static constexpr uint kContexts =
+      kOrder == ContextOrder::kOrder1 ? kNSymbol : 1;
+
+  uint n_slots;
+
+  void operator()() const {
+    const auto &rom = kReciprocalRom<SimpleModel<kNSymbol>, Precision>;
+    SimpleModel<kNSymbol> init_model;
+    init_model.template Init<Precision>();
+    fpga_tools::OnchipMemoryWithCache<SimpleModel<kNSymbol>,
+                                      kDepth * kContexts, 0>
+        models(init_model);
+
+    uint ranges[kDepth];
+    uint codes[kDepth];
+    RCInputStream input_streams[kDepth];
+    uchar contexts[kDepth];
+    uint remaining[kDepth];
+    uint num_words[kDepth];
+    uint words_read[kDepth];
+    uint n_live = 0;
+    fpga_tools::UnrolledLoop<kDepth>([&](auto k) {
+      uint4 init = {0, 0, 0, 0};
+      if (k < n_slots) {
+        init = BarrelInitPipes::read<k>();
       }
+      ranges[k] = (uint)-1;
+      codes[k] = init[1];
+      input_streams[k] = {init[2], kRangeOutSize};
+      contexts[k] = 0;
+      remaining[k] = init[0];
+      num_words[k] = init[3];
+      words_read[k] = 0;
+      n_live += init[0] > 0;
+    });
+    PerfCounters perf;
+    perf.Init();
+
+    uint s = 0;
+    [[intel::ivdep(kDepth)]]
+    while (n_live > 0) {
+      perf.Cycle();
+      if (remaining[s] > 0) {
+        uint row = s * kContexts + (kContexts > 1 ? contexts[s] : 0);
+        auto model = models.read(row);
+        perf.Norm(model.total_freq >= SimpleModel<kNSymbol>::kBound);
+        uint range = ranges[s];
+        uint code = codes[s];
+        auto input_stream = input_streams[s];
+        uint range_unit =
+            Precision::RangeUnit(range, rom.reciprocal[model.step]);
+
+        ushort cum;
+        uchar symbol = SymbolSearch::template Find<kNSymbol>(
+            model.freqs, range_unit, code, cum);
+        range = ShiftMultiply(range_unit, model.freqs[symbol]);
+        code -= ShiftMultiply(range_unit, cum);
+
+        model.template UpdateFreqs<Precision>(symbol);
+        models.write(row, model);
+        contexts[s] = symbol;
+
+        uchar stream_size = input_stream.size;
+        UpdateRange(range, code, input_stream);
+        perf.Renorm(true, stream_size - input_stream.size);
 
-      SymbolOutPipe::write(symbol);
+        bool refill = input_stream.size <= kRangeOutSize;
+        fpga_tools::UnrolledLoop<kDepth>([&](auto k) {
+          if (k == s) {
+            if (refill) {
+              UintRCVecx2 in = BarrelDataInPipes::read<k>();
+              input_stream.bits |= in << (input_stream.size * 8);
+              input_stream.size += kRangeOutSize;
+            }
+            BarrelSymbolOutPipes::write<k>(symbol);
+          }
+        });
+        words_read[s] += refill;
+
+        ranges[s] = range;
+        codes[s] = code;
+        input_streams[s] = input_stream;
+        remaining[s]--;
+        n_live -= remaining[s] == 0;
+      }
+      s = s == kDepth - 1 ? 0 : s + 1;
     }
+    // leave the data pipes empty for the next lanes
+    fpga_tools::UnrolledLoop<kDepth>([&](auto k) {
+      for (; words_read[k] < num_words[k]; ++words_read[k]) {
+        BarrelDataInPipes::read<k>();
+      }
+    });
+    perf.Send<BarrelDataInPipes>();
+  }
+};
+
+// BarrelDecoderKernel with the model size picked at launch.
+template <typename Alphabets, uint kDepth,
+          ContextOrder kOrder = ContextOrder::kOrder0,
+          typename SymbolSearch = TreeSymbolSearch,
+          typename Precision = Mantissa24Reciprocal>
+struct AlphabetBarrelDecoderKernel {
+  uint alphabet;  // index into Alphabets
+  uint n_slots;
+
+  void operator()() const {
+    fpga_tools::UnrolledLoop<Alphabets::kCount>([&](auto a) {
+      if (a == alphabet) {
+        BarrelDecoderKernel<Alphabets::Size(a), kDepth, kOrder, SymbolSearch,
+                            Precision>{n_slots}();
+      }
+    });
   }
 };
 
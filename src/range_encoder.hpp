@@ -6,32 +6,93 @@
 #include "unrolled_loop.hpp"
 using namespace sycl;
 
-template <uint kNCoders>
-struct RangeCoder {
+// Adds x to low, and tells whether low carried into the bytes already sent.
+inline bool AddToLow(ulong &low, uint x) {
+  ulong low_LS32b = low & 0xffffffff;
+  ulong low_MS32b = low >> 32;
+  bool carry = low_MS32b == 0xffffffff && low_LS32b + x > 0xffffffff;
+  low += x;
+  return carry;
+}
+
+// Narrows low and range to the interval of the symbol, and tells whether
+// low carried into the bytes already sent.
+template <typename Precision>
+bool EncodeSymbol(ulong &low, uint &range, const SymbolFrequence &sf) {
+  uint range_unit = Precision::RangeUnit(range, sf.total_freq_reciprocal);
+  bool carry = AddToLow(low, range_unit * sf.cumulative_freq);
+  range = range_unit * sf.freq;
+  return carry;
+}
+
+// Shifts out the top bytes of low while the top byte of range is zero, at
+// most three.
+inline RangeOutput Normalize(ulong &low, uint &range) {
+  ac_int<32, false> range_bits(range);
+
+  bool is_first_byte_zero = !(
+      range_bits[24] | range_bits[25] | range_bits[26] | range_bits[27] |
+      range_bits[28] | range_bits[29] | range_bits[30] | range_bits[31]);
+  bool is_second_byte_zero = !(
+      range_bits[16] | range_bits[17] | range_bits[18] | range_bits[19] |
+      range_bits[20] | range_bits[21] | range_bits[22] | range_bits[23]);
+  bool is_third_byte_zero = !(
+      range_bits[8] | range_bits[9] | range_bits[10] | range_bits[11] |
+      range_bits[12] | range_bits[13] | range_bits[14] | range_bits[15]);
+
+  bool range_8bits =
+      is_first_byte_zero & is_second_byte_zero & is_third_byte_zero;
+  bool range_16bits = is_first_byte_zero & is_second_byte_zero;
+  bool range_24bits = is_first_byte_zero;
 
-  static uint UpdateRange(uint freq, uint range, uint total_freq_reciprocal) {
-    // return freq*range*total_freq_reciprocal;
-    uint B = ExtractMantissa(total_freq_reciprocal);
-    uint res = 0;
+  RangeOutput out{0, {0, 0, 0, 0}};
+  if (range_8bits) {
+    out = {3,
+           {(uchar)(low >> 56), (uchar)(low >> 48), (uchar)(low >> 40), 0}};
+    range <<= 24;
+    low <<= 24;
+  } else if (range_16bits) {
+    out = {2, {(uchar)(low >> 56), (uchar)(low >> 48), 0, 0}};
+    range <<= 16;
+    low <<= 16;
+  } else if (range_24bits) {
+    out = {1, {(uchar)(low >> 56), 0, 0, 0}};
+    range <<= 8;
+    low <<= 8;
+  }
+  return out;
+}
+
+// The end of a lane: the high word of low, then the low word when second.
+template <uint kBytes>
+RangeOutputOf<kBytes> FlushLow(ulong low, bool second) {
+  auto out = RangeOutputOf<kBytes>::Empty();
+  out.size = 4;
+  ulong curr_low = low;
+  if (second) {
+    curr_low <<= 32;
+  }
 #pragma unroll
-    for (int i = 0; i < 32; ++i) {
-      uint t = ((B >> i) * freq);
-      if ((range >> (31 - i)) & 0x1) {
-        res += t;
-      }
-    }
-    return res;
+  for (int k = 0; k < 4; k++) {
+    out.buffer[k] = curr_low >> 56;
+    curr_low <<= 8;
   }
+  return out;
+}
+
+// Codes the symbols of kNCoders lanes, one per lane and cycle. range_unit
+// comes from Precision, and range_unit * freq is the new range.
+template <uint kNCoders, typename Precision = Mantissa24Reciprocal>
+struct RangeCoder {
+  static_assert(Precision::kOnDevice, "no kernel datapath for this precision");
 
   void operator()() const {
     ulong low[kNCoders];
     uint range[kNCoders];
-    uint range_sizes[kNCoders];
     bool can_continue[kNCoders];
 #pragma unroll
     for (int i = 0; i < kNCoders; i++) {
       can_continue[i] = true;
-      range_sizes[i] = 0;
       low[i] = 0;
       range[i] = (uint)-1;
     }
@@ -39,28 +100,30 @@ struct RangeCoder {
     // extend 2 loops for sending low out after all done
     bool do_ouput_low[2] = {false, false};
     bool alive = true;
+    PerfCounters perf;
+    perf.Init();
 
     while (alive) {
       bool alive_exists = false;
-      std::array<uint, kNCoders> carry_locations;
+      bool carries[kNCoders];
+      bool coded[kNCoders];
+      perf.Cycle();
       fpga_tools::UnrolledLoop<0, kNCoders>([&](auto i) {
-        carry_locations[i] = 0xffffffff;
+        carries[i] = false;
         bool read_success = false;
-        auto [sf, done] = FrequncePipes::read<i>(read_success);
+        FlagBundle<SymbolFrequence> bundle;
+        // a finished lane must not consume the next job's frequencies
+        if (can_continue[i]) {
+          bundle = FrequncePipes::read<i>(read_success);
+        }
+        auto [sf, done] = bundle;
+        perf.EmptyRead(can_continue[i] && !read_success);
         if (read_success) {
           can_continue[i] = !done;
         }
-        if (read_success && !done) {
-          float reciprocal = 1.0f / sf.total_freq;
-          uint fake_val = *(uint *)&reciprocal;
-          uint temp = ShiftDivide(range[i], fake_val) * sf.cumulative_freq;
-          ulong low_LS32b = low[i] & 0xffffffff;
-          ulong low_MS32b = low[i] >> 32;
-          if (low_MS32b == 0xffffffff && low_LS32b + temp > 0xffffffff) {
-            carry_locations[i] = range_sizes[i];
-          }
-          low[i] += temp;
-          range[i] = UpdateRange(sf.freq, range[i], fake_val);
+        coded[i] = read_success && !done;
+        if (coded[i]) {
+          carries[i] = EncodeSymbol<Precision>(low[i], range[i], sf);
         }
       });
       fpga_tools::UnrolledLoop<0, kNCoders>(
@@ -72,59 +135,169 @@ struct RangeCoder {
 
       std::array<RangeOutput, kNCoders> out_buffers;
       fpga_tools::UnrolledLoop<0, kNCoders>([&](auto i) {
-        ac_int<32, false> range_bits(range[i]);
-
-        bool is_first_byte_zero = !(
-            range_bits[24] | range_bits[25] | range_bits[26] | range_bits[27] |
-            range_bits[28] | range_bits[29] | range_bits[30] | range_bits[31]);
-        bool is_second_byte_zero = !(
-            range_bits[16] | range_bits[17] | range_bits[18] | range_bits[19] |
-            range_bits[20] | range_bits[21] | range_bits[22] | range_bits[23]);
-        bool is_third_byte_zero = !(
-            range_bits[8] | range_bits[9] | range_bits[10] | range_bits[11] |
-            range_bits[12] | range_bits[13] | range_bits[14] | range_bits[15]);
-
-        bool range_8bits =
-            is_first_byte_zero & is_second_byte_zero & is_third_byte_zero;
-        bool range_16bits = is_first_byte_zero & is_second_byte_zero;
-        bool range_24bits = is_first_byte_zero;
-
-        RangeOutput out{0, {0, 0, 0, 0}};
-        if (range_8bits) {
-          out = {3,
-                 {(uchar)(low[i] >> 56), (uchar)(low[i] >> 48),
-                  (uchar)(low[i] >> 40), 0}};
-          range[i] <<= 24;
-          low[i] <<= 24;
-        } else if (range_16bits) {
-          out = {2, {(uchar)(low[i] >> 56), (uchar)(low[i] >> 48), 0, 0}};
-          range[i] <<= 16;
-          low[i] <<= 16;
-        } else if (range_24bits) {
-          out = {1, {(uchar)(low[i] >> 56), 0, 0, 0}};
-          range[i] <<= 8;
-          low[i] <<= 8;
-        }
+        RangeOutput out = Normalize(low[i], range[i]);
+        perf.Renorm(coded[i], out.size);
+        perf.Carry(carries[i]);
 
         if (do_ouput_low[0]) {
-          out.size = 4;
-          ulong curr_low = low[i];
-          if (do_ouput_low[1]) {
-            curr_low <<= 32;
-          }
+          out = FlushLow<kRangeOutSize>(low[i], do_ouput_low[1]);
+        }
+        out.carry = carries[i];
+        out_buffers[i] = out;
+      });
+
+      RangePipe<kNCoders>::write({out_buffers, do_ouput_low[1]});
+    }
+    perf.Send<FrequncePipes>();
+  }
+};
+
+// kWidth symbols of a lane, of which the first count are coded.
+template <uint kWidth>
+struct SymbolGroup {
+  array<uchar, kWidth> symbols;
+  uchar count;
+};
+
+template <uint kWidth>
+using SymbolGroupPipes =
+    PipeArray<class SymGrpP, FlagBundle<SymbolGroup<kWidth>>, 256, kMaxCoders>;
+
+// Codes one more symbol of a group into out, the bytes of the group so far.
+// A carry is added to those bytes, and what ripples out of them goes to the
+// store as out.carry.
+template <typename Precision, uint kBytes>
+void AppendSymbol(RangeOutputOf<kBytes> &out, ulong &low, uint &range,
+                  const SymbolFrequence &sf, PerfCounters &perf) {
+  bool carry = EncodeSymbol<Precision>(low, range, sf);
+  perf.Carry(carry);
+  bool ripple = carry;
 #pragma unroll
-          for (int k = 0; k < 4; k++) {
-            out.buffer[k] = curr_low >> 56;
-            curr_low <<= 8;
+  for (int k = kBytes - 1; k >= 0; --k) {
+    if (k < out.size && ripple) {
+      out.buffer[k]++;
+      ripple = out.buffer[k] == 0;
+    }
+  }
+  out.carry = out.carry || ripple;
+
+  RangeOutput norm = Normalize(low, range);
+  perf.Renorm(true, norm.size);
+  decltype(out.buffer) bytes;
+  bytes.AcInt() = norm.buffer.AcInt();
+  out.buffer.AcInt() |= bytes.template ElementShift<false>(out.size).AcInt();
+  out.size += norm.size;
+}
+
+// The model and the coder of kNCoders lanes in one kernel, coding up to
+// kWidth symbols of a lane per cycle from SymbolGroupPipes<kWidth>. The
+// model update of a symbol is forwarded to the lookup of the next, and
+// low and range are narrowed and normalized once per symbol. The bytes of
+// the group go to the store together: a carry into bytes of the same group
+// is added here, so the output is the one of SimpleModelKernel and
+// RangeCoder.
+// A lane reads and writes its contexts up to kWidth times per cycle. Within
+// a cycle the symbols depend on each other anyway, and across cycles the
+// cache of a lane has kWidth times kContextCacheDepth entries, so that it
+// still holds every write of the last kContextCacheDepth iterations, which
+// the ivdep relies on. A cache of kContextCacheDepth writes would only cover
+// kContextCacheDepth / kWidth of them.
+template <uint kNCoders, uint kWidth, uint kNSymbol,
+          ContextOrder kOrder = ContextOrder::kOrder0,
+          typename Precision = Mantissa24Reciprocal>
+struct FusedCoder {
+  static_assert(Precision::kOnDevice, "no kernel datapath for this precision");
+  // the output vectors are ac_ints of whole bytes
+  static_assert((kWidth & (kWidth - 1)) == 0, "kWidth is a power of two");
+  static constexpr uint kBytes = kWidth * kRangeOutSize;
+  using Output = RangeOutputOf<kBytes>;
+
+  void operator()() const {
+    ModelContexts<kNSymbol, kOrder, kContextCacheDepth * kWidth>
+        contexts[kNCoders];
+    uchar context[kNCoders];
+    ulong low[kNCoders];
+    uint range[kNCoders];
+    bool can_continue[kNCoders];
+    fpga_tools::UnrolledLoop<0, kNCoders>([&](auto i) {
+      contexts[i].template Init<Precision>();
+      context[i] = 0;
+      can_continue[i] = true;
+      low[i] = 0;
+      range[i] = (uint)-1;
+    });
+
+    // extend 2 loops for sending low out after all done
+    bool do_ouput_low[2] = {false, false};
+    bool alive = true;
+    PerfCounters perf;
+    perf.Init();
+
+    [[intel::ivdep(kContextCacheDepth)]]
+    while (alive) {
+      bool alive_exists = false;
+      std::array<Output, kNCoders> out_buffers;
+      perf.Cycle();
+      fpga_tools::UnrolledLoop<0, kNCoders>([&](auto i) {
+        bool read_success = false;
+        FlagBundle<SymbolGroup<kWidth>> bundle;
+        // a finished lane must not consume the next job's symbols
+        if (can_continue[i]) {
+          bundle = SymbolGroupPipes<kWidth>::template read<i>(read_success);
+        }
+        perf.EmptyRead(can_continue[i] && !read_success);
+        if (read_success) {
+          can_continue[i] = !bundle.done;
+        }
+        bool coded = read_success && !bundle.done;
+
+        Output out = Output::Empty();
+#pragma unroll
+        for (uint j = 0; j < kWidth; ++j) {
+          if (coded && j < bundle.data.count) {
+            uchar symbol = bundle.data.symbols[j];
+            auto model = contexts[i].Read(context[i]);
+            perf.Norm(model.total_freq >= SimpleModel<kNSymbol>::kBound);
+            auto sf = model.template Update<Precision>(symbol);
+            contexts[i].Write(context[i], model);
+            context[i] = symbol;
+
+            AppendSymbol<Precision>(out, low[i], range[i], sf, perf);
           }
         }
-        range_sizes[i] += out.size;
         out_buffers[i] = out;
       });
+      fpga_tools::UnrolledLoop<0, kNCoders>(
+          [&](auto i) { alive_exists = alive_exists || can_continue[i]; });
 
-      RangePipe<kNCoders>::write({out_buffers, do_ouput_low[1]});
-      RangeCarryPipe<kNCoders>::write({carry_locations, do_ouput_low[1]});
+      do_ouput_low[1] = do_ouput_low[0];
+      alive = !do_ouput_low[1];
+      do_ouput_low[0] = !alive_exists;
+
+      if (do_ouput_low[0]) {
+        fpga_tools::UnrolledLoop<0, kNCoders>([&](auto i) {
+          out_buffers[i] = FlushLow<kBytes>(low[i], do_ouput_low[1]);
+        });
+      }
+      RangePipe<kNCoders, kBytes>::write({out_buffers, do_ouput_low[1]});
     }
+    perf.Send<SymbolGroupPipes<kWidth>>();
+  }
+};
+
+// FusedCoder with the model size picked at launch.
+template <uint kNCoders, uint kWidth, typename Alphabets,
+          ContextOrder kOrder = ContextOrder::kOrder0,
+          typename Precision = Mantissa24Reciprocal>
+struct AlphabetFusedCoder {
+  uint alphabet;  // index into Alphabets
+
+  void operator()() const {
+    fpga_tools::UnrolledLoop<Alphabets::kCount>([&](auto a) {
+      if (a == alphabet) {
+        FusedCoder<kNCoders, kWidth, Alphabets::Size(a), kOrder, Precision>{}();
+      }
+    });
   }
 };
 #endif
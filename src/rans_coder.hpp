@@ -0,0 +1,339 @@
+#ifndef RANS_CODER_HPP_
+#define RANS_CODER_HPP_
+#include <algorithm>
+
+#include "range_decoder.hpp"
+#include "range_encoder.hpp"
+
+// A third coding engine, interleaved rANS with static tables. A pre-pass
+// counts the symbols of a lane and NormalizeFreqs quantizes the counts to
+// frequencies that sum to kRansTotal. The table then codes the whole lane,
+// so the decoder finds a symbol with one lookup of the low kRansScaleBits of
+// a state, and divides nothing.
+//
+// The states of a lane take the symbols in turn and share one stream of
+// 16-bit units. rANS decodes in the reverse order of encoding, so the coder
+// reads a lane from its last symbol to its first, and the decoders read the
+// units from the end of the lane back to the start. The k-th symbol the coder
+// takes goes to state k % n_states. A coder that takes kWidth symbols per
+// cycle has kRansStates * kWidth of them (RansLaneStates), and the container
+// records the count.
+//
+// A lane payload is its table, kNSymbol 16-bit frequencies, followed by the
+// units, followed by the final states, 4 bytes each, state 0 first. All of
+// them are little-endian.
+
+constexpr uint kRansScaleBits = 12;
+constexpr uint kRansTotal = 1 << kRansScaleBits;
+// A state is in [kRansL, 2^31) between symbols.
+constexpr uint kRansL = 1 << 15;
+constexpr uint kRansUnitBits = 16;
+// Cycles before the coder uses a state again, and the states of a lane
+// coded one symbol per cycle.
+constexpr uint kRansStates = 8;
+
+constexpr uint RansLaneStates(uint width) { return kRansStates * width; }
+
+// Quantizes the counts of n symbols to frequencies that sum to kRansTotal.
+// A symbol that occurs keeps a frequency of at least 1. Without any symbol,
+// symbol 0 takes all of kRansTotal.
+// The product of a count and kRansTotal is 64 bits wide, since a lane of a
+// large chunk has counts above 2^20.
+inline void NormalizeFreqs(const uint *counts, uint n, ushort *freqs) {
+  ulong total = 0;
+  for (uint s = 0; s < n; ++s) {
+    total += counts[s];
+  }
+  if (total == 0) {
+    std::fill(freqs, freqs + n, 0);
+    freqs[0] = kRansTotal;
+    return;
+  }
+  int sum = 0;
+  uint largest = 0;
+  for (uint s = 0; s < n; ++s) {
+    freqs[s] = counts[s] == 0
+                   ? 0
+                   : std::max<ulong>(ulong(counts[s]) * kRansTotal / total, 1);
+    sum += freqs[s];
+    largest = counts[s] > counts[largest] ? s : largest;
+  }
+  // rounding down leaves some of kRansTotal to the most frequent symbol, and
+  // the rare symbols raised to 1 are paid for by the largest frequencies
+  freqs[largest] += std::max<int>(kRansTotal - sum, 0);
+  for (; sum > int(kRansTotal); --sum) {
+    --*std::max_element(freqs, freqs + n);
+  }
+}
+
+// What the coder needs to code a symbol: x / freq in Alverson's way, with a
+// multiply by a reciprocal and a shift, exact for x < 2^31.
+struct RansSymbol {
+  uint rcp_freq;
+  uchar rcp_shift;
+  ushort freq;
+  ushort bias;
+  ushort cmpl_freq;
+
+  static RansSymbol Of(ushort freq, ushort start) {
+    RansSymbol sym;
+    sym.freq = freq;
+    sym.cmpl_freq = kRansTotal - freq;
+    if (freq < 2) {
+      // x * kRansTotal + start, through q = x - 1
+      sym.rcp_freq = ~0u;
+      sym.rcp_shift = 0;
+      sym.bias = start + kRansTotal - 1;
+    } else {
+      uint shift = 0;
+      while (freq > (1u << shift)) {
+        shift++;
+      }
+      sym.rcp_freq = ((1ull << (shift + 31)) + freq - 1) / freq;
+      sym.rcp_shift = shift - 1;
+      sym.bias = start;
+    }
+    return sym;
+  }
+};
+
+// Writes the state's low unit out if coding the symbol would leave
+// [kRansL, 2^31), then codes it.
+inline RangeOutput RansEncode(uint &x, const RansSymbol &sym) {
+  auto out = RangeOutput::Empty();
+  // x >= (kRansL >> kRansScaleBits << kRansUnitBits) * freq, which would
+  // not fit 32 bits for a freq of kRansTotal
+  if ((x >> (31 - kRansScaleBits)) >= sym.freq) {
+    out.size = 2;
+    out.buffer[0] = x;
+    out.buffer[1] = x >> 8;
+    x >>= kRansUnitBits;
+  }
+  uint q = uint((ulong(x) * sym.rcp_freq) >> 32) >> sym.rcp_shift;
+  x += sym.bias + q * sym.cmpl_freq;
+  return out;
+}
+
+inline RangeOutput RansFlush(uint x) {
+  auto out = RangeOutput::Empty();
+  out.size = 4;
+#pragma unroll
+  for (uint k = 0; k < 4; ++k) {
+    out.buffer[k] = x >> (8 * k);
+  }
+  return out;
+}
+
+// Codes the symbols of kNCoders lanes from SymbolGroupPipes<kWidth>, up to
+// kWidth per lane and cycle, with the tables in freqs, kNSymbol entries per
+// lane. The groups must deliver every lane from its last symbol to its first.
+// Without a model there is no recurrence from one symbol to the next: the
+// symbols of a group go to kWidth consecutive states, row by row of
+// kStates / kWidth rows, and a row is only used again that many cycles
+// later, kRansStates for any kWidth, which covers the multiply chain of
+// RansEncode. A lane that is done writes its kStates states out, one per
+// cycle.
+template <uint kNCoders, uint kWidth, uint kNSymbol, typename Freqs,
+          uint kStates = RansLaneStates(kWidth)>
+struct RansCoder {
+  static_assert(kStates % kWidth == 0, "a group takes whole rows of states");
+  static constexpr uint kRows = kStates / kWidth;
+  static constexpr uint kBytes = kWidth * kRangeOutSize;
+  using Output = RangeOutputOf<kBytes>;
+  using InPipes = SymbolGroupPipes<kWidth>;
+
+  Freqs freqs;
+
+  void operator()() const {
+    RansSymbol syms[kNCoders][kNSymbol];
+    for (uint i = 0; i < kNCoders; ++i) {
+      ushort start = 0;
+      for (uint s = 0; s < kNSymbol; ++s) {
+        ushort freq = freqs[i * kNSymbol + s];
+        syms[i][s] = RansSymbol::Of(freq, start);
+        start += freq;
+      }
+    }
+
+    uint states[kNCoders][kRows][kWidth];
+    ac_int<Log2(kRows) + 1, false> row[kNCoders];
+    bool can_continue[kNCoders];
+    ac_int<Log2(kStates) + 1, false> flushed[kNCoders];
+#pragma unroll
+    for (uint i = 0; i < kNCoders; ++i) {
+#pragma unroll
+      for (uint r = 0; r < kRows; ++r) {
+#pragma unroll
+        for (uint j = 0; j < kWidth; ++j) {
+          states[i][r][j] = kRansL;
+        }
+      }
+      row[i] = 0;
+      can_continue[i] = true;
+      flushed[i] = 0;
+    }
+    PerfCounters perf;
+    perf.Init();
+
+    bool alive = true;
+    [[intel::ivdep(kRows)]]
+    while (alive) {
+      perf.Cycle();
+      bool last = true;
+      std::array<Output, kNCoders> out_buffers;
+      fpga_tools::UnrolledLoop<0, kNCoders>([&](auto i) {
+        auto out = Output::Empty();
+        if (can_continue[i]) {
+          bool read_success = false;
+          auto bundle = InPipes::template read<i>(read_success);
+          perf.EmptyRead(!read_success);
+          if (read_success) {
+            can_continue[i] = !bundle.done;
+          }
+          if (read_success && !bundle.done) {
+            fpga_tools::UnrolledLoop<kWidth>([&](auto j) {
+              if (j < bundle.data.count) {
+                uint x = states[i][row[i]][j];
+                RangeOutput unit =
+                    RansEncode(x, syms[i][bundle.data.symbols[j]]);
+                states[i][row[i]][j] = x;
+                perf.Renorm(true, unit.size);
+                decltype(out.buffer) bytes;
+                bytes.AcInt() = unit.buffer.AcInt();
+                out.buffer.AcInt() |=
+                    bytes.template ElementShift<false>(out.size).AcInt();
+                out.size += unit.size;
+              }
+            });
+            row[i] = row[i] == kRows - 1 ? 0 : row[i] + 1;
+          }
+        } else if (flushed[i] < kStates) {
+          RangeOutput state =
+              RansFlush(states[i][flushed[i] / kWidth][flushed[i] % kWidth]);
+          out.buffer.AcInt() = state.buffer.AcInt();
+          out.size = state.size;
+          flushed[i] = flushed[i] + 1;
+        }
+        out_buffers[i] = out;
+        last = last && flushed[i] == kStates;
+      });
+      alive = !last;
+      RangePipe<kNCoders, kBytes>::write({out_buffers, last});
+    }
+    perf.Send<InPipes>();
+  }
+};
+
+// RansCoder with the model size picked at launch.
+template <uint kNCoders, uint kWidth, typename Alphabets, typename Freqs>
+struct AlphabetRansCoder {
+  uint alphabet;  // index into Alphabets
+  Freqs freqs;
+
+  void operator()() const {
+    fpga_tools::UnrolledLoop<Alphabets::kCount>([&](auto a) {
+      if (a == alphabet) {
+        RansCoder<kNCoders, kWidth, Alphabets::Size(a), Freqs>{freqs}();
+      }
+    });
+  }
+};
+
+// Sends a lane of size bytes at word begin of rc to RansDecoderKernel<kLane>:
+// the symbol count and the number of units first, then the table, the
+// states from the last to the first, and the units from the end backwards.
+template <uint kLane, uint kStates = kRansStates, typename RCWords>
+void FeedRansDecoder(const RCWords &rc, uint begin, uint size,
+                     uint num_symbols, uint n_table) {
+  auto unit = [&](uint u) {
+    return (rc[begin + u / 2].to_uint() >> (kRansUnitBits * (u % 2))) & 0xffff;
+  };
+  uint n_units = size / 2;
+  uint states_begin = n_units - 2 * kStates;
+  RCInitPipes::write<kLane>({num_symbols, 0, 0, states_begin - n_table});
+  for (uint u = 0; u < n_table; ++u) {
+    RCDataInPipes::write<kLane>(unit(u));
+  }
+  for (int j = kStates - 1; j >= 0; --j) {
+    uint u = states_begin + 2 * j;
+    RCDataInPipes::write<kLane>(unit(u) | unit(u + 1) << kRansUnitBits);
+  }
+  for (uint u = states_begin; u > n_table; --u) {
+    RCDataInPipes::write<kLane>(unit(u - 1));
+  }
+}
+
+// Decodes a lane of RansCoder, one symbol per cycle. The states take the
+// symbols in turn, so a state is only used again kStates cycles later.
+template <uint kNSymbol, uint kLane = 0, uint kStates = kRansStates>
+struct RansDecoderKernel {
+  void operator()() const {
+    uint4 init = RCInitPipes::read<kLane>();
+    uint num_symbol = init[0];
+    uint num_units = init[3];
+    PerfCounters perf;
+    perf.Init();
+
+    ushort freq[kNSymbol];
+    ushort cum[kNSymbol];
+    uchar slot_symbol[kRansTotal];
+    ushort start = 0;
+    for (uint s = 0; s < kNSymbol; ++s) {
+      freq[s] = RCDataInPipes::read<kLane>();
+      cum[s] = start;
+      for (ushort c = 0; c < freq[s]; ++c) {
+        slot_symbol[start + c] = s;
+      }
+      start += freq[s];
+    }
+
+    uint states[kStates];
+#pragma unroll
+    for (int j = kStates - 1; j >= 0; --j) {
+      states[j] = RCDataInPipes::read<kLane>();
+    }
+
+    uint j = num_symbol == 0 ? 0 : (num_symbol - 1) % kStates;
+    uint units_read = 0;
+    [[intel::ivdep(kStates)]]
+    for (uint k = 0; k < num_symbol; ++k) {
+      perf.Cycle();
+      uint x = states[j];
+      ushort slot = x & (kRansTotal - 1);
+      uchar symbol = slot_symbol[slot];
+      x = freq[symbol] * (x >> kRansScaleBits) + slot - cum[symbol];
+      // a corrupt lane that asks for more units than it has must not wait
+      // on the data pipe forever
+      bool renorm = x < kRansL && units_read < num_units;
+      if (renorm) {
+        x = x << kRansUnitBits | RCDataInPipes::read<kLane>();
+        units_read++;
+      }
+      perf.Renorm(true, renorm * 2);
+      states[j] = x;
+      j = j == 0 ? kStates - 1 : j - 1;
+      SymbolOutPipes::write<kLane>(symbol);
+    }
+    // leave the data pipe empty for the next stream
+    for (; units_read < num_units; ++units_read) {
+      RCDataInPipes::read<kLane>();
+    }
+    perf.Send<RCDataInPipes::PipeAt<kLane>>();
+  }
+};
+
+// RansDecoderKernel with the model size picked at launch.
+template <typename Alphabets, uint kLane = 0, uint kStates = kRansStates>
+struct AlphabetRansDecoderKernel {
+  uint alphabet;  // index into Alphabets
+
+  void operator()() const {
+    fpga_tools::UnrolledLoop<Alphabets::kCount>([&](auto a) {
+      if (a == alphabet) {
+        RansDecoderKernel<Alphabets::Size(a), kLane, kStates>{}();
+      }
+    });
+  }
+};
+
+#endif  // RANS_CODER_HPP_
@@ -0,0 +1,313 @@
+#ifndef RUN_LENGTH_HPP_
+#define RUN_LENGTH_HPP_
+#include <vector>
+
+#include "range_decoder.hpp"
+#include "range_encoder.hpp"
+
+// An optional stage in front of the model that turns runs of one symbol into
+// tokens. Every symbol is a literal token, until kRunTrigger equal literals
+// in a row. The next token is then a count, the number c of further repeats
+// of that literal, coded with a model of its own of kRunSymbols symbols. A
+// count of kMaxRunCount says that another count follows, so a run of any
+// length is its first kRunTrigger literals and a few counts. A lane that ends
+// on kRunTrigger equal literals still codes a count, 0 if nothing follows.
+//
+// Which of the two models a token goes to follows from the tokens before it,
+// so the coded stream needs no flags, and the encoder, the decoder and the
+// inverse stage each track it with a RunLengthState. Only literals move the
+// context of an order-1 model.
+
+constexpr uint kRunTrigger = 3;
+constexpr uint kRunSymbols = 16;
+constexpr uint kMaxRunCount = kRunSymbols - 1;
+
+struct RunLengthState {
+  uchar last;  // the last literal
+  uchar repeats;  // of last in a row, up to kRunTrigger
+  bool count_next;
+
+  void Init() {
+    last = 0;
+    repeats = 0;
+    count_next = false;
+  }
+
+  // Whether the next token is a count.
+  bool IsCount() const { return count_next; }
+
+  // The symbols token stands for.
+  uint Symbols(uchar token) const { return count_next ? token : 1; }
+
+  void Next(uchar token) {
+    if (count_next) {
+      count_next = token == kMaxRunCount;
+      repeats = 0;
+    } else {
+      repeats = repeats > 0 && token == last ? repeats + 1 : 1;
+      last = token;
+      count_next = repeats == kRunTrigger;
+    }
+  }
+};
+
+using RunTokenPipes =
+    PipeArray<class RunTokP, FlagBundle<uchar>, 256, kMaxCoders>;
+using RunTokenOutPipes = PipeArray<class RunTokOP, uchar, 4, kMaxCoders>;
+
+// Turns the symbols of InPipe into tokens on OutPipe, one symbol per cycle.
+// A run that ends on a new symbol needs its count and the new literal, and
+// the literal waits one cycle for its turn.
+template <typename InPipe, typename OutPipe>
+struct RunLengthEncoder {
+  void operator()() const {
+    RunLengthState state;
+    state.Init();
+    uchar run = 0;  // repeats of the current run not counted yet
+    FlagBundle<uchar> held;
+    bool holding = false;
+    bool done = false;
+    while (!done) {
+      auto in = holding ? held : InPipe::read();
+      holding = false;
+      if (state.IsCount()) {
+        if (!in.done && in.data == state.last) {
+          run++;
+          if (run == kMaxRunCount) {
+            OutPipe::write({uchar(kMaxRunCount), false});
+            state.Next(kMaxRunCount);
+            run = 0;
+          }
+        } else {
+          OutPipe::write({run, false});
+          state.Next(run);
+          // a count of run left the state in literal mode for in
+          held = in;
+          holding = true;
+          run = 0;
+        }
+      } else {
+        OutPipe::write(in);
+        state.Next(in.data);
+        done = in.done;
+      }
+    }
+  }
+};
+
+// SimpleModelKernel for the tokens of RunLengthEncoder: the literals go to
+// the kNSymbol contexts and the counts to a kRunSymbols model.
+template <typename InPipe, typename FreqOutPipe, uint kNSymbol,
+          ContextOrder kOrder = ContextOrder::kOrder0,
+          typename Precision = Mantissa24Reciprocal>
+struct RunLengthModelKernel {
+  void operator()() const {
+    bool done = false;
+    ModelContexts<kNSymbol, kOrder> contexts;
+    contexts.template Init<Precision>();
+    SimpleModel<kRunSymbols> runs;
+    runs.template Init<Precision>();
+    RunLengthState state;
+    state.Init();
+    uchar context = 0;
+    PerfCounters perf;
+    perf.Init();
+    [[intel::ivdep(kContextCacheDepth)]]
+    while (!done) {
+      auto in = InPipe::read();
+      done = in.done;
+      bool is_count = state.IsCount() && !done;
+      auto model = contexts.Read(context);
+      perf.Cycle();
+      perf.Norm(!done && (is_count ? runs.total_freq : model.total_freq) >=
+                             SimpleModel<kNSymbol>::kBound);
+      SymbolFrequence f;
+      if (is_count) {
+        f = runs.template Update<Precision>(in.data);
+      } else {
+        f = model.template Update<Precision>(in.data);
+        contexts.Write(context, model);
+        context = in.data;
+      }
+      state.Next(in.data);
+      FreqOutPipe::write({f, done});
+    }
+    perf.Send<InPipe>();
+  }
+};
+
+// RunLengthModelKernel with the model size picked at launch.
+template <typename InPipe, typename FreqOutPipe, typename Alphabets,
+          ContextOrder kOrder = ContextOrder::kOrder0,
+          typename Precision = Mantissa24Reciprocal>
+struct AlphabetRunLengthModelKernel {
+  uint alphabet;  // index into Alphabets
+
+  void operator()() const {
+    fpga_tools::UnrolledLoop<Alphabets::kCount>([&](auto a) {
+      if (a == alphabet) {
+        RunLengthModelKernel<InPipe, FreqOutPipe, Alphabets::Size(a), kOrder,
+                             Precision>{}();
+      }
+    });
+  }
+};
+
+// RangeDecoderKernel for a lane of tokens, fed the same way. Both models
+// search for the token next to each other, and the state picks one. The
+// tokens go to RunTokenOutPipes, for RunLengthExpander<kLane>. Decoding
+// stops at the lane's symbol count, after the count a last run still owes.
+template <uint kNSymbol, uint kLane = 0,
+          ContextOrder kOrder = ContextOrder::kOrder0,
+          typename SymbolSearch = TreeSymbolSearch,
+          typename Precision = Mantissa24Reciprocal>
+struct RunLengthDecoderKernel {
+  static_assert(Precision::kOnDevice, "no kernel datapath for this precision");
+
+  void operator()() const {
+    const auto &rom = kReciprocalRom<SimpleModel<kNSymbol>, Precision>;
+    const auto &run_rom = kReciprocalRom<SimpleModel<kRunSymbols>, Precision>;
+    ModelContexts<kNSymbol, kOrder> contexts;
+    contexts.template Init<Precision>();
+    SimpleModel<kRunSymbols> runs;
+    runs.template Init<Precision>();
+    RunLengthState state;
+    state.Init();
+    uchar context = 0;
+    uint range = (uint)-1;
+    uint4 init = RCInitPipes::read<kLane>();
+    uint num_symbol = init[0];
+    uint code = init[1];
+    RCInputStream input_stream{init[2], kRangeOutSize};
+    uint num_words = init[3];
+    uint words_read = 0;
+    PerfCounters perf;
+    perf.Init();
+
+    [[intel::ivdep(kContextCacheDepth)]]
+    for (uint s = 0; s < num_symbol || state.IsCount();) {
+      bool is_count = state.IsCount();
+      auto model = contexts.Read(context);
+      perf.Cycle();
+      perf.Norm((is_count ? runs.total_freq : model.total_freq) >=
+                SimpleModel<kNSymbol>::kBound);
+      uint range_unit = Precision::RangeUnit(
+          range, is_count ? run_rom.reciprocal[runs.step]
+                          : rom.reciprocal[model.step]);
+
+      ushort literal_cum;
+      ushort count_cum;
+      uchar literal = SymbolSearch::template Find<kNSymbol>(
+          model.freqs, range_unit, code, literal_cum);
+      uchar count = SymbolSearch::template Find<kRunSymbols>(
+          runs.freqs, range_unit, code, count_cum);
+      uchar token = is_count ? count : literal;
+      range = ShiftMultiply(range_unit, is_count ? runs.freqs[count]
+                                                 : model.freqs[literal]);
+      code -= ShiftMultiply(range_unit, is_count ? count_cum : literal_cum);
+
+      if (is_count) {
+        runs.template UpdateFreqs<Precision>(token);
+      } else {
+        model.template UpdateFreqs<Precision>(token);
+        contexts.Write(context, model);
+        context = token;
+      }
+      s += state.Symbols(token);
+      state.Next(token);
+
+      uchar stream_size = input_stream.size;
+      UpdateRange(range, code, input_stream);
+      perf.Renorm(true, stream_size - input_stream.size);
+
+      if (input_stream.size <= kRangeOutSize) {
+        UintRCVecx2 in = RCDataInPipes::read<kLane>();
+        input_stream.bits |= in << (input_stream.size * 8);
+        input_stream.size += kRangeOutSize;
+        words_read++;
+      }
+
+      RunTokenOutPipes::write<kLane>(token);
+    }
+    // leave the data pipe empty for the next stream
+    for (; words_read < num_words; ++words_read) {
+      RCDataInPipes::read<kLane>();
+    }
+    perf.Send<RCDataInPipes::PipeAt<kLane>>();
+  }
+};
+
+// RunLengthDecoderKernel with the model size picked at launch.
+template <typename Alphabets, uint kLane = 0,
+          ContextOrder kOrder = ContextOrder::kOrder0,
+          typename SymbolSearch = TreeSymbolSearch,
+          typename Precision = Mantissa24Reciprocal>
+struct AlphabetRunLengthDecoderKernel {
+  uint alphabet;  // index into Alphabets
+
+  void operator()() const {
+    fpga_tools::UnrolledLoop<Alphabets::kCount>([&](auto a) {
+      if (a == alphabet) {
+        RunLengthDecoderKernel<Alphabets::Size(a), kLane, kOrder, SymbolSearch,
+                               Precision>{}();
+      }
+    });
+  }
+};
+
+// The inverse stage: turns the tokens of lane kLane back into its n_symbols
+// symbols on SymbolOutPipes, one symbol per cycle. A count reads no symbol
+// out and has its repeats written on the cycles after it.
+template <uint kLane = 0>
+struct RunLengthExpander {
+  uint n_symbols;
+
+  void operator()() const {
+    RunLengthState state;
+    state.Init();
+    uchar left = 0;  // repeats of state.last still to write
+    for (uint k = 0; k < n_symbols || state.IsCount();) {
+      if (left > 0) {
+        SymbolOutPipes::write<kLane>(state.last);
+        left--;
+        k++;
+      } else {
+        uchar token = RunTokenOutPipes::read<kLane>();
+        if (state.IsCount()) {
+          left = token;
+        } else {
+          SymbolOutPipes::write<kLane>(token);
+          k++;
+        }
+        state.Next(token);
+      }
+    }
+  }
+};
+
+// The tokens of the n_symbols symbols at in, as RunLengthEncoder sends them.
+inline void RunLengthTokens(const uchar *in, uint n_symbols,
+                            std::vector<uchar> &tokens) {
+  RunLengthState state;
+  state.Init();
+  tokens.clear();
+  auto put = [&](uchar token) {
+    tokens.push_back(token);
+    state.Next(token);
+  };
+  for (uint k = 0; k < n_symbols;) {
+    put(in[k++]);
+    if (state.IsCount()) {
+      uint run = 0;
+      for (; k < n_symbols && in[k] == state.last; ++k) {
+        run++;
+      }
+      for (; run >= kMaxRunCount; run -= kMaxRunCount) {
+        put(kMaxRunCount);
+      }
+      put(run);
+    }
+  }
+}
+
+#endif  // RUN_LENGTH_HPP_
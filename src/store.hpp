@@ -3,112 +3,257 @@
 #include "range_coding.h"
 #include "unrolled_loop.hpp"
 
-template <uint num_enabled_coders, typename UintAccessorList,
-          typename OutSizeAccessor>
-void StoreCarry(UintAccessorList &out_accessors,
-                OutSizeAccessor &size_accessor) {
-  constexpr uint kNCoders = num_enabled_coders;
-  uint num_locations[kNCoders];
-#pragma unroll
-  for (int i = 0; i < kNCoders; i++) {
-    num_locations[i] = 0;
+using RangeVector = decltype(RangeOutput::buffer);
+
+// A lane gathers its coded words into bursts of kStoreBurstBytes, and writes
+// a whole aligned burst at once. Every lane then has a single wide LSU that
+// issues full bursts, instead of a narrow store per word.
+constexpr uint kStoreBurstBytes = 64;
+constexpr uint kStoreBurstWords = kStoreBurstBytes / kRangeOutSize;
+struct alignas(kStoreBurstBytes) StoreBurst {
+  RangeVector::AcIntType words[kStoreBurstWords];
+};
+
+// DDR channels of the board. The output buffers of the lanes go to the
+// channels in turn, so that more lanes get more memory bandwidth.
+#ifndef DDR_CHANNELS
+#define DDR_CHANNELS 4
+#endif
+constexpr uint kDdrChannels = DDR_CHANNELS;
+
+// A carry out of the coder's low adds one to bytes that were already sent.
+// It can only reach the last byte that is not 0xff and the run of 0xff bytes
+// after it, so those are held back as cache + run length until a byte that
+// stops the ripple arrives. After a carry the coder's next byte is 0x00, so
+// a held run never takes more than one carry.
+// A resolver takes and releases up to kBytes bytes per iteration.
+template <uint kBytes = kRangeOutSize>
+struct CarryResolver {
+  using Output = RangeOutputOf<kBytes>;
+  using Vector = decltype(Output::buffer);
+
+  uchar cache;
+  bool has_cache;
+  bool carry;
+  uint run;
+  // a released run is written kBytes bytes per iteration, and input bytes
+  // behind it wait in the stash
+  uint drain;
+  uchar drain_byte;
+  Vector stash;
+  typename Output::IdxType stash_size;
+
+  void Init() {
+    has_cache = false;
+    carry = false;
+    run = 0;
+    drain = 0;
+    stash_size = 0;
   }
-  bool done = false;
-  while (!done) {
-    auto bundle = RangeCarryPipe<kNCoders>::read();
-    done = bundle.done;
-    fpga_tools::UnrolledLoop<0, kNCoders>([&](auto i) {
-      if (bundle.data[i] != 0xffffffff) {
-        out_accessors[i][num_locations[i]++] = bundle.data[i];
+
+  bool Busy() const { return drain > 0 || stash_size > 0; }
+
+  // Takes in the coder output (when has_input) or the stash and returns the
+  // bytes that can no longer change.
+  Output Resolve(const Output &in, bool has_input) {
+    Output out = Output::Empty();
+    if (drain > 0) {
+      out.size = drain < kBytes ? drain : kBytes;
+#pragma unroll
+      for (uint k = 0; k < kBytes; ++k) {
+        out.buffer[k] = k < out.size ? drain_byte : 0;
       }
-    });
+      drain -= out.size;
+      return out;
+    }
+
+    Vector src = has_input ? in.buffer : stash;
+    typename Output::IdxType src_size = has_input ? in.size : stash_size;
+    if (has_input && in.carry) {
+      carry = true;
+    }
+    bool stop = false;
+    typename Output::IdxType consumed = 0;
+#pragma unroll
+    for (uint k = 0; k < kBytes; ++k) {
+      uchar b = src[k];
+      if (k < src_size && !stop) {
+        consumed = k + 1;
+        if (b == 0xff && has_cache) {
+          run++;
+        } else {
+          if (has_cache) {
+            out.buffer[out.size++] = cache + carry;
+          }
+          if (run > 0) {
+            drain = run;
+            drain_byte = carry ? 0x00 : 0xff;
+            stop = true;
+          }
+          cache = b;
+          has_cache = true;
+          carry = false;
+          run = 0;
+        }
+      }
+    }
+    stash = src.ElementShift(consumed);
+    stash_size = src_size - consumed;
+    return out;
   }
-  using PipelinedLSU = ext::intel::lsu<>;
-  fpga_tools::UnrolledLoop<0, kNCoders>([&](auto i) {
-    PipelinedLSU::store(size_accessor.get_pointer() + i, num_locations[i]);
-  });
-}
-using RangeVector = decltype(RangeOutput::buffer);
-using RangeVectorx2 = ShiftingArray<uchar, kRangeOutSize * 2>;
 
-template <uint kNCoders, typename DataAccessor, typename SizeAccessor>
+  // Releases the held bytes at the end of the stream.
+  Output Flush() {
+    Output out = Output::Empty();
+    if (has_cache) {
+      out.size = 1;
+      out.buffer[0] = cache + carry;
+      drain = run;
+      drain_byte = carry ? 0x00 : 0xff;
+    }
+    has_cache = false;
+    return out;
+  }
+};
+
+// Writes the coded bytes of every lane to its out accessor of StoreBurst,
+// and the byte count of lane i to size_accessor[i]. The coder sends up to
+// kBytes bytes per lane and iteration, so up to kBytes / kRangeOutSize
+// words of a lane complete per iteration.
+template <uint kNCoders, uint kBytes = kRangeOutSize, typename DataAccessor,
+          typename SizeAccessor>
 void Store(DataAccessor &out_accessors, SizeAccessor &size_accessor) {
-  uint accessor_indices[kNCoders];
-  std::array<RangeVectorx2, kNCoders> out_streams;
-  ac_int<Log2(kRangeOutSize * 2) + 1, false> stream_sizes[kNCoders];
+  static_assert(kBytes % kRangeOutSize == 0, "the coder sends whole words");
+  using BurstLSU = ext::intel::lsu<ext::intel::burst_coalesce<true>>;
+  // a partial word and the new bytes
+  using OutStream = ShiftingArray<uchar, kBytes * 2>;
+  uint accessor_indices[kNCoders];  // bursts written
+  std::array<OutStream, kNCoders> out_streams;
+  ac_int<Log2(kRangeOutSize) + 1, false> stream_sizes[kNCoders];
+  StoreBurst bursts[kNCoders];
+  ac_int<Log2(kStoreBurstWords), false> burst_fill[kNCoders];  // words
+  CarryResolver<kBytes> resolvers[kNCoders];
 
 #pragma unroll
   for (int i = 0; i < kNCoders; i++) {
     stream_sizes[i] = 0;
     accessor_indices[i] = 0;
     out_streams[i].AcInt() = 0;
+    bursts[i] = {};
+    burst_fill[i] = 0;
+    resolvers[i].Init();
   }
 
+  // puts the complete low word of out_streams[i] at the burst position
+  auto gather = [&](uint i) {
+#pragma unroll
+    for (uint k = 0; k < kStoreBurstWords; ++k) {
+      if (k == burst_fill[i]) {
+        bursts[i].words[k] =
+            static_cast<RangeVector::AcIntType>(out_streams[i].AcInt());
+      }
+    }
+  };
+
   bool done = false;
-  while (!done) {
-    auto bundle = RangePipe<kNCoders>::read();
-    done = bundle.done;
+  bool flushed = false;
+  bool busy = false;
+  PerfCounters perf;
+  perf.Init();
+  while (!flushed || busy) {
+    // new coder output is taken only when no lane is still draining
+    bool read_input = !busy && !done;
+    bool flush = !busy && done && !flushed;
+    FlagBundle<array<RangeOutputOf<kBytes>, kNCoders>> bundle;
+    if (read_input) {
+      bundle = RangePipe<kNCoders, kBytes>::read();
+    }
+    perf.Cycle();
+    perf.Stall(busy);
+    bool any_busy = false;
     fpga_tools::UnrolledLoop<0, kNCoders>([&](auto i) {
-      RangeVectorx2 buffer;
-      buffer.AcInt() = bundle.data[i].buffer.AcInt();
+      auto out = flush ? resolvers[i].Flush()
+                       : resolvers[i].Resolve(bundle.data[i], read_input);
+      perf.Carry(read_input && bundle.data[i].carry);
+      any_busy = any_busy || resolvers[i].Busy();
+
+      OutStream buffer;
+      buffer.AcInt() = out.buffer.AcInt();
       out_streams[i].AcInt() |=
-          buffer.ElementShift<false>(stream_sizes[i]).AcInt();
-      if (stream_sizes[i] >= kRangeOutSize - bundle.data[i].size) {
-        out_accessors[i][accessor_indices[i]++] = out_streams[i].AcInt();
-        out_streams[i].ElementShift(kRangeOutSize);
-      }
-      stream_sizes[i] = (stream_sizes[i] + bundle.data[i].size) % kRangeOutSize;
+          buffer.template ElementShift<false>(stream_sizes[i]).AcInt();
+      uint stream_size = stream_sizes[i] + out.size;
+      fpga_tools::UnrolledLoop<kBytes / kRangeOutSize>([&](auto w) {
+        if (stream_size >= (w + 1) * kRangeOutSize) {
+          gather(i);
+          if (burst_fill[i] == kStoreBurstWords - 1) {
+            BurstLSU::store(
+                out_accessors[i].get_pointer() + accessor_indices[i]++,
+                bursts[i]);
+          }
+          burst_fill[i]++;
+          out_streams[i].ElementShift(kRangeOutSize);
+        }
+      });
+      stream_sizes[i] = stream_size % kRangeOutSize;
     });
+    done = done || (read_input && bundle.done);
+    flushed = flushed || flush;
+    busy = any_busy;
   }
+  // the last burst, with the partial last word
   using PipelinedLSU = ext::intel::lsu<>;
   fpga_tools::UnrolledLoop<0, kNCoders>([&](auto i) {
-    PipelinedLSU::store(
-        out_accessors[i].get_pointer() + accessor_indices[i],
-        static_cast<RangeVector::AcIntType>(out_streams[i].AcInt()));
+    gather(i);
+    BurstLSU::store(out_accessors[i].get_pointer() + accessor_indices[i],
+                    bursts[i]);
     PipelinedLSU::store(
         size_accessor.get_pointer() + i,
-        accessor_indices[i] * kRangeOutSize + stream_sizes[i].to_uint());
+        (accessor_indices[i] * kStoreBurstWords + burst_fill[i].to_uint()) *
+                kRangeOutSize +
+            stream_sizes[i].to_uint());
   });
+  perf.Send<RangePipe<kNCoders, kBytes>>();
 }
 
 static const property_list buffer_props{property::buffer::mem_channel{1}};
-template <uchar kNCoders>
+template <uchar kNCoders, uint kBytes = kRangeOutSize>
 struct DoubleBufferingStore {
   template <typename T>
   struct BufferList {
     std::array<buffer<T, 1>, kNCoders> list;
     BufferList(size_t buffer_size) : list(CreateBufferArray(buffer_size)) {}
+    // lane i on DDR channel 1 + i % kDdrChannels: mem_channel numbers the
+    // channels from 1, as in buffer_props, since 0 is no channel at all
     static auto CreateBufferArray(size_t size) {
-      return CreateArray<kNCoders>(
-          [=](size_t i) { return buffer<T, 1>(range<1>(size), buffer_props); });
+      return CreateArray<kNCoders>([=](size_t i) {
+        return buffer<T, 1>(
+            range<1>(size),
+            property_list{property::buffer::mem_channel{
+                int(1 + i % kDdrChannels)}});
+      });
     }
     buffer<T, 1> &operator[](size_t idx) { return list[idx]; }
   };
 
-  BufferList<RangeVector::AcIntType> rc_buffer[2];
-  BufferList<uint> carry_buffer[2];
+  BufferList<StoreBurst> rc_buffer[2];
   buffer<uint, 1> rc_size_buffer[2];
-  buffer<uint, 1> carry_size_buffer[2];
   event rc_event[2];
-  event carry_event[2];
 
-  DoubleBufferingStore(size_t fq_size)
+  // Worst-case output of one coder in bursts: slightly more than a byte per
+  // symbol on incompressible input, plus the end-of-stream flush.
+  static size_t RCCapacity(size_t lane_size) {
+    return CountVecs<kStoreBurstBytes>(lane_size + lane_size / 8 + 16);
+  }
+
+  DoubleBufferingStore(size_t lane_size)
       : rc_buffer{
-        BufferList<RangeVector::AcIntType>(fq_size/kRangeOutSize),
-        BufferList<RangeVector::AcIntType>(fq_size/kRangeOutSize),
-      },
-      carry_buffer{
-        BufferList<uint>(fq_size/10),
-        BufferList<uint>(fq_size/10),
+        BufferList<StoreBurst>(RCCapacity(lane_size)),
+        BufferList<StoreBurst>(RCCapacity(lane_size)),
       },
       rc_size_buffer{
         buffer<uint,1>{range<1>(kNCoders),buffer_props},
         buffer<uint,1>{range<1>(kNCoders),buffer_props},
-      },
-        carry_size_buffer{
-        buffer<uint,1>{range<1>(kNCoders),buffer_props},
-        buffer<uint,1>{range<1>(kNCoders),buffer_props},
-        }
+      }
     {}
 
   void Launch(queue &q, bool id) {
@@ -117,37 +262,10 @@ struct DoubleBufferingStore {
           [&](size_t idx) { return rc_buffer[id][idx].get_access(h); });
       auto size_acc = rc_size_buffer[id].get_access(h);
       h.single_task<class StoreRC>([=]() [[intel::kernel_args_restrict]] {
-        Store<kNCoders>(acc_list, size_acc);
-      });
-    });
-    carry_event[id] = q.submit([&](handler &h) {
-      auto acc_list = CreateArray<kNCoders>(
-          [&](size_t idx) { return carry_buffer[id][idx].get_access(h); });
-      auto size_acc = carry_size_buffer[id].get_access(h);
-      h.single_task<class StoreCarrys>([=]() [[intel::kernel_args_restrict]] {
-        StoreCarry<kNCoders>(acc_list, size_acc);
+        Store<kNCoders, kBytes>(acc_list, size_acc);
       });
     });
   }
-
-  void ApplyCarry(bool id, uint coder_idx) {
-    uint i = coder_idx;
-    auto data_buffer = rc_buffer[id][i];
-    auto carrys = carry_buffer[id][i];
-    uint carry_size = carry_size_buffer[id].get_host_access()[i];
-    if (carry_size > 0) {
-      auto carry_acc = carrys.get_host_access();
-      auto data_acc = data_buffer.get_host_access();
-      for (int i = 0; i < carry_size; ++i) {
-        auto loc = carry_acc[i] - 1;
-        while (data_acc[loc] == 0xff) {
-          data_acc[loc] = 0x00;
-          loc--;
-        }
-        data_acc[loc]++;
-      }
-    }
-  }
 };
 
 #endif  // STORE_HPP_
\ No newline at end of file
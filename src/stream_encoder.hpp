@@ -0,0 +1,500 @@
+#ifndef STREAM_ENCODER_HPP_
+#define STREAM_ENCODER_HPP_
+#include <algorithm>
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "binary_coder.hpp"
+#include "block_sort.hpp"
+#include "container.hpp"
+#include "lane_threads.hpp"
+#include "rans_coder.hpp"
+#include "run_length.hpp"
+#include "range_encoder.hpp"
+#include "store.hpp"
+
+using SymbPipes =
+    PipeArray<class SxxxqP, FlagBundle<uchar>, 256, kMaxCoders>;
+
+template <uint kLane, typename In>
+class ReadSymbols;
+template <typename In>
+class FindUsedBytes;
+template <typename In>
+class ChunkHistogram;
+
+// bytes the FindUsedBytes pre-pass looks at per cycle
+constexpr uint kUsedBytesWidth = 8;
+
+// Encodes an input of any length in fixed-size chunks. Each chunk becomes
+// one MultiStream container. The two DoubleBufferingStore slots are used in
+// turn, so that while chunk k is being encoded, chunk k+1 is read and copied
+// to the device and chunk k-1 is read back and handed to the sink.
+// A pre-pass on the device finds the bytes a chunk uses. The lanes then code
+// their ranks with the smallest model size of Alphabets that fits.
+// An input in device-readable host memory (see HostInput) is read by the
+// kernels in place instead, without staging or transfers.
+// With kSymbolsPerCycle above 1, one FusedCoder takes the place of the
+// model kernels and the RangeCoder, and codes that many symbols per lane and
+// cycle. The binary engine has a BinaryCoder in their place instead. The
+// rANS engine makes two passes over a chunk: a ChunkHistogram pre-pass counts
+// the lanes on the device and freezes their tables, and a RansCoder then codes
+// the lanes backwards with them, kSymbolsPerCycle symbols per lane and cycle.
+// The run-length transform puts a RunLengthEncoder in front of the model
+// kernel of every lane, which codes the tokens with RunLengthModelKernel.
+// The block-sort transform sorts every lane of a chunk on the host, one
+// thread per lane, before the chunk goes to the device, and puts a
+// MoveToFrontEncoder in front of the model kernel of every lane.
+template <uint kNCoders, typename Alphabets,
+          ContextOrder kOrder = ContextOrder::kOrder0,
+          typename Precision = Mantissa24Reciprocal,
+          uint kSymbolsPerCycle = 1, CoderEngine kEngine = CoderEngine::kRange,
+          SymbolTransform kTransform = SymbolTransform::kNone>
+class StreamingEncoder {
+  static constexpr bool kBinary = kEngine == CoderEngine::kBinary;
+  static constexpr bool kRans = kEngine == CoderEngine::kRans;
+  static constexpr bool kFused =
+      kSymbolsPerCycle > 1 && kEngine == CoderEngine::kRange;
+  static_assert(!kBinary || (kSymbolsPerCycle == 1 &&
+                             kOrder == ContextOrder::kOrder0),
+                "the binary engine codes one bit per cycle with order 0");
+  static_assert(!kRans || kOrder == ContextOrder::kOrder0,
+                "the rANS engine codes with order 0");
+  static constexpr bool kRunLength = kTransform == SymbolTransform::kRunLength;
+  static constexpr bool kBlockSort = kTransform == SymbolTransform::kBlockSort;
+  static_assert(kTransform == SymbolTransform::kNone ||
+                    (kEngine == CoderEngine::kRange && kSymbolsPerCycle == 1),
+                "transforms go through the model kernels of the range engine");
+  static constexpr uint kStoreBytes = kSymbolsPerCycle * kRangeOutSize;
+
+ public:
+  StreamingEncoder(queue &q, size_t chunk_size)
+      : q_(q),
+        chunk_size_(chunk_size),
+        lane_size_(ChunkLaneSize(chunk_size, kNCoders)),
+        fq_buffer_{buffer<uchar, 1>{range<1>(chunk_size)},
+                   buffer<uchar, 1>{range<1>(chunk_size)}},
+        used_buffer_{buffer<uint, 1>{range<1>(8)},
+                     buffer<uint, 1>{range<1>(8)}},
+        freq_buffer_{buffer<ushort, 1>{range<1>(kNCoders * 256)},
+                     buffer<ushort, 1>{range<1>(kNCoders * 256)}},
+        staging_{std::make_unique<uchar[]>(chunk_size),
+                 std::make_unique<uchar[]>(chunk_size)},
+        sorted_{kBlockSort ? std::make_unique<uchar[]>(chunk_size) : nullptr,
+                kBlockSort ? std::make_unique<uchar[]>(chunk_size) : nullptr},
+        store_(lane_size_) {}
+
+  // Calls sink(const MultiStream &, const uchar *input, size_t input_size)
+  // for every chunk, in input order. Returns the number of bytes encoded.
+  template <typename Sink>
+  size_t Encode(std::istream &in, Sink &&sink) {
+    return EncodeChunks<false>([&](bool slot) { return Load(in, slot); },
+                               sink);
+  }
+
+  // Same as above for the size bytes at data, which the device must be able
+  // to read: USM host memory, or any memory with system USM. The sink gets
+  // pointers into data. Block-sorted chunks are still staged.
+  template <typename Sink>
+  size_t Encode(const uchar *data, size_t size, Sink &&sink) {
+    size_t pos = 0;
+    return EncodeChunks<true>(
+        [&](bool slot) {
+          size_t n = std::min(chunk_size_, size - pos);
+          chunk_in_[slot] = data + pos;
+          pos += n;
+          if (n > 0) {
+            if constexpr (kBlockSort) {
+              h2d_event_[slot].wait();
+              SubmitBlockSorted(slot, chunk_in_[slot], n);
+            } else {
+              SubmitFindUsed(slot, n, chunk_in_[slot]);
+            }
+          }
+          return n;
+        },
+        sink);
+  }
+
+  // Sum of the coder kernel times over all encoded chunks.
+  double EncodingSeconds() const { return encoding_seconds_; }
+
+  // Counters of the model, coder and store kernels over all encoded chunks,
+  // empty without PERF_COUNTERS.
+  const PerfReport &Perf() const { return perf_; }
+
+ private:
+  size_t LaneBegin(bool slot, uint lane) const {
+    return std::min(size_t(lane) * lane_size_, chunk_bytes_[slot]);
+  }
+  uint LaneSymbols(bool slot, uint lane) const {
+    return LaneBegin(slot, lane + 1) - LaneBegin(slot, lane);
+  }
+
+  // Loads chunk k+1 with load(slot), which returns its size, while chunk k is
+  // coded.
+  template <bool kInPlace, typename Loader, typename Sink>
+  size_t EncodeChunks(Loader &&load, Sink &sink) {
+    size_t total = 0;
+    bool slot = 0;
+    chunk_bytes_[slot] = load(slot);
+    if (chunk_bytes_[slot] > 0) {
+      Launch<kInPlace>(slot);
+    }
+    while (chunk_bytes_[slot] > 0) {
+      // queue chunk k+1 behind chunk k, then drain chunk k while it runs
+      chunk_bytes_[!slot] = load(!slot);
+      if (chunk_bytes_[!slot] > 0) {
+        Launch<kInPlace>(!slot);
+      }
+      Finish(slot, sink);
+      total += chunk_bytes_[slot];
+      slot = !slot;
+    }
+    return total;
+  }
+
+  size_t Load(std::istream &in, bool slot) {
+    // the previous copy out of this staging area must be complete
+    h2d_event_[slot].wait();
+    in.read((char *)staging_[slot].get(), chunk_size_);
+    size_t size = in.gcount();
+    chunk_in_[slot] = staging_[slot].get();
+    if (size > 0 && kBlockSort) {
+      SubmitBlockSorted(slot, chunk_in_[slot], size);
+    } else if (size > 0) {
+      h2d_event_[slot] = q_.submit([&](handler &h) {
+        auto acc = fq_buffer_[slot].get_access<access::mode::write>(h);
+        h.copy(staging_[slot].get(), acc);
+      });
+      SubmitFindUsed(slot, size, fq_buffer_[slot]);
+    }
+    return size;
+  }
+
+  // Sorts every lane of the size bytes at in into sorted_[slot], one thread
+  // per lane, and copies them to the device for the FindUsedBytes pre-pass
+  // and the lanes. The sorted lanes use the same bytes.
+  void SubmitBlockSorted(bool slot, const uchar *in, size_t size) {
+    uchar *sorted = sorted_[slot].get();
+    LaneThreads workers;
+    for (uint i = 0; i < kNCoders; ++i) {
+      size_t begin = std::min(size_t(i) * lane_size_, size);
+      size_t end = std::min(begin + lane_size_, size);
+      workers.Run([=] {
+        primary_[slot][i] = BlockSort(in + begin, end - begin, sorted + begin);
+      });
+    }
+    workers.Join();
+    h2d_event_[slot] = q_.submit([&](handler &h) {
+      auto acc = fq_buffer_[slot].get_access<access::mode::write>(h);
+      h.copy(sorted, acc);
+    });
+    SubmitFindUsed(slot, size, fq_buffer_[slot]);
+  }
+
+  // Runs the FindUsedBytes pre-pass over the chunk in slot, read from its
+  // input buffer or in place from a pointer, or the ChunkHistogram one for
+  // the rANS engine.
+  template <typename In>
+  void SubmitFindUsed(bool slot, size_t size, In &in) {
+    if constexpr (kRans) {
+      SubmitHistogram(slot, size, in);
+      return;
+    }
+    q_.submit([&](handler &h) {
+      auto acc = Access(h, in);
+      auto used_acc =
+          used_buffer_[slot].get_access<access::mode::discard_write>(h);
+      h.single_task<FindUsedBytes<In>>([=] {
+        [[intel::fpga_register]] uint used[8] = {0};
+        for (uint k = 0; k < size; k += kUsedBytesWidth) {
+#pragma unroll
+          for (uint j = 0; j < kUsedBytesWidth; ++j) {
+            if (k + j < size) {
+              uchar c = acc[k + j];
+              used[c >> 5] |= 1u << (c & 31);
+            }
+          }
+        }
+#pragma unroll
+        for (uint i = 0; i < 8; ++i) {
+          used_acc[i] = used[i];
+        }
+      });
+    });
+  }
+
+  // Counts the bytes of every lane of the chunk in slot, kUsedBytesWidth per
+  // cycle, each into its own histogram so that the bytes of a cycle never
+  // update the same counter. The counts give the used bytes, the model size
+  // and the frozen table of every lane, in ranks, which go to freq_buffer_.
+  template <typename In>
+  void SubmitHistogram(bool slot, size_t size, In &in) {
+    std::array<uint, kNCoders + 1> bounds;
+    for (uint i = 0; i <= kNCoders; ++i) {
+      bounds[i] = std::min(size_t(i) * lane_size_, size);
+    }
+    q_.submit([&](handler &h) {
+      auto acc = Access(h, in);
+      auto used_acc =
+          used_buffer_[slot].get_access<access::mode::discard_write>(h);
+      auto freq_acc =
+          freq_buffer_[slot].get_access<access::mode::discard_write>(h);
+      h.single_task<ChunkHistogram<In>>([=] {
+        // a count goes from its M20K read through one add back to its
+        // write in about 3 cycles, which 4 cached writes cover
+        constexpr uint kCacheDepth = 4;
+        uint counts[kNCoders][256];
+        [[intel::fpga_register]] uint used[8] = {0};
+        for (uint i = 0; i < kNCoders; ++i) {
+          fpga_tools::OnchipMemoryWithCache<uint, 256, kCacheDepth>
+              hists[kUsedBytesWidth];
+#pragma unroll
+          for (uint j = 0; j < kUsedBytesWidth; ++j) {
+            hists[j].init(0);
+          }
+          uint end = bounds[i + 1];
+          [[intel::ivdep(kCacheDepth)]]
+          for (uint k = bounds[i]; k < end; k += kUsedBytesWidth) {
+            fpga_tools::UnrolledLoop<kUsedBytesWidth>([&](auto j) {
+              if (k + j < end) {
+                uchar c = acc[k + j];
+                hists[j].write(c, hists[j].read(c) + 1);
+              }
+            });
+          }
+          for (uint c = 0; c < 256; ++c) {
+            uint n = 0;
+#pragma unroll
+            for (uint j = 0; j < kUsedBytesWidth; ++j) {
+              n += hists[j].read(c);
+            }
+            counts[i][c] = n;
+            used[c >> 5] |= uint(n > 0) << (c & 31);
+          }
+        }
+
+        uint n_used = 0;
+        for (uint c = 0; c < 256; ++c) {
+          n_used += (used[c >> 5] >> (c & 31)) & 1;
+        }
+        uint alphabet = Alphabets::Select(n_used);
+        // the host turns a chunk no model holds down
+        uint n = alphabet == Alphabets::kCount ? 0 : Alphabets::Size(alphabet);
+        for (uint i = 0; i < kNCoders && n > 0; ++i) {
+          uint rank_counts[256] = {0};
+          ushort freqs[256];
+          for (uint c = 0, r = 0; c < 256; ++c) {
+            if ((used[c >> 5] >> (c & 31)) & 1) {
+              rank_counts[r++] = counts[i][c];
+            }
+          }
+          NormalizeFreqs(rank_counts, n, freqs);
+          for (uint s = 0; s < n; ++s) {
+            freq_acc[i * n + s] = freqs[s];
+          }
+        }
+#pragma unroll
+        for (uint i = 0; i < 8; ++i) {
+          used_acc[i] = used[i];
+        }
+      });
+    });
+  }
+
+  static auto Access(handler &h, buffer<uchar, 1> &in) {
+    return in.get_access<access::mode::read>(h);
+  }
+  static const uchar *Access(handler &h, const uchar *in) { return in; }
+
+  template <bool kInPlace>
+  void Launch(bool slot) {
+    {
+      auto used_acc = used_buffer_[slot].get_host_access();
+      std::copy(used_acc.get_pointer(), used_acc.get_pointer() + 8,
+                used_[slot].bits);
+    }
+    uint alphabet = Alphabets::Select(used_[slot].Count());
+    if (alphabet == Alphabets::kCount) {
+      throw std::runtime_error("chunk uses more symbols than any model");
+    }
+    model_symbols_[slot] = Alphabets::Size(alphabet);
+    auto ranks = used_[slot].Ranks();
+
+    if constexpr (kRunLength) {
+      fpga_tools::UnrolledLoop<kNCoders>([&](auto i) {
+        q_.single_task(RunLengthEncoder<SymbPipes::PipeAt<i>,
+                                        RunTokenPipes::PipeAt<i>>{});
+        q_.single_task(
+            AlphabetRunLengthModelKernel<RunTokenPipes::PipeAt<i>,
+                                         FrequncePipes::PipeAt<i>, Alphabets,
+                                         kOrder, Precision>{alphabet});
+      });
+    } else if constexpr (kBlockSort) {
+      fpga_tools::UnrolledLoop<kNCoders>([&](auto i) {
+        q_.single_task(
+            AlphabetMoveToFrontEncoder<SymbPipes::PipeAt<i>,
+                                       MoveToFrontPipes::PipeAt<i>, Alphabets>{
+                alphabet});
+        q_.single_task(AlphabetModelKernel<MoveToFrontPipes::PipeAt<i>,
+                                           FrequncePipes::PipeAt<i>, Alphabets,
+                                           kOrder, Precision>{alphabet});
+      });
+    } else if constexpr (!kFused && !kBinary && !kRans) {
+      fpga_tools::UnrolledLoop<kNCoders>([&](auto i) {
+        q_.single_task(
+            AlphabetModelKernel<SymbPipes::PipeAt<i>, FrequncePipes::PipeAt<i>,
+                                Alphabets, kOrder, Precision>{alphabet});
+      });
+    }
+    store_.Launch(q_, slot);
+
+    fpga_tools::UnrolledLoop<kNCoders>([&](auto i) {
+      if constexpr (kInPlace && !kBlockSort) {
+        SubmitReadSymbols<i>(slot, chunk_in_[slot], ranks);
+      } else {
+        SubmitReadSymbols<i>(slot, fq_buffer_[slot], ranks);
+      }
+    });
+    if constexpr (kFused) {
+      coder_event_[slot] = q_.single_task(
+          AlphabetFusedCoder<kNCoders, kSymbolsPerCycle, Alphabets, kOrder,
+                             Precision>{alphabet});
+    } else if constexpr (kBinary) {
+      coder_event_[slot] = q_.single_task(
+          AlphabetBinaryCoder<SymbPipes, kNCoders, Alphabets>{alphabet});
+    } else if constexpr (kRans) {
+      coder_event_[slot] = q_.submit([&](handler &h) {
+        auto freq_acc = freq_buffer_[slot].get_access<access::mode::read>(h);
+        h.single_task(
+            AlphabetRansCoder<kNCoders, kSymbolsPerCycle, Alphabets,
+                              decltype(freq_acc)>{alphabet, freq_acc});
+      });
+    } else {
+      coder_event_[slot] = q_.single_task(RangeCoder<kNCoders, Precision>{});
+    }
+  }
+
+  template <uint kLane, typename In>
+  void SubmitReadSymbols(bool slot, In &in,
+                         const std::array<uchar, 256> &ranks) {
+    uint begin = LaneBegin(slot, kLane);
+    uint end = begin + LaneSymbols(slot, kLane);
+    q_.submit([&](handler &h) {
+      auto acc = Access(h, in);
+      h.template single_task<ReadSymbols<kLane, In>>([=] {
+        if constexpr (kFused) {
+          using GroupPipes = SymbolGroupPipes<kSymbolsPerCycle>;
+          for (uint k = begin; k < end; k += kSymbolsPerCycle) {
+            SymbolGroup<kSymbolsPerCycle> group;
+#pragma unroll
+            for (uint j = 0; j < kSymbolsPerCycle; ++j) {
+              group.symbols[j] = k + j < end ? ranks[acc[k + j]] : 0;
+            }
+            group.count = std::min(end - k, kSymbolsPerCycle);
+            GroupPipes::template write<kLane>({group, false});
+          }
+          GroupPipes::template write<kLane>(true);
+        } else if constexpr (kRans) {
+          using GroupPipes = SymbolGroupPipes<kSymbolsPerCycle>;
+          for (uint k = end; k > begin;) {
+            SymbolGroup<kSymbolsPerCycle> group;
+#pragma unroll
+            for (uint j = 0; j < kSymbolsPerCycle; ++j) {
+              group.symbols[j] = j < k - begin ? ranks[acc[k - 1 - j]] : 0;
+            }
+            group.count = std::min(k - begin, kSymbolsPerCycle);
+            k -= group.count;
+            GroupPipes::template write<kLane>({group, false});
+          }
+          GroupPipes::template write<kLane>(true);
+        } else {
+          for (uint k = begin; k < end; ++k) {
+            SymbPipes::write<kLane>({ranks[acc[k]], false});
+          }
+          // the done flag travels alone so that the last symbol is coded too
+          SymbPipes::write<kLane>({0, true});
+        }
+      });
+    });
+  }
+
+  template <typename Sink>
+  void Finish(bool slot, Sink &sink) {
+    auto start = coder_event_[slot]
+                     .get_profiling_info<info::event_profiling::command_start>();
+    auto end = coder_event_[slot]
+                   .get_profiling_info<info::event_profiling::command_end>();
+    encoding_seconds_ += (end - start) / 1e9;
+
+    MultiStream stream(kNCoders, kOrder, StreamLayout::kPlain, Precision::kId,
+                       kEngine, kTransform);
+    stream.SetAlphabet(used_[slot], model_symbols_[slot]);
+    if constexpr (kRans) {
+      stream.SetRansStates(RansLaneStates(kSymbolsPerCycle));
+    }
+    {
+      auto rc_sizes = store_.rc_size_buffer[slot].get_host_access();
+      auto freq_acc = freq_buffer_[slot].get_host_access();
+      uint n_table = kRans ? model_symbols_[slot] : 0;
+      for (uint i = 0; i < kNCoders; ++i) {
+        // the rANS table or the BWT primary index leads the payload
+        const void *prefix = freq_acc.get_pointer() + i * n_table;
+        uint prefix_size = n_table * sizeof(ushort);
+        if constexpr (kBlockSort) {
+          prefix = &primary_[slot][i];
+          prefix_size = sizeof(uint);
+        }
+        stream.SetLane(
+            i, LaneSymbols(slot, i), prefix, prefix_size,
+            store_.rc_buffer[slot][i].get_host_access().get_pointer(),
+            rc_sizes[i]);
+      }
+    }
+    if constexpr (kFused) {
+      perf_.Collect<SymbolGroupPipes<kSymbolsPerCycle>>(q_, "fused coder");
+    } else if constexpr (kBinary) {
+      perf_.Collect<SymbPipes>(q_, "binary coder");
+    } else if constexpr (kRans) {
+      perf_.Collect<SymbolGroupPipes<kSymbolsPerCycle>>(q_, "rans coder");
+    } else {
+      using ModelPipes = std::conditional_t<
+          kRunLength, RunTokenPipes,
+          std::conditional_t<kBlockSort, MoveToFrontPipes, SymbPipes>>;
+      fpga_tools::UnrolledLoop<kNCoders>([&](auto i) {
+        perf_.Collect<typename ModelPipes::template PipeAt<i>>(
+            q_, "model " + std::to_string(i));
+      });
+      perf_.Collect<FrequncePipes>(q_, "coder");
+    }
+    perf_.Collect<RangePipe<kNCoders, kStoreBytes>>(q_, "store");
+    sink(stream, chunk_in_[slot], chunk_bytes_[slot]);
+  }
+
+  queue &q_;
+  size_t chunk_size_;
+  size_t lane_size_;
+  buffer<uchar, 1> fq_buffer_[2];
+  buffer<uint, 1> used_buffer_[2];
+  // the rANS tables, in the layout of the lane payloads
+  buffer<ushort, 1> freq_buffer_[2];
+  std::unique_ptr<uchar[]> staging_[2];
+  // the block-sorted lanes of a slot and their primary indices
+  std::unique_ptr<uchar[]> sorted_[2];
+  uint primary_[2][kNCoders];
+  // where the sink finds the input of a slot
+  const uchar *chunk_in_[2] = {nullptr, nullptr};
+  size_t chunk_bytes_[2] = {0, 0};
+  UsedBytes used_[2];
+  uint model_symbols_[2];
+  event h2d_event_[2];
+  event coder_event_[2];
+  double encoding_seconds_ = 0;
+  PerfReport perf_;
+  DoubleBufferingStore<kNCoders, kStoreBytes> store_;
+};
+
+#endif  // STREAM_ENCODER_HPP_